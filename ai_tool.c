@@ -26,6 +26,7 @@
 #include <ai_tts.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <uv.h>
 #include <uv_async_queue.h>
@@ -179,6 +180,8 @@ static void aitool_asr_callback(asr_event_t event, const asr_result_t* result, v
         printf("Asr cancel\n");
     } else if (event == asr_event_closed) {
         printf("Asr closed\n");
+    } else if (event == asr_event_partial_delta) {
+        printf("Asr delta: keep %d definite %d +%s\n", result->stable_len, result->definite_len, result->result);
     } else {
         printf("Unknown event: %d\n", event);
     }
@@ -235,6 +238,7 @@ CMD0(create_asr_engine)
     asr_init_params_t param;
     int i;
 
+    memset(&param, 0, sizeof(param));
     for (i = 0; i < AITOOL_MAX_CHAIN; i++) {
         if (!aitool->chain[i].handle) {
             param.loop = &aitool->loop;
@@ -49,6 +49,12 @@ typedef struct asr_init_params {
     const char* rec_mode; // short long
     const char* language; // zh-CN
     int silence_timeout; // 3000ms
+    int packet_duration; // 100ms, 20-200ms of audio per upload packet
+    int packet_adaptive; // 1: resize packets to the link, starting from packet_duration
+    int partial_delta; // 1: report partial results as asr_event_partial_delta
+    int vad_hangover; // 500ms of trailing silence that ends the utterance, -1: no local vad
+    int preroll; // 0: recorder opens on start, else ms of idle capture kept for the next start, up to 2000
+    ai_audio_process_t audio; // recorder preprocessing, zeroed: off
 } asr_init_params_t;
 
 typedef enum {
@@ -59,6 +65,7 @@ typedef enum {
     asr_event_complete,
     asr_event_error,
     asr_event_closed,
+    asr_event_partial_delta, // result holds only the text after stable_len
 } asr_event_t;
 
 typedef enum {
@@ -72,6 +79,8 @@ typedef struct asr_result {
     char* result;
     int duration;
     asr_error_t error_code;
+    int stable_len; // bytes kept from the previous transcript, partial_delta only
+    int definite_len; // leading bytes of the transcript the server marked final
 } asr_result_t;
 
 typedef struct asr_audio_info {
@@ -79,6 +79,7 @@ typedef struct conversation_audio_info {
     int sample_rate; // 16000
     int channels; // 1
     int sample_bit; // 16
+    ai_audio_process_t process; // recorder preprocessing, zeroed: off
 } conversation_audio_info_t;
 
 typedef void (*conversation_callback_t)(conversation_event_t event, 
@@ -35,6 +35,23 @@ typedef struct ai_volc_auth {
     const char* app_key;
 } ai_volc_auth_t;
 
+/* Recorder audio preprocessing, the stages run in the order listed */
+
+#define AI_AUDIO_DOWNMIX 0x01 // stereo capture to mono
+#define AI_AUDIO_RESAMPLE 0x02 // decimate to the engine rate, integer factors 2-6
+#define AI_AUDIO_DC_REMOVE 0x04
+#define AI_AUDIO_DENOISE 0x08 // attenuate 10ms blocks close to the noise floor
+#define AI_AUDIO_GAIN 0x10 // fixed gain_db
+#define AI_AUDIO_AGC 0x20 // pull speech towards agc_level_db
+
+typedef struct ai_audio_process {
+    int stages; // AI_AUDIO_* bits, 0: recorder audio reaches the engine untouched
+    int sample_rate; // capture rate, 0: the engine rate
+    int channels; // capture channels, 0: the engine channels
+    int gain_db; // -20 to 30
+    int agc_level_db; // rms target in dBFS, 0: -20
+} ai_audio_process_t;
+
 #ifdef __cplusplus
 }
 #endif
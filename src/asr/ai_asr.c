@@ -31,13 +31,29 @@
 #include <uv_async_queue.h>
 
 #include "ai_asr.h"
+#include "ai_arena.h"
+#include "ai_audio_chain.h"
 #include "ai_asr_internal.h"
+#include "ai_cmd_queue.h"
 #include "ai_common.h"
+#include "ai_frame_pool.h"
+#include "ai_ring_buffer.h"
+#include "ai_vad.h"
 #include "ai_voice_plugin.h"
 
 #define ASR_DEFAULT_SILENCE_TIMEOUT 3000
 #define ASR_MIN_SILENCE_TIMEOUT 300
 #define ASR_MAX_SILENCE_TIMEOUT 15000
+#define ASR_DEFAULT_PACKET_DURATION 100
+#define ASR_MIN_PACKET_DURATION 20
+#define ASR_MAX_PACKET_DURATION 200
+#define ASR_DEFAULT_VAD_HANGOVER 500
+#define ASR_MIN_VAD_HANGOVER 200
+#define ASR_MAX_VAD_HANGOVER 3000
+#define ASR_MAX_PREROLL 2000
+#define ASR_QUEUE_DEPTH 16
+#define ASR_FORMAT_MAX 96
+#define ASR_ARENA_CHUNK 256
 
 /****************************************************************************
  * Private Types
@@ -54,17 +70,35 @@ typedef struct asr_context {
     uv_loop_t* loop;
     uv_loop_t* user_loop;
     uv_async_queue_t* asyncq;
-    uv_async_queue_t user_asyncq;
+    ai_cmd_queue_t* cmdq; // commands for the engine loop
+    ai_cmd_queue_t* user_cmdq; // callbacks for the user loop
     uv_pipe_t* pipe;
-    char* format;
+    char* reserved; // read buffer lent by plugin->reserve_audio
+    char* format; // lives in arena
+    ai_arena_t arena; // session scoped allocations
     asr_callback_t cb;
     void* cookie;
     asr_state_t state;
     int is_send_finished;
     int is_closed;
     voice_init_params_t voice_param;
-    char last_result[1024];
+    int partial_delta;
+    char* transcript; // full text of the latest result
+    size_t transcript_len;
+    size_t transcript_size;
     int64_t last_result_time;
+    int vad_hangover; // 0 when local vad is off
+    int vad_active; // the recorder format is one the vad can read
+    ai_vad_t vad;
+    int preroll; // ms of idle capture handed to the next session, 0 when off
+    size_t preroll_bytes; // preroll in bytes of the capture format
+    int frame_bytes; // bytes per sample frame of the capture format
+    int capture_phase; // bytes read so far modulo frame_bytes
+    ai_ring_buffer_t preroll_ring; // newest idle capture, the oldest is dropped
+    ai_audio_process_t audio;
+    ai_audio_chain_t* chain; // NULL without preprocessing
+    int chain_active; // the recorder captures in the chain's input format
+    char capture_format[ASR_FORMAT_MAX];
 } asr_context_t;
 
 typedef enum {
@@ -75,53 +109,42 @@ typedef enum {
     ASR_MESSAGE_CANCEL,
     ASR_MESSAGE_IS_BUSY,
     ASR_MESSAGE_CLOSE,
-    ASR_MESSAGE_CB
+    ASR_MESSAGE_CB,
+    ASR_MESSAGE_PREROLL
 } message_id_t;
 
-typedef int (*message_handler_t)(void* message_data);
-
-typedef struct message_s {
-    message_id_t message_id;
-    message_handler_t message_handler;
-    void* message_data;
-} message_t;
-
 typedef struct message_data_listener_s {
-    asr_context_t* ctx;
     asr_callback_t cb;
     void* cookie;
 } message_data_listener_t;
 
 typedef struct message_data_start_s {
-    asr_context_t* ctx;
-    asr_audio_info_t audio_info;
+    int version;
+    char format[ASR_FORMAT_MAX];
 } message_data_start_t;
 
-typedef struct message_data_finish_s {
-    asr_context_t* ctx;
-} message_data_finish_t;
-
-typedef struct message_data_cancel_s {
-    asr_context_t* ctx;
-} message_data_cancel_t;
-
-typedef struct message_data_is_busy_s {
-    asr_context_t* ctx;
-} message_data_is_busy_t;
-
-typedef struct message_data_close_s {
-    asr_context_t* ctx;
-} message_data_close_t;
-
 typedef struct message_data_cb_s {
-    asr_context_t* ctx;
     voice_event_t event;
-    asr_result_t* result;
+    int has_result;
+    asr_result_t result; // result text is malloced
 } message_data_cb_t;
 
+/* Messages are copied by value into the command queues */
+
+typedef struct message_s {
+    message_id_t message_id;
+    asr_context_t* ctx;
+    union {
+        message_data_listener_t listener;
+        message_data_start_t start;
+        message_data_cb_t cb;
+    } data;
+} message_t;
+
 static void ai_asr_voice_callback(voice_event_t event, const voice_result_t* result, void* cookie);
 static int ai_asr_close_handler(asr_context_t* ctx);
-static void ai_asr_send_callback(asr_context_t* ctx, voice_event_t event, asr_result_t* result);
+static int ai_asr_finish_handler(asr_context_t* ctx);
+static void ai_asr_send_callback(asr_context_t* ctx, voice_event_t event, const asr_result_t* result);
 
 /****************************************************************************
  * Private Functions
@@ -137,24 +160,93 @@ static int64_t ai_asr_gettime_relative(void)
 static void alloc_read_buffer(uv_handle_t* handle, size_t suggested_size,
     uv_buf_t* buf)
 {
-    buf->base = (char*)calloc(1, suggested_size);
-    buf->len = suggested_size;
+    asr_context_t* ctx = uv_handle_get_data(handle);
+    int len = 0;
+
+    /* Let the recorder read straight into the engine's audio buffer,
+     * idle pre-roll capture and preprocessed audio only go to pool frames */
+    if (ctx->plugin->reserve_audio && ctx->state == ASR_STATE_START && !ctx->chain_active)
+        len = ctx->plugin->reserve_audio(ctx->engine, &buf->base, suggested_size);
+
+    if (len > 0) {
+        ctx->reserved = buf->base;
+        buf->len = len;
+        return;
+    }
+
+    /* Otherwise borrow a pool frame, or a heap one when the pool is out:
+     * an empty buffer makes libuv report UV_ENOBUFS with the data still
+     * readable, so the loop would spin on it until a frame comes back */
+    if (suggested_size > AI_FRAME_MEDIUM_SIZE)
+        suggested_size = AI_FRAME_MEDIUM_SIZE;
+
+    buf->base = ai_frame_buf_alloc_fallback(suggested_size);
+    buf->len = buf->base ? suggested_size : 0;
+
+    /* The chain may put a carried partial frame in front of the data */
+    if (buf->base && ctx->chain_active)
+        buf->len -= AI_AUDIO_CHAIN_HEADROOM;
+}
+
+/* 本地VAD判定说话结束: 停止录音让引擎收尾，最终结果和complete由引擎回调带回 */
+
+static void ai_asr_vad_endpoint(asr_context_t* ctx)
+{
+    if (ctx->state != ASR_STATE_START)
+        return;
+
+    AI_INFO("ai_asr vad endpoint after %dms of silence", ctx->vad_hangover);
+    ctx->state = ASR_STATE_FINISH;
+    ctx->vad_active = 0;
+    ai_asr_finish_handler(ctx);
 }
 
 static void read_buffer_cb(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf)
 {
     asr_context_t* ctx = uv_handle_get_data((uv_handle_t*)client);
-    ctx->plugin->write_audio(ctx->engine, buf->base, nread);
+    ai_vad_state_t vad = AI_VAD_SILENCE;
     static int count = 0;
+
     if (count % 20 == 0)
         AI_INFO("asr recorder read audio data: %d\n", nread);
     count++;
-    free(buf->base);
+
+    if (buf->base == NULL)
+        return;
+
+    /* Everything below sees audio in the engine format */
+    if (nread > 0 && ctx->chain_active)
+        nread = ai_audio_chain_process(ctx->chain, buf->base, nread);
+
+    if (nread > 0 && ctx->frame_bytes)
+        ctx->capture_phase = (ctx->capture_phase + nread) % ctx->frame_bytes;
+
+    /* The vad reads the pcm before the engine takes it */
+    if (nread > 0 && ctx->vad_active && ctx->state == ASR_STATE_START)
+        vad = ai_vad_process(&ctx->vad, buf->base, nread);
+
+    if (buf->base == ctx->reserved) {
+        ctx->reserved = NULL;
+        if (nread > 0)
+            ctx->plugin->commit_audio(ctx->engine, nread);
+    } else if (ctx->state != ASR_STATE_START) {
+        /* 空闲时只保留最近的预录音频，等下一次start交给引擎 */
+        if (nread > 0 && ctx->preroll_ring.buffer)
+            ai_ring_buffer_queue_arr(&ctx->preroll_ring, buf->base, nread);
+        ai_frame_buf_free(buf->base);
+    } else {
+        if (nread > 0)
+            ctx->plugin->write_audio(ctx->engine, buf->base, nread);
+        ai_frame_buf_free(buf->base);
+    }
+
+    if (vad == AI_VAD_END)
+        ai_asr_vad_endpoint(ctx);
 }
 
 static void ai_asr_send_error(asr_context_t* ctx, asr_error_t error)
 {
-    voice_result_t result;
+    voice_result_t result = { 0 };
 
     result.duration = 0;
     result.result = NULL;
@@ -237,10 +329,11 @@ static void media_recorder_event_callback(void* cookie, int event, int ret,
 
 static void ai_asr_destroy_engine(asr_context_t* ctx)
 {
-    if (ctx->format) {
-        free(ctx->format);
-        ctx->format = NULL;
-    }
+    ctx->format = NULL;
+    ai_arena_release(&ctx->arena);
+    ai_ring_buffer_free(&ctx->preroll_ring);
+    free(ctx->chain);
+    free(ctx->transcript);
 
     if (ctx->engine) {
         voice_plugin_uninit(ctx->plugin, ctx->engine, 0);
@@ -251,27 +344,36 @@ static void ai_asr_destroy_engine(asr_context_t* ctx)
     ctx = NULL;
 }
 
-static void ai_asr_uvasyncq_close_cb(uv_handle_t* handle)
+static void ai_asr_user_cmdq_close_cb(void* data)
 {
-    asr_context_t* ctx = uv_handle_get_data((const uv_handle_t*)handle);
+    asr_context_t* ctx = data;
 
     ai_asr_destroy_engine(ctx);
-    AI_INFO("ai_asr_uvasyncq_close_cb");
+    AI_INFO("ai_asr_user_cmdq_close_cb");
 }
 
 static void ai_asr_close_async(asr_context_t* ctx)
 {
-    uv_handle_set_data((uv_handle_t*)&(ctx->user_asyncq), ctx);
-    uv_close((uv_handle_t*)&(ctx->user_asyncq), ai_asr_uvasyncq_close_cb);
+    ai_cmd_queue_t* user_cmdq = ctx->user_cmdq;
+
+    ctx->user_cmdq = NULL;
+    ai_cmd_queue_close(user_cmdq, ai_asr_user_cmdq_close_cb);
 }
 
 static int ai_asr_close_handler(asr_context_t* ctx)
 {
+    ai_cmd_queue_t* cmdq;
     int ret = 0;
 
     if (ctx == NULL)
         return -EINVAL;
 
+    /* Nothing reaches the engine loop after close. Clear the pointer
+     * first so new senders see NULL, close waits for the ones inside */
+    cmdq = ctx->cmdq;
+    ctx->cmdq = NULL;
+    ai_cmd_queue_close(cmdq, NULL);
+
     ai_asr_send_callback(ctx, voice_event_closed, NULL);
 
     AI_INFO("ai_asr_close_handler");
@@ -285,7 +387,8 @@ static int ai_asr_finish_handler(asr_context_t* ctx)
     if (ctx == NULL)
         return -EINVAL;
 
-    if (ctx->handle != NULL) {
+    /* The pre-roll recorder keeps running until close */
+    if (ctx->handle != NULL && !ctx->preroll) {
         ret = media_uv_recorder_close(ctx->handle, media_recorder_close_cb);
         if (ret < 0)
             AI_INFO("close recorder failed:%d", ret);
@@ -300,6 +403,13 @@ static int ai_asr_finish_handler(asr_context_t* ctx)
     if (ctx->engine != NULL)
         ret = ctx->plugin->finish(ctx->engine);
 
+    if (ctx->chain_active)
+        ai_audio_chain_report(ctx->chain, "ai_asr");
+
+    AI_INFO("ai_asr session arena used:%zu peak:%zu", ctx->arena.used, ctx->arena.peak);
+    ctx->format = NULL;
+    ai_arena_reset(&ctx->arena);
+
     AI_INFO("ai_asr_finish_handler");
 
     return ret;
@@ -317,27 +427,36 @@ static void ai_asr_focus_callback(int suggestion, void* cookie)
     AI_INFO("asr recorder focus suggestion:%d", suggestion);
 }
 
-static int ai_asr_init_recorder(asr_context_t* ctx)
+static int ai_asr_request_focus(asr_context_t* ctx)
 {
-    const char* format = ctx->format;
     int init_suggestion;
-    char* stream = "cap";
-    void* handle = NULL;
 
     ctx->focus_handle = media_focus_request(&init_suggestion, MEDIA_SCENARIO_TTS, ai_asr_focus_callback, ctx);
     if (init_suggestion != MEDIA_FOCUS_PLAY && ctx->focus_handle) {
         AI_INFO("asr recorder focus failed");
         media_focus_abandon(ctx->focus_handle);
         ctx->focus_handle = NULL;
-        goto failed;
+        return -EPERM;
     }
 
+    return 0;
+}
+
+static int ai_asr_open_recorder(asr_context_t* ctx, const char* format)
+{
+    char* stream = "cap";
+    void* handle = NULL;
+
     handle = media_uv_recorder_open(ctx->loop, stream, media_recorder_open_cb, ctx);
     if (handle == NULL) {
         AI_INFO("asr recorder open failed");
         goto failed;
     }
 
+    /* From here on the recorder reports its close through
+     * media_recorder_close_cb, close_l has to wait for it */
+    ctx->is_closed = false;
+
     int ret = media_uv_recorder_listen(handle, media_recorder_event_callback);
     if (ret < 0) {
         AI_INFO("asr recorder listen failed");
@@ -354,27 +473,63 @@ static int ai_asr_init_recorder(asr_context_t* ctx)
     }
 
     ctx->handle = handle;
-    AI_INFO("ai_asr_init_recorder %p\n", ctx->handle);
+    AI_INFO("ai_asr_open_recorder %p\n", ctx->handle);
 
     return 0;
 failed:
     return -EPERM;
 }
 
-static int ai_asr_callback_l(void* message_data)
+/* With preprocessing the recorder captures in the chain's input format
+ * and the chain turns that into the engine format */
+
+static const char* ai_asr_capture_format(asr_context_t* ctx, const char* format)
+{
+    int sample_rate;
+    int channels;
+    int ret;
+
+    ctx->chain_active = 0;
+    if (ctx->chain == NULL)
+        return format;
+
+    ret = ai_audio_parse_format(format, &sample_rate, &channels);
+    if (ret >= 0)
+        ret = ai_audio_chain_init(ctx->chain, &ctx->audio, sample_rate, channels);
+    if (ret >= 0)
+        ret = ai_audio_chain_capture_format(ctx->chain, ctx->capture_format, sizeof(ctx->capture_format));
+    if (ret < 0) {
+        AI_WARN("ai_asr audio chain off for %s:%d", format, ret);
+        return format;
+    }
+
+    ctx->chain_active = 1;
+    return ctx->capture_format;
+}
+
+static int ai_asr_init_recorder(asr_context_t* ctx)
 {
-    message_data_cb_t* data = (message_data_cb_t*)message_data;
-    asr_context_t* ctx = data->ctx;
+    int ret;
+
+    ret = ai_asr_request_focus(ctx);
+    if (ret < 0)
+        return ret;
+
+    return ai_asr_open_recorder(ctx, ai_asr_capture_format(ctx, ctx->format));
+}
+
+static int ai_asr_callback_l(message_t* message)
+{
+    message_data_cb_t* data = &message->data.cb;
+    asr_context_t* ctx = message->ctx;
     asr_event_t event = data->event;
-    asr_result_t* asr_result = data->result;
+    asr_result_t* asr_result = data->has_result ? &data->result : NULL;
 
     if (ctx->cb)
         ctx->cb(event, asr_result, ctx->cookie);
 
-    if (asr_result) {
+    if (asr_result)
         free(asr_result->result);
-        free(asr_result);
-    }
 
     if (event == asr_event_closed) {
         if (ctx->user_loop)
@@ -386,28 +541,81 @@ static int ai_asr_callback_l(void* message_data)
     return 0;
 }
 
-static void ai_asr_send_callback(asr_context_t* ctx, voice_event_t event, asr_result_t* result)
+static void ai_asr_send_callback(asr_context_t* ctx, voice_event_t event, const asr_result_t* result)
 {
-    message_data_cb_t* cb = (message_data_cb_t*)malloc(sizeof(message_data_cb_t));
-    cb->ctx = ctx;
-    cb->event = event;
-    cb->result = result;
-    if (ctx->user_loop) {
-        message_t* message = (message_t*)malloc(sizeof(message_t));
-        message->message_id = ASR_MESSAGE_CB;
-        message->message_handler = ai_asr_callback_l;
-        message->message_data = cb;
-        uv_async_queue_send(&(ctx->user_asyncq), message);
-    } else {
-        ai_asr_callback_l(cb);
-        free(cb);
+    message_t message = { 0 };
+    int ret;
+
+    message.message_id = ASR_MESSAGE_CB;
+    message.ctx = ctx;
+    message.data.cb.event = event;
+    if (result) {
+        message.data.cb.has_result = 1;
+        message.data.cb.result = *result;
+    }
+
+    if (ctx->user_loop == NULL) {
+        ai_asr_callback_l(&message);
+        return;
+    }
+
+    /* A full transcript is superseded by the next one, so only those may be
+     * dropped; deltas and the final events fall back to the heap */
+    if (event == voice_event_result)
+        ret = ai_cmd_queue_send(ctx->user_cmdq, &message, sizeof(message));
+    else
+        ret = ai_cmd_queue_post(ctx->user_cmdq, &message, sizeof(message));
+
+    if (ret < 0) {
+        AI_ERR("ai_asr callback event %d dropped:%d", event, ret);
+        if (result)
+            free(result->result);
     }
 }
 
+/* Keep the full transcript and return how many leading bytes the new
+ * text shares with the previous one, backed off to a UTF-8 boundary */
+
+static size_t ai_asr_update_transcript(asr_context_t* ctx, const char* text, size_t len)
+{
+    size_t stable = 0;
+    size_t size;
+    char* grown;
+
+    while (stable < len && stable < ctx->transcript_len && text[stable] == ctx->transcript[stable])
+        stable++;
+    while (stable > 0 && stable < len && (text[stable] & 0xc0) == 0x80)
+        stable--;
+
+    if (len + 1 > ctx->transcript_size) {
+        size = ctx->transcript_size ? ctx->transcript_size : 256;
+        while (size < len + 1)
+            size *= 2;
+        grown = realloc(ctx->transcript, size);
+        if (grown == NULL) {
+            AI_WARN("ai_asr no memory for a %zu byte transcript", len + 1);
+            ctx->transcript_len = 0;
+            return 0;
+        }
+        ctx->transcript = grown;
+        ctx->transcript_size = size;
+    }
+
+    memcpy(ctx->transcript + stable, text + stable, len - stable + 1);
+    ctx->transcript_len = len;
+
+    return stable;
+}
+
 static void ai_asr_voice_callback(voice_event_t event, const voice_result_t* result, void* cookie)
 {
     asr_context_t* ctx = cookie;
     asr_result_t* asr_result = NULL;
+    asr_result_t cb_result = { 0 };
+    const char* text;
+    size_t old_len;
+    size_t stable;
+    size_t len;
 
     if (ctx->cb == NULL)
         return;
@@ -416,34 +624,48 @@ static void ai_asr_voice_callback(voice_event_t event, const voice_result_t* res
         return;
 
     if (result) {
-        asr_result = (asr_result_t*)malloc(sizeof(asr_result_t));
-        if (result->result != NULL) {
-            asr_result->result = (char*)malloc(strlen(result->result) + 1);
-            strlcpy(asr_result->result, result->result, strlen(result->result) + 1);
-        } else
-            asr_result->result = NULL;
+        asr_result = &cb_result;
         asr_result->duration = result->duration;
+        asr_result->definite_len = result->definite_len;
         if (result->error_code != 0)
             asr_result->error_code = asr_error_failed;
         else
             asr_result->error_code = 0;
         AI_INFO("ai_asr_voice_callback:%s", result->result);
 
-        if (asr_result->result != NULL) {
-                    if (strcmp(ctx->last_result, asr_result->result) == 0 && ctx->last_result_time != 0 && (ai_asr_gettime_relative() - ctx->last_result_time) > ctx->voice_param.silence_timeout * 1000) {
-            AI_INFO("ai_asr_voice_callback timeout: %s %d", asr_result->result, ctx->voice_param.silence_timeout);
-                free(asr_result->result);
-                free(asr_result);
+        if (result->result != NULL) {
+            len = strlen(result->result);
+            old_len = ctx->transcript_len;
+            stable = ai_asr_update_transcript(ctx, result->result, len);
+
+            if (stable == len && len == old_len && ctx->last_result_time != 0
+                && (ai_asr_gettime_relative() - ctx->last_result_time) > ctx->voice_param.silence_timeout * 1000) {
+                AI_INFO("ai_asr_voice_callback timeout: %s %d", result->result, ctx->voice_param.silence_timeout);
                 ai_asr_voice_callback(voice_event_complete, NULL, ctx);
                 ctx->is_send_finished = true;
                 return;
             }
 
-            if (strcmp(ctx->last_result, asr_result->result) || ctx->last_result_time == 0) {
-                strlcpy(ctx->last_result, asr_result->result, sizeof(ctx->last_result));
+            if (stable != len || len != old_len || ctx->last_result_time == 0) {
                 ctx->last_result_time = ai_asr_gettime_relative();
-                AI_INFO("ai_asr_voice_callback first time:%s", ctx->last_result);
+                AI_INFO("ai_asr_voice_callback first time:%s", result->result);
+            }
+
+            /* 增量模式下只把变化的尾部交给上层 */
+            text = result->result;
+            if (ctx->partial_delta && event == voice_event_result) {
+                event = voice_event_partial_delta;
+                asr_result->stable_len = stable;
+                text += stable;
+                len -= stable;
             }
+
+            /* Text has no size bound, the frame pool is kept for audio */
+            asr_result->result = malloc(len + 1);
+            if (asr_result->result != NULL)
+                memcpy(asr_result->result, text, len + 1);
+            else
+                AI_WARN("ai_asr no memory for a %zu byte result", len + 1);
         }
     }
 
@@ -456,17 +678,78 @@ static void ai_asr_voice_callback(voice_event_t event, const voice_result_t* res
     ai_asr_send_callback(ctx, event, asr_result);
 }
 
+static int ai_asr_set_listener_l(message_t* message);
+static int ai_asr_start_l(message_t* message);
+static int ai_asr_finish_l(message_t* message);
+static int ai_asr_cancel_l(message_t* message);
+static int ai_asr_close_l(message_t* message);
+static int ai_asr_preroll_l(message_t* message);
+
+static void ai_asr_message_cb(void* data, void* cmd)
+{
+    message_t* message = cmd;
+
+    switch (message->message_id) {
+    case ASR_MESSAGE_LISTENER:
+        ai_asr_set_listener_l(message);
+        break;
+    case ASR_MESSAGE_START:
+        ai_asr_start_l(message);
+        break;
+    case ASR_MESSAGE_FINISH:
+        ai_asr_finish_l(message);
+        break;
+    case ASR_MESSAGE_CANCEL:
+        ai_asr_cancel_l(message);
+        break;
+    case ASR_MESSAGE_CLOSE:
+        ai_asr_close_l(message);
+        break;
+    case ASR_MESSAGE_CB:
+        ai_asr_callback_l(message);
+        break;
+    case ASR_MESSAGE_PREROLL:
+        ai_asr_preroll_l(message);
+        break;
+    default:
+        AI_WARN("ai_asr unknown message:%d", message->message_id);
+        break;
+    }
+}
+
+static void ai_asr_message_discard(void* data, void* cmd)
+{
+    message_t* message = cmd;
+
+    if (message->message_id == ASR_MESSAGE_CB && message->data.cb.has_result)
+        free(message->data.cb.result.result);
+}
+
 static void ai_asr_async_cb(uv_async_queue_t* handle, void* data)
 {
-    AI_INFO("ai_asr_async_cb");
+    asr_context_t* ctx = handle->data;
+    int ret;
+
+    /* The plugin queue only carries the request to attach the command
+     * queue to the engine loop, everything else goes through cmdq */
+    ret = ai_cmd_queue_attach(data, ctx->loop);
+    AI_INFO("ai_asr_async_cb attach:%d", ret);
+}
+
+static int ai_asr_send_message(asr_context_t* ctx, message_t* message)
+{
+    ai_cmd_queue_t* cmdq = ctx->cmdq;
+    int ret;
 
-    message_t* message = (message_t*)data;
+    /* Read once, close clears it before the queue goes away */
+    if (cmdq == NULL)
+        return -EPIPE;
 
-    if (message->message_handler)
-        message->message_handler(message->message_data);
+    ret = ai_cmd_queue_send(cmdq, message, sizeof(message_t));
+    if (ret < 0)
+        AI_WARN("ai_asr message %d not queued:%d", message->message_id, ret);
 
-    free(message->message_data);
-    free(message);
+    return ret;
 }
 
 static int ai_asr_map_params(asr_context_t* ctx, const asr_init_params_t* in_param, const ai_auth_t* auth,
@@ -487,6 +770,29 @@ static int ai_asr_map_params(asr_context_t* ctx, const asr_init_params_t* in_par
         out_param->silence_timeout = ASR_MIN_SILENCE_TIMEOUT;
     else
         out_param->silence_timeout = ASR_DEFAULT_SILENCE_TIMEOUT;
+    if (in_param->packet_duration > ASR_MAX_PACKET_DURATION)
+        out_param->packet_duration = ASR_MAX_PACKET_DURATION;
+    else if (in_param->packet_duration < ASR_MIN_PACKET_DURATION && in_param->packet_duration != 0)
+        out_param->packet_duration = ASR_MIN_PACKET_DURATION;
+    else if (in_param->packet_duration == 0)
+        out_param->packet_duration = ASR_DEFAULT_PACKET_DURATION;
+    else
+        out_param->packet_duration = in_param->packet_duration;
+    out_param->packet_adaptive = in_param->packet_adaptive;
+    if (in_param->vad_hangover < 0)
+        ctx->vad_hangover = 0;
+    else if (in_param->vad_hangover == 0)
+        ctx->vad_hangover = ASR_DEFAULT_VAD_HANGOVER;
+    else if (in_param->vad_hangover < ASR_MIN_VAD_HANGOVER)
+        ctx->vad_hangover = ASR_MIN_VAD_HANGOVER;
+    else if (in_param->vad_hangover > ASR_MAX_VAD_HANGOVER)
+        ctx->vad_hangover = ASR_MAX_VAD_HANGOVER;
+    else
+        ctx->vad_hangover = in_param->vad_hangover;
+    if (in_param->preroll > ASR_MAX_PREROLL)
+        ctx->preroll = ASR_MAX_PREROLL;
+    else if (in_param->preroll > 0)
+        ctx->preroll = in_param->preroll;
     out_param->cb = ai_asr_async_cb;
     out_param->opaque = ctx;
     if (auth->engine_type == asr_engine_type_volc) {
@@ -506,10 +812,10 @@ static int ai_asr_map_params(asr_context_t* ctx, const asr_init_params_t* in_par
     return 0;
 }
 
-static int ai_asr_set_listener_l(void* message_data)
+static int ai_asr_set_listener_l(message_t* message)
 {
-    message_data_listener_t* data = (message_data_listener_t*)message_data;
-    asr_context_t* ctx = data->ctx;
+    message_data_listener_t* data = &message->data.listener;
+    asr_context_t* ctx = message->ctx;
     asr_callback_t callback = data->cb;
     void* cookie = data->cookie;
 
@@ -526,28 +832,64 @@ static int ai_asr_set_listener_l(void* message_data)
 
 static int ai_asr_create_format(asr_context_t* ctx, const char* format)
 {
-    int len;
-
     if (!format)
         return -EINVAL;
 
-    len = strlen(format) + 1;
-    char* temp = (char*)realloc(ctx->format, len);
-    if (temp == NULL) {
+    ctx->format = ai_arena_strdup(&ctx->arena, format);
+    if (ctx->format == NULL)
         return -ENOMEM;
-    }
-    ctx->format = temp;
-    strlcpy(ctx->format, format, len);
 
     return 0;
 }
 
-static int ai_asr_start_l(void* message_data)
+/* The local vad and the pre-roll window only understand s16le */
+
+static void ai_asr_init_vad(asr_context_t* ctx)
 {
-    message_data_start_t* data = (message_data_start_t*)message_data;
-    asr_context_t* ctx = data->ctx;
-    const asr_audio_info_t* audio_info = &data->audio_info;
+    int sample_rate;
+    int channels;
+
+    ctx->vad_active = 0;
+    if (ctx->vad_hangover <= 0 || ai_audio_parse_format(ctx->format, &sample_rate, &channels) < 0)
+        return;
+
+    ctx->vad_active = ai_vad_init(&ctx->vad, sample_rate, channels, ctx->vad_hangover) == 0;
+}
+
+/* Hand the idle capture to the engine ahead of the live audio. The ring
+ * holds a little more than the window, the extra and any partial sample
+ * frame at its head are dropped so the stream stays frame aligned. */
+
+static void ai_asr_flush_preroll(asr_context_t* ctx)
+{
+    ai_ring_buffer_t* ring = &ctx->preroll_ring;
+    size_t items = ai_ring_buffer_num_items(ring);
+    size_t keep = items;
+    size_t skew;
+    char* data;
+    size_t len;
+
+    if (keep > ctx->preroll_bytes)
+        keep = ctx->preroll_bytes;
+    skew = (keep + ctx->frame_bytes - ctx->capture_phase) % ctx->frame_bytes;
+    keep = keep > skew ? keep - skew : 0;
+    ai_ring_buffer_clear_arr(ring, items - keep);
+
+    AI_INFO("ai_asr pre-roll %zu bytes", keep);
+    while ((len = ai_ring_buffer_peek_contiguous(ring, &data)) > 0) {
+        if (ctx->vad_active)
+            ai_vad_process(&ctx->vad, data, len);
+        ctx->plugin->write_audio(ctx->engine, data, len);
+        ai_ring_buffer_consume(ring, len);
+    }
+}
+
+static int ai_asr_start_l(message_t* message)
+{
+    message_data_start_t* data = &message->data.start;
+    asr_context_t* ctx = message->ctx;
     voice_env_params_t* env;
+    asr_state_t state;
     int ret = 0;
 
     AI_INFO("ai_asr_start_l before");
@@ -560,33 +902,56 @@ static int ai_asr_start_l(void* message_data)
         return 0;
     }
 
+    ai_arena_reset(&ctx->arena);
+    ctx->format = NULL;
+
+    /* A running pre-roll recorder keeps its capture format */
     env = ctx->plugin->get_env(ctx->engine);
-    if (audio_info && audio_info->format && !env->force_format) {
-        ret = ai_asr_create_format(ctx, audio_info->format);
-        free(audio_info->format);
-    } else {
+    if (data->format[0] != '\0' && !env->force_format && ctx->handle == NULL)
+        ret = ai_asr_create_format(ctx, data->format);
+    else
         ret = ai_asr_create_format(ctx, env->format);
-    }
     if (ret < 0)
         return ret;
 
-    memset(ctx->last_result, 0, sizeof(ctx->last_result));
+    ai_asr_init_vad(ctx);
+    ctx->transcript_len = 0;
     ctx->last_result_time = 0;
+    state = ctx->state;
     ctx->state = ASR_STATE_START;
     ctx->is_send_finished = false;
-    ctx->is_closed = false;
 
-    ret = ctx->plugin->start(ctx->engine, NULL);
+    if (ctx->preroll && ctx->handle != NULL) {
+        ret = ai_asr_request_focus(ctx);
+        if (ret < 0)
+            goto failed;
+
+        ret = ctx->plugin->start(ctx->engine, NULL);
+        if (ret < 0)
+            goto failed;
+
+        ai_asr_flush_preroll(ctx);
+        ai_asr_voice_callback(voice_event_start, NULL, ctx);
+        AI_INFO("ai_asr_start_l with pre-roll");
+        return ret;
+    }
+
+    /* Open the recorder first so capture starts right away. The plugin
+     * connects in the background and buffers audio until the server
+     * has taken the session request. */
+    ret = ai_asr_init_recorder(ctx);
     if (ret < 0)
         goto failed;
 
-    ret = ai_asr_init_recorder(ctx);
+    ret = ctx->plugin->start(ctx->engine, NULL);
     if (ret < 0)
-        return ret;
+        goto failed;
 
     ret = media_uv_recorder_start(ctx->handle, media_recorder_start_cb, ctx);
-    if (ret < 0)
+    if (ret < 0) {
+        ctx->plugin->cancel(ctx->engine);
         goto failed;
+    }
 
     ai_asr_voice_callback(voice_event_start, NULL, ctx);
 
@@ -594,16 +959,26 @@ static int ai_asr_start_l(void* message_data)
 
     return ret;
 failed:
-    AI_INFO("ai_asr_start_l failed");
-    media_uv_recorder_close(ctx->handle, media_recorder_close_cb);
-    ctx->handle = NULL;
+    AI_INFO("ai_asr_start_l failed:%d", ret);
+
+    /* Back to where start found it, so a later start or close is taken */
+    ctx->state = state;
+    if (ctx->focus_handle != NULL) {
+        media_focus_abandon(ctx->focus_handle);
+        ctx->focus_handle = NULL;
+    }
+
+    /* The pre-roll recorder keeps running until close */
+    if (ctx->handle != NULL && !ctx->preroll) {
+        media_uv_recorder_close(ctx->handle, media_recorder_close_cb);
+        ctx->handle = NULL;
+    }
     return ret;
 }
 
-static int ai_asr_finish_l(void* message_data)
+static int ai_asr_finish_l(message_t* message)
 {
-    message_data_finish_t* data = (message_data_finish_t*)message_data;
-    asr_context_t* ctx = data->ctx;
+    asr_context_t* ctx = message->ctx;
     int ret;
 
     AI_INFO("ai_asr_finish_l");
@@ -614,16 +989,15 @@ static int ai_asr_finish_l(void* message_data)
     }
     ctx->state = ASR_STATE_FINISH;
 
-    ret = ai_asr_finish_handler(data->ctx);
-    ai_asr_voice_callback(voice_event_complete, NULL, data->ctx);
+    ret = ai_asr_finish_handler(ctx);
+    ai_asr_voice_callback(voice_event_complete, NULL, ctx);
 
     return ret;
 }
 
-static int ai_asr_cancel_l(void* message_data)
+static int ai_asr_cancel_l(message_t* message)
 {
-    message_data_cancel_t* data = (message_data_cancel_t*)message_data;
-    asr_context_t* ctx = data->ctx;
+    asr_context_t* ctx = message->ctx;
     int ret;
 
     AI_INFO("ai_asr_cancel_l");
@@ -635,15 +1009,14 @@ static int ai_asr_cancel_l(void* message_data)
     ctx->state = ASR_STATE_CANCEL;
 
     ctx->is_send_finished = true;
-    ret = ai_asr_finish_handler(data->ctx);
+    ret = ai_asr_finish_handler(ctx);
 
     return ret;
 }
 
-static int ai_asr_close_l(void* message_data)
+static int ai_asr_close_l(message_t* message)
 {
-    message_data_close_t* data = (message_data_close_t*)message_data;
-    asr_context_t* ctx = data->ctx;
+    asr_context_t* ctx = message->ctx;
 
     AI_INFO("ai_asr_close_l");
 
@@ -653,6 +1026,11 @@ static int ai_asr_close_l(void* message_data)
     }
     ctx->state = ASR_STATE_CLOSE;
 
+    if (ctx->handle != NULL) {
+        media_uv_recorder_close(ctx->handle, media_recorder_close_cb);
+        ctx->handle = NULL;
+    }
+
     if (ctx->is_closed)
         ai_asr_close_handler(ctx);
     else
@@ -661,6 +1039,58 @@ static int ai_asr_close_l(void* message_data)
     return 0;
 }
 
+/* Always-on capture: the recorder runs from create to close without the
+ * media focus, which is only taken for a session */
+
+static int ai_asr_preroll_l(message_t* message)
+{
+    asr_context_t* ctx = message->ctx;
+    voice_env_params_t* env;
+    int sample_rate;
+    int channels;
+    size_t size;
+    int ret;
+
+    if (ctx->state != ASR_STATE_INIT || ctx->handle != NULL)
+        return 0;
+
+    env = ctx->plugin->get_env(ctx->engine);
+    ret = ai_audio_parse_format(env->format, &sample_rate, &channels);
+    if (ret < 0) {
+        AI_WARN("ai_asr no pre-roll for format %s", env->format);
+        goto failed;
+    }
+
+    ctx->frame_bytes = channels * sizeof(int16_t);
+    ctx->preroll_bytes = (size_t)sample_rate * ctx->preroll / 1000 * ctx->frame_bytes;
+    for (size = 1; size <= ctx->preroll_bytes; size <<= 1)
+        ;
+    ret = ai_ring_buffer_alloc(&ctx->preroll_ring, size, 0);
+    if (ret < 0)
+        goto failed;
+
+    ret = ai_asr_open_recorder(ctx, ai_asr_capture_format(ctx, env->format));
+    if (ret < 0)
+        goto failed;
+
+    ret = media_uv_recorder_start(ctx->handle, media_recorder_start_cb, ctx);
+    if (ret < 0) {
+        media_uv_recorder_close(ctx->handle, media_recorder_close_cb);
+        ctx->handle = NULL;
+        goto failed;
+    }
+
+    AI_INFO("ai_asr pre-roll %dms, %zu bytes", ctx->preroll, ctx->preroll_bytes);
+
+    return 0;
+failed:
+    AI_WARN("ai_asr pre-roll off:%d", ret);
+    ai_ring_buffer_free(&ctx->preroll_ring);
+    ctx->preroll = 0;
+    ctx->frame_bytes = 0;
+    return ret;
+}
+
 /****************************************************************************
  * Public Functions
  ****************************************************************************/
@@ -700,29 +1130,43 @@ asr_handle_t ai_asr_create_engine_l(const asr_init_params_t* param, const ai_aut
         return NULL;
     ctx->is_closed = true;
     ctx->state = ASR_STATE_INIT;
+    ai_arena_init(&ctx->arena, ASR_ARENA_CHUNK);
+
+    ctx->cmdq = ai_cmd_queue_create(sizeof(message_t), ASR_QUEUE_DEPTH,
+        ai_asr_message_cb, ai_asr_message_discard, ctx);
+    if (ctx->cmdq == NULL)
+        goto failed;
 
     ctx->user_loop = param->loop;
     if (param->loop) {
-        ctx->user_asyncq.data = ctx;
-        ret = uv_async_queue_init(param->loop, &ctx->user_asyncq, ai_asr_async_cb);
-        if (ret < 0) {
-            free(ctx);
-            return NULL;
-        }
+        ctx->user_cmdq = ai_cmd_queue_create(sizeof(message_t), ASR_QUEUE_DEPTH,
+            ai_asr_message_cb, ai_asr_message_discard, ctx);
+        if (ctx->user_cmdq == NULL)
+            goto failed;
+
+        ret = ai_cmd_queue_attach(ctx->user_cmdq, param->loop);
+        if (ret < 0)
+            goto failed;
+    }
+
+    if (param->audio.stages) {
+        ctx->audio = param->audio;
+        ctx->chain = zalloc(sizeof(ai_audio_chain_t));
+        if (ctx->chain == NULL)
+            AI_WARN("ai_asr no memory for the audio chain");
     }
 
     ctx->plugin = plugin;
+    ctx->partial_delta = param->partial_delta;
     ret = ai_asr_map_params(ctx, param, auth, &ctx->voice_param);
     if (ret < 0) {
-        free(ctx);
         AI_INFO("ai_asr_create_engine auth error");
-        return NULL;
+        goto failed;
     }
     ctx->engine = voice_plugin_init(plugin, &ctx->voice_param);
     if (ctx->engine == NULL) {
-        free(ctx);
         AI_INFO("ai_asr_create_engine failed");
-        return NULL;
+        goto failed;
     }
 
     env = ctx->plugin->get_env(ctx->engine);
@@ -731,13 +1175,28 @@ asr_handle_t ai_asr_create_engine_l(const asr_init_params_t* param, const ai_aut
 
     AI_INFO("ai_asr_create_engine:%p", ctx->loop);
 
-    if (ctx->loop == NULL) {
+    if (ctx->loop == NULL || ctx->asyncq == NULL
+        || uv_async_queue_send(ctx->asyncq, ctx->cmdq) < 0) {
         voice_plugin_uninit(plugin, ctx->engine, 1);
-        free(ctx);
-        return NULL;
+        goto failed;
+    }
+
+    if (ctx->preroll) {
+        message_t message = { 0 };
+
+        message.message_id = ASR_MESSAGE_PREROLL;
+        message.ctx = ctx;
+        ai_asr_send_message(ctx, &message);
     }
 
     return ctx;
+
+failed:
+    ai_cmd_queue_close(ctx->user_cmdq, NULL);
+    ai_cmd_queue_close(ctx->cmdq, NULL);
+    free(ctx->chain);
+    free(ctx);
+    return NULL;
 }
 
 asr_handle_t ai_asr_create_engine(const asr_init_params_t* param)
@@ -759,81 +1218,73 @@ int ai_asr_set_listener(asr_handle_t handle, asr_callback_t callback, void* cook
 {
     asr_context_t* ctx = (asr_context_t*)handle;
 
-    AI_INFO("ai_asr_set_listener:%p", ctx->asyncq);
+    message_t message = { 0 };
+
+    AI_INFO("ai_asr_set_listener:%p", ctx->cmdq);
 
-    if (ctx == NULL || ctx->engine == NULL || ctx->asyncq == NULL)
+    if (ctx == NULL || ctx->engine == NULL || ctx->cmdq == NULL)
         return -1;
 
-    message_t* message = (message_t*)malloc(sizeof(message_t));
-    message_data_listener_t* data = (message_data_listener_t*)calloc(1, sizeof(message_data_listener_t));
-    data->ctx = ctx;
-    data->cb = callback;
-    data->cookie = cookie;
-    message->message_id = ASR_MESSAGE_LISTENER;
-    message->message_handler = ai_asr_set_listener_l;
-    message->message_data = data;
-    return uv_async_queue_send(ctx->asyncq, message);
+    message.message_id = ASR_MESSAGE_LISTENER;
+    message.ctx = ctx;
+    message.data.listener.cb = callback;
+    message.data.listener.cookie = cookie;
+    return ai_asr_send_message(ctx, &message);
 }
 
 int ai_asr_start(asr_handle_t handle, const asr_audio_info_t* audio_info)
 {
     asr_context_t* ctx = (asr_context_t*)handle;
 
-    AI_INFO("ai_asr_start:%p", ctx->asyncq);
+    message_t message = { 0 };
 
-    if (ctx == NULL || ctx->engine == NULL || ctx->asyncq == NULL)
+    AI_INFO("ai_asr_start:%p", ctx->cmdq);
+
+    if (ctx == NULL || ctx->engine == NULL || ctx->cmdq == NULL)
         return -EINVAL;
 
-    message_t* message = (message_t*)malloc(sizeof(message_t));
-    message_data_start_t* data = (message_data_start_t*)calloc(1, sizeof(message_data_start_t));
-    data->ctx = ctx;
+    message.message_id = ASR_MESSAGE_START;
+    message.ctx = ctx;
     if (audio_info) {
-        data->audio_info.version = audio_info->version;
-        if (audio_info->format && strlen(audio_info->format) > 0) {
-            data->audio_info.format = (char*)malloc(strlen(audio_info->format) + 1);
-            strlcpy(data->audio_info.format, audio_info->format, strlen(audio_info->format) + 1);
-        }
+        message.data.start.version = audio_info->version;
+        if (audio_info->format && strlen(audio_info->format) >= ASR_FORMAT_MAX)
+            return -EINVAL;
+        if (audio_info->format)
+            strlcpy(message.data.start.format, audio_info->format, ASR_FORMAT_MAX);
     }
-    message->message_id = ASR_MESSAGE_START;
-    message->message_handler = ai_asr_start_l;
-    message->message_data = data;
-    return uv_async_queue_send(ctx->asyncq, message);
+    return ai_asr_send_message(ctx, &message);
 }
 
 int ai_asr_finish(asr_handle_t handle)
 {
     asr_context_t* ctx = (asr_context_t*)handle;
 
+    message_t message = { 0 };
+
     AI_INFO("ai_asr_finish");
 
-    if (ctx == NULL || ctx->asyncq == NULL)
+    if (ctx == NULL || ctx->cmdq == NULL)
         return -EINVAL;
 
-    message_t* message = (message_t*)malloc(sizeof(message_t));
-    message_data_finish_t* data = (message_data_finish_t*)calloc(1, sizeof(message_data_finish_t));
-    data->ctx = ctx;
-    message->message_id = ASR_MESSAGE_FINISH;
-    message->message_handler = ai_asr_finish_l;
-    message->message_data = data;
-    return uv_async_queue_send(ctx->asyncq, message);
+    message.message_id = ASR_MESSAGE_FINISH;
+    message.ctx = ctx;
+    return ai_asr_send_message(ctx, &message);
 }
 
 int ai_asr_cancel(asr_handle_t handle)
 {
     asr_context_t* ctx = (asr_context_t*)handle;
 
+    message_t message = { 0 };
+
     AI_INFO("ai_asr_cancel");
 
-    if (ctx == NULL || ctx->asyncq == NULL)
+    if (ctx == NULL || ctx->cmdq == NULL)
         return -EINVAL;
 
-    message_t* message = (message_t*)malloc(sizeof(message_t));
-    message_data_cancel_t* data = (message_data_cancel_t*)calloc(1, sizeof(message_data_cancel_t));
-    data->ctx = ctx;
-    message->message_id = ASR_MESSAGE_CANCEL;
-    message->message_handler = ai_asr_cancel_l;
-    message->message_data = data;
-    return uv_async_queue_send(ctx->asyncq, message);
+    message.message_id = ASR_MESSAGE_CANCEL;
+    message.ctx = ctx;
+    return ai_asr_send_message(ctx, &message);
 }
 
 int ai_asr_is_busy(asr_handle_t handle)
@@ -842,7 +1293,7 @@ int ai_asr_is_busy(asr_handle_t handle)
 
     AI_INFO("ai_asr_is_busy");
 
-    if (ctx == NULL || ctx->handle == NULL || ctx->engine == NULL || ctx->asyncq == NULL)
+    if (ctx == NULL || ctx->handle == NULL || ctx->engine == NULL || ctx->cmdq == NULL)
         return -EINVAL;
 
     return 0;
@@ -852,19 +1303,16 @@ int ai_asr_close(asr_handle_t handle)
 {
     asr_context_t* ctx = (asr_context_t*)handle;
 
+    message_t message = { 0 };
+
     AI_INFO("ai_asr_close");
 
-    if (ctx == NULL || ctx->asyncq == NULL)
+    if (ctx == NULL || ctx->cmdq == NULL)
         return -EINVAL;
 
-    message_t* message = (message_t*)malloc(sizeof(message_t));
-    message_data_close_t* data = (message_data_close_t*)calloc(1, sizeof(message_data_close_t));
-    data->ctx = ctx;
-    message->message_id = ASR_MESSAGE_CLOSE;
-    message->message_handler = ai_asr_close_l;
-    message->message_data = data;
-
-    return uv_async_queue_send(ctx->asyncq, message);
+    message.message_id = ASR_MESSAGE_CLOSE;
+    message.ctx = ctx;
+    return ai_asr_send_message(ctx, &message);
 }
 
 asr_state_t ai_asr_get_state(asr_handle_t handle)
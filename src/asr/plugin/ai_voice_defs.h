@@ -31,6 +31,7 @@ typedef enum {
     voice_event_complete,
     voice_event_error,
     voice_event_closed,
+    voice_event_partial_delta,
 } voice_event_t;
 
 typedef enum {
@@ -49,6 +50,7 @@ typedef struct voice_result {
     const char* result;
     int duration;
     voice_error_t error_code;
+    int definite_len; // leading bytes of result covered by final utterances
 } voice_result_t;
 
 typedef struct voice_audio_info {
@@ -68,6 +70,8 @@ typedef struct voice_init_params {
     const char* rec_mode;
     const char* language;
     int silence_timeout;
+    int packet_duration;
+    int packet_adaptive;
     const char* app_id;
     const char* app_key;
     ai_uvasyncq_cb_t cb;
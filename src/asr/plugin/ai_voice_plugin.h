@@ -32,6 +32,8 @@ typedef struct voice_plugin_s {
     int (*event_cb)(void* engine, voice_callback_t callback, void* cookie);
     int (*start)(void* engine, const voice_audio_info_t* audio_info);
     int (*write_audio)(void* engine, const char* data, int len);
+    int (*reserve_audio)(void* engine, char** data, int len); // optional, zero-copy write_audio
+    int (*commit_audio)(void* engine, int len);
     int (*finish)(void* engine);
     int (*cancel)(void* engine);
     voice_env_params_t* (*get_env)(void* engine);
@@ -22,26 +22,33 @@
  * Included Files
  ****************************************************************************/
 
-#include <archive.h>
-#include <archive_entry.h>
 #include <errno.h>
 #include <json_object.h>
-#include <json_tokener.h>
 #include <libwebsockets.h>
+#ifdef CONFIG_AI_VOLC_ASR_OPUS
+#include <opus.h>
+#endif
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 #include <uuid.h>
 #include <uv.h>
 #include <uv_async_queue.h>
 
+#include "ai_arena.h"
+#include "ai_cmd_queue.h"
 #include "ai_common.h"
+#include "ai_json_scan.h"
+#include "ai_net_cache.h"
 #include "ai_ring_buffer.h"
 #include "ai_voice_plugin.h"
+#include "ai_zlib.h"
 
 #define VOLC_PROTOCOL_VERSION 0x01
 #define VOLC_DEFAULT_HEADER_SIZE 0x01
@@ -69,29 +76,96 @@
 #define VOLC_PATH "/api/v3/sauc/bigmodel"
 #define VOLC_CLIENT_PROTOCOL_NAME ""
 
-#define VOLC_HEADER_LEN 12
+#define VOLC_HEADER_LEN 12 // header + sequence + payload size
 #define VOLC_TIMEOUT 1000 // milliseconds
-#define VOLC_SILENCE_TIMEOUT 200000 // microseconds
-#define VOLC_BUFFER_MAX_SIZE 128 * 1024
+#define VOLC_EOS_TIMEOUT 3000 // milliseconds to wait for the final result
+#define VOLC_BUFFER_MAX_SIZE 128 * 1024 // send ring growth cap, also bounds the pre-roll, ~4s of 16k mono
+#define VOLC_BUFFER_PACKETS 8 // the send ring starts with room for this many packets
+#define VOLC_RING_MIN_SIZE 1024
+#define VOLC_ARENA_CHUNK 2048
+
+#define VOLC_PACKET_MIN 20 // milliseconds of audio per upload packet
+#define VOLC_PACKET_MAX 200
+#define VOLC_PACKET_STEP 20
+#define VOLC_RTT_LOW 80 // milliseconds, below this packets shrink
+#define VOLC_RTT_HIGH 300 // milliseconds, above this packets grow
+
+#ifdef CONFIG_AI_VOLC_ASR_SEND_BURST
+#define VOLC_SEND_BURST CONFIG_AI_VOLC_ASR_SEND_BURST
+#else
+#define VOLC_SEND_BURST 4 // packets per writable callback while catching up
+#endif
 
 #define VOLC_LOOP_INTERVAL 10000
+#define VOLC_HOST_QUEUE_DEPTH 64 // pending session attach/detach requests, senders block beyond this
+#define VOLC_PING_INTERVAL 20 // seconds of silence before lws pings an idle socket
+
+#ifdef CONFIG_AI_VOLC_ASR_PREWARM
+#define VOLC_PREWARM 1
+#else
+#define VOLC_PREWARM 0
+#endif
+
+#ifdef CONFIG_AI_VOLC_ASR_RESUME_WINDOW
+#define VOLC_RESUME_WINDOW CONFIG_AI_VOLC_ASR_RESUME_WINDOW
+#else
+#define VOLC_RESUME_WINDOW 2000 // milliseconds of sent audio kept for replay, 0 disables resume
+#endif
+
+#ifdef CONFIG_AI_VOLC_ASR_OPUS
+#define VOLC_OPUS_FRAME_MS CONFIG_AI_VOLC_ASR_OPUS_FRAME_MS
+#define VOLC_OPUS_BITRATE CONFIG_AI_VOLC_ASR_OPUS_BITRATE
+#define VOLC_OPUS_MAX_PACKET 4000 // bytes, enough for 120ms at 510kbit/s
+#define VOLC_OGG_HEADER_LEN 27
+#define VOLC_OGG_PAGE_MAX (VOLC_OGG_HEADER_LEN + 255) // page header with a full lacing table
+#define VOLC_OGG_OVERHEAD 512 // the OpusHead and OpusTags pages plus one page header
+#define VOLC_OGG_BOS 0x02
+#define VOLC_OGG_EOS 0x04
+#endif
 
 /****************************************************************************
  * Private Types
  ****************************************************************************/
 struct volc_context;
 
+/* 结束流程: finish后先把环形缓冲里剩下的音频发完，再发负序号的尾包，
+ * 然后等服务端返回最终结果再关连接，eos_timer兜底超时 */
+enum volc_eos_state {
+    VOLC_EOS_NONE,
+    VOLC_EOS_FLUSH, // draining the ring before the last packet
+    VOLC_EOS_SENT, // last packet sent, waiting for the final result
+};
+
 struct volc_lws_state {
-    struct volc_context* ctx;
-    struct lws_context* lws_ctx;
+    struct volc_host* host;
+    struct volc_context* ctx; // NULL while the connection is the host spare
     struct lws* wsi;
+    bool established; // websocket handshake done
+    bool session; // handed to a session, spare connections stay idle
+    bool closing; // session finished, close on next writable
+    bool acked; // server answered the session request, audio may flow
+    enum volc_eos_state eos;
     int seq;
+    int packet_ms; // current upload packet duration
+    uint32_t srtt; // smoothed milliseconds from a packet to the next response
+    uint64_t sent_at; // loop time of the oldest unanswered packet, 0 if none
+#ifdef CONFIG_AI_VOLC_ASR_OPUS
+    OpusEncoder* opus; // set when the session uploads opus instead of raw pcm
+    int16_t* opus_pcm; // one frame of pcm taken from the ring
+    uint32_t ogg_serial;
+    uint32_t ogg_seq; // pages written, 0 until the stream headers went out
+    uint64_t ogg_granule; // 48 kHz samples encoded so far
+#endif
     ai_ring_buffer_t buffer;
     unsigned char* payload;
     char connect_id[37]; // 存储UUID字符串
     unsigned char* recv_buf;
     unsigned char* recv_buf_ptr;
     int recv_buf_size;
+    ai_arena_t arena; // 单次会话内的解析结果，每帧处理完后重置
+    ai_zlib_t zlib; // gzip state kept for the whole connection
+    unsigned char* send_buf; // LWS_PRE headroom + the largest frame sent so far
+    size_t send_buf_size; // usable bytes after the headroom
 };
 
 typedef struct {
@@ -108,14 +182,18 @@ typedef struct {
     int code;
     char* error_msg;
     char* text;
+    int definite; // the newest utterance is final
+    int definite_len; // bytes of text covered by the leading final utterances
+    long definite_ms; // end time of the leading final utterances
     int completed;
 } volc_response_result;
 
 typedef struct volc_context {
     voice_callback_t cb;
     void* cookie;
-    pthread_t thread;
-    uv_loop_t loop;
+    struct volc_host* host; // engine thread shared by every session
+    struct volc_context* next; // host session list
+    uv_loop_t* loop; // the host loop
     uv_async_queue_t* asyncq;
     ai_uvasyncq_cb_t uvasyncq_cb;
     void* opaque;
@@ -124,12 +202,78 @@ typedef struct volc_context {
     bool is_running;
     bool is_finished;
     bool is_closed;
-    struct volc_lws_state* state;
+    bool is_attached; // handles live on the host loop
+    bool is_detached; // uninit reached the host, freed once conns and handles are gone
+    atomic_int attach_state; // VOLC_ATTACH_*, init and the host race on it after a timeout
+    int conns; // connection states still pointing at this session
+    int closing_handles;
+    struct volc_lws_state* state; // connection of the running session
+    uv_timer_t eos_timer; // bounds the wait for the final result
+    uv_timer_t resume_timer; // reconnects a session after a network drop
+    uint16_t resume_count; // reconnects used by the running session
+    ai_ring_buffer_t replay; // tail of the audio already sent in this session
+    uint64_t sent_pos; // stream bytes sent, the replay ring ends here
+    uint64_t session_pos; // stream byte where the current connection started
+    long commit_ms; // final audio of the current connection, server time
+    char* transcript; // text of earlier connections followed by the latest result
+    size_t transcript_size;
+    size_t prefix_len; // bytes of transcript fixed by earlier connections
+    size_t commit_len; // bytes of transcript that are final so far
+    int packet_ms; // configured upload packet duration
+    bool packet_adaptive;
     voice_audio_info_t audio_info;
     char* app_id;
     char* app_key;
 } volc_context_t;
 
+/* 所有会话共用一个引擎线程: 一个uv loop和一个lws_context驱动全部连接，
+ * 每个会话只有自己的连接、环形缓冲、序号、定时器和回调，按需分配；
+ * 预连的空闲连接也挂在宿主上，会话多少都只有一条 */
+typedef struct volc_host {
+    pthread_t thread;
+    uv_loop_t loop;
+    sem_t sem;
+    atomic_int start_state; // VOLC_HOST_*, the thread and acquire race on it after a timeout
+    sem_t slots; // free cmdq slots, posted back as the loop handles each command
+    bool running;
+    bool stopping;
+    struct lws_context* lws_ctx;
+    ai_cmd_queue_t* cmdq; // session attach/detach, sent from any thread
+    volc_context_t* sessions; // attached sessions, loop thread only
+    size_t count;
+    int refs; // sessions holding the host, under g_volc_host_lock
+    struct volc_lws_state* spare; // pre-warmed connection for the next session
+    uv_timer_t prewarm_timer;
+    uint16_t retry_count;
+    char* app_id; // credentials the spare is opened with
+    char* app_key;
+} volc_host_t;
+
+enum {
+    VOLC_HOST_ATTACH,
+    VOLC_HOST_DETACH,
+};
+
+/* 等待超时后由先改状态的一方决定归属: 放弃的会话由宿主detach释放，
+ * 放弃的宿主由它自己的线程释放 */
+enum {
+    VOLC_ATTACH_PENDING,
+    VOLC_ATTACH_DONE,
+    VOLC_ATTACH_ABANDONED,
+};
+
+enum {
+    VOLC_HOST_STARTING,
+    VOLC_HOST_READY,
+    VOLC_HOST_FAILED,
+    VOLC_HOST_ABANDONED,
+};
+
+typedef struct {
+    int type;
+    volc_context_t* ctx;
+} volc_host_cmd_t;
+
 typedef struct {
     int pb_code;
     voice_error_t voice_code;
@@ -140,6 +284,28 @@ static voice_err_code_t errcode_map[] = {
     { 0, 0, NULL },
 };
 
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static pthread_mutex_t g_volc_host_lock = PTHREAD_MUTEX_INITIALIZER;
+static volc_host_t* g_volc_host;
+
+static const uint32_t volc_backoff_ms[] = { 1000, 2000, 5000, 10000, 30000, 60000 };
+
+/* 会话中途断网后的重连间隔，次数用完才上报网络错误 */
+static const uint32_t volc_resume_ms[] = { 0, 500, 2000 };
+
+/* 空闲连接靠ping保活，建连失败时按表退避重试，重试次数用完后等下次start再连 */
+static const lws_retry_bo_t volc_retry_policy = {
+    .retry_ms_table = volc_backoff_ms,
+    .retry_ms_table_count = LWS_ARRAY_SIZE(volc_backoff_ms),
+    .conceal_count = LWS_ARRAY_SIZE(volc_backoff_ms),
+    .secs_since_valid_ping = VOLC_PING_INTERVAL,
+    .secs_since_valid_hangup = VOLC_PING_INTERVAL + 10,
+    .jitter_percent = 20,
+};
+
 /****************************************************************************
  * Private Functions
  ****************************************************************************/
@@ -167,87 +333,117 @@ int volc_bytes_to_int(const unsigned char* bytes)
     return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
 }
 
-__attribute__((used)) static int volc_gzip_compress(const unsigned char* input, size_t input_len, unsigned char** output, size_t* output_len)
+static void volc_generate_message_header(char* header,
+    uint8_t message_type,
+    uint8_t sequence_flag,
+    uint8_t serialization,
+    uint8_t compression)
+{
+    header[0] = VOLC_PROTOCOL_VERSION << 4 | VOLC_DEFAULT_HEADER_SIZE;
+    header[1] = message_type << 4 | sequence_flag;
+    header[2] = serialization << 4 | compression;
+    header[3] = 0;
+}
+
+static char* volc_gunzip_payload(struct volc_lws_state* state, const unsigned char* data, size_t* len)
 {
-    struct archive* a;
-    struct archive_entry* entry;
-    size_t used;
+    size_t size = ai_zlib_gunzip_size(data, *len);
+    ssize_t ret;
+    char* out;
 
-    a = archive_write_new();
-    archive_write_add_filter_gzip(a);
-    archive_write_set_format_raw(a);
-    archive_write_open_memory(a, *output, *output_len, &used);
+    if (size == 0 || size > VOLC_BUFFER_MAX_SIZE)
+        return NULL;
 
-    entry = archive_entry_new();
-    archive_entry_set_size(entry, input_len);
-    archive_write_header(a, entry);
-    archive_write_data(a, input, input_len);
-    archive_write_finish_entry(a);
+    out = ai_arena_alloc(&state->arena, size + 1);
+    if (out == NULL)
+        return NULL;
 
-    archive_entry_free(entry);
-    archive_write_close(a);
-    archive_write_free(a);
+    ret = ai_zlib_gunzip(&state->zlib, data, *len, out, size);
+    if (ret < 0) {
+        AI_WARN("asr_volc gunzip payload failed:%zd\n", ret);
+        return NULL;
+    }
+    out[ret] = '\0';
+    *len = ret;
 
-    *output_len = used;
-    return ARCHIVE_OK;
+    return out;
 }
 
-static int volc_gzip_decompress(const unsigned char* input, size_t input_len, unsigned char** output, size_t* output_len)
+/* 只扫描用到的字段，文本直接从收包缓冲解码进arena，不建json树 */
+
+static char* volc_scan_string(struct volc_lws_state* state, const ai_json_value_t* value)
 {
-    struct archive* a;
-    struct archive_entry* entry;
-    int ret;
+    char* str;
+
+    if (value->type != AI_JSON_STRING)
+        return NULL;
 
-    a = archive_read_new();
-    archive_read_support_format_raw(a);
-    archive_read_support_filter_gzip(a);
+    str = ai_arena_alloc(&state->arena, value->len);
+    if (str == NULL || ai_json_scan_string(value, str, value->len) < 0)
+        return NULL;
 
-    ret = archive_read_open_memory(a, input, input_len);
-    if (ret != ARCHIVE_OK) {
-        return ret;
+    return str;
+}
+
+static void volc_scan_result(struct volc_lws_state* state, const char* json, size_t len, volc_response_result* result)
+{
+    ai_json_value_t utterances;
+    ai_json_value_t utterance;
+    const char* cursor = NULL;
+    ai_json_value_t object;
+    ai_json_value_t value;
+    bool leading = true;
+    bool definite;
+    ssize_t text_len;
+    long code;
+
+    if (ai_json_scan(json, len, "code", &value) == 0 && ai_json_scan_int(&value, &code) == 0 && code != 0) {
+        result->code = code;
+        if (ai_json_scan(json, len, "message", &value) == 0)
+            result->error_msg = volc_scan_string(state, &value);
     }
 
-    while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
-        *output_len = archive_entry_size(entry);
-        *output = malloc(*output_len);
-        ret = archive_read_data(a, *output, *output_len);
-        if (ret != ARCHIVE_OK) {
-            *output_len = 0;
-            free(*output);
-            return ret;
+    if (ai_json_scan(json, len, "result", &object) < 0)
+        return;
+
+    if (ai_json_scan_member(&object, "text", &value) == 0)
+        result->text = volc_scan_string(state, &value);
+
+    if (ai_json_scan_member(&object, "utterances", &utterances) == 0) {
+        while (ai_json_scan_next(&utterances, &cursor, &utterance) == 1) {
+            definite = false;
+            if (ai_json_scan_member(&utterance, "definite", &value) == 0)
+                ai_json_scan_bool(&value, &definite);
+            result->definite = definite;
+
+            /* 开头连续已确定的分句不会再变，上层可以直接固定 */
+            leading = leading && definite;
+            if (leading && ai_json_scan_member(&utterance, "text", &value) == 0) {
+                text_len = ai_json_scan_string(&value, NULL, 0);
+                if (text_len > 0)
+                    result->definite_len += text_len;
+                if (ai_json_scan_member(&utterance, "end_time", &value) == 0)
+                    ai_json_scan_int(&value, &result->definite_ms);
+            }
         }
     }
-
-    archive_read_free(a);
-    return ARCHIVE_OK;
 }
 
-static void volc_generate_message_header(char* header,
-    uint8_t message_type,
-    uint8_t sequence_flag,
-    uint8_t serialization,
-    uint8_t compression)
-{
-    header[0] = VOLC_PROTOCOL_VERSION << 4 | VOLC_DEFAULT_HEADER_SIZE;
-    header[1] = message_type << 4 | sequence_flag;
-    header[2] = serialization << 4 | compression;
-    header[3] = 0;
-}
+/* Returns 0 for a result, -EPROTO for an error the server reported and
+ * -EBADMSG for a frame that can't be decoded */
 
-static int volc_parse_response(const unsigned char* res, size_t length, volc_response_result* result)
+static int volc_parse_response(struct volc_lws_state* state, const unsigned char* res, size_t length, volc_response_result* result)
 {
-    struct json_object* result_obj;
-    struct json_object* result_text;
-    const char* result_text_str;
-    size_t output_len = 0;
+    const char* payload;
     size_t payload_len;
-    char* payloadStr = NULL;
-
-    if (res == NULL || length == 0)
-        return -1;
 
     memset(result, 0, sizeof(volc_response_result));
 
+    if (res == NULL || length < VOLC_HEADER_LEN) {
+        AI_WARN("asr_volc short frame:%zu\n", length);
+        return -EBADMSG;
+    }
+
     const unsigned char num = 0b00001111;
     result->protocol_version = (res[0] >> 4) & num;
     result->header_size = res[0] & 0x0f;
@@ -265,13 +461,20 @@ static int volc_parse_response(const unsigned char* res, size_t length, volc_res
     memcpy(temp, res + 8, sizeof(temp));
     result->payload_size = volc_bytes_to_int(temp);
 
-    payload_len = length - VOLC_HEADER_LEN;
-    result->payload = malloc(payload_len + 1);
-    if (result->payload == NULL) {
-        return -1;
+    if (result->payload_size < 0 || (size_t)result->payload_size > length - VOLC_HEADER_LEN) {
+        AI_WARN("asr_volc payload size %d over frame %zu\n", result->payload_size, length);
+        return -EBADMSG;
     }
-    memcpy(result->payload, res + VOLC_HEADER_LEN, payload_len);
-    result->payload[payload_len] = '\0';
+
+    payload_len = result->payload_size;
+    if (result->message_compression == VOLC_GZIP)
+        payload = result->payload = volc_gunzip_payload(state, res + VOLC_HEADER_LEN, &payload_len);
+    else if (result->message_type != VOLC_FULL_SERVER_RESPONSE)
+        payload = result->payload = ai_arena_memdup(&state->arena, res + VOLC_HEADER_LEN, payload_len);
+    else
+        payload = (const char*)res + VOLC_HEADER_LEN; // scanned in place in the receive buffer
+    if (payload == NULL)
+        return -EBADMSG;
 
     if (result->message_type_specific_flags == VOLC_NEG_SEQUENCE
         || result->message_type_specific_flags == VOLC_NEG_WITH_SEQUENCE) {
@@ -280,35 +483,15 @@ static int volc_parse_response(const unsigned char* res, size_t length, volc_res
 
     switch (result->message_type) {
     case VOLC_FULL_SERVER_RESPONSE:
-        if (result->message_compression == VOLC_GZIP) {
-            volc_gzip_decompress(res + VOLC_HEADER_LEN, payload_len, (unsigned char**)&payloadStr, &output_len);
-            payload_len = output_len;
-            free(payloadStr);
-        } else {
-            payloadStr = result->payload;
-        }
-
-        struct json_object* parsed_json = json_tokener_parse(payloadStr);
-        json_object_object_get_ex(parsed_json, "result", &result_obj);
-        json_object_object_get_ex(result_obj, "text", &result_text);
-        result_text_str = json_object_get_string(result_text);
-        if (result_text_str == NULL) {
-            json_object_put(parsed_json);
-            break;
-        }
-        result->text = (char*)malloc(strlen(result_text_str) + 1);
-        if (result->text != NULL)
-            strlcpy(result->text, result_text_str, strlen(result_text_str) + 1);
-        json_object_put(parsed_json);
+        volc_scan_result(state, payload, payload_len, result);
         break;
 
     case VOLC_SERVER_ACK:
-        payloadStr = result->payload;
-        AI_INFO("asr_volc payload:%s\n", payloadStr);
+        AI_INFO("asr_volc payload:%s\n", result->payload);
         break;
 
     case VOLC_SERVER_ERROR_RESPONSE:
-        result->code = result->sequence;
+        result->code = result->sequence ?: -1;
         result->error_msg = result->payload;
         AI_INFO("asr_volc response:{\"code\":%d,\"error msg\":%s}\n",
             result->code, result->error_msg);
@@ -319,39 +502,329 @@ static int volc_parse_response(const unsigned char* res, size_t length, volc_res
         break;
     }
 
-    free(result->payload);
-    return result->sequence;
+    return result->code != 0 ? -EPROTO : 0;
+}
+
+/* 已发送的pcm留一段在replay环里，断线重连后从最后确定的分句之后重放 */
+
+static void volc_keep_sent(volc_context_t* ctx, const char* data, size_t len)
+{
+    if (ctx->replay.buffer)
+        ai_ring_buffer_queue_arr(&ctx->replay, data, len);
+    ctx->sent_pos += len;
+}
+
+static uint64_t volc_ms_to_bytes(volc_context_t* ctx, long ms)
+{
+    voice_audio_info_t* info = &ctx->audio_info;
+    uint64_t sample_size = info->channels * info->sample_bit / 8;
+
+    if (ms <= 0 || sample_size == 0)
+        return 0;
+
+    return (uint64_t)ms * info->sample_rate / 1000 * sample_size;
+}
+
+static size_t volc_ring_size(volc_context_t* ctx, long ms)
+{
+    uint64_t bytes = volc_ms_to_bytes(ctx, ms);
+    size_t size = VOLC_RING_MIN_SIZE;
+
+    while (size <= bytes)
+        size <<= 1;
+
+    return size;
+}
+
+/* 发送环按包长起步，断网积压或预录等不到应答时按需翻倍，最多VOLC_BUFFER_MAX_SIZE */
+
+static int volc_alloc_send_ring(volc_context_t* ctx, ai_ring_buffer_t* ring, size_t need)
+{
+    long packet_ms = ctx->packet_adaptive ? VOLC_PACKET_MAX : ctx->packet_ms;
+    size_t size = volc_ring_size(ctx, packet_ms * VOLC_BUFFER_PACKETS);
+    int ret;
+
+    while (size <= need)
+        size <<= 1;
+
+    ret = ai_ring_buffer_alloc(ring, size, 0);
+    if (ret < 0)
+        return ret;
+
+    ai_ring_buffer_set_policy(ring, AI_RING_BUFFER_GROW,
+        size > VOLC_BUFFER_MAX_SIZE ? size : VOLC_BUFFER_MAX_SIZE);
+    return 0;
+}
+
+/* 上层看到的是一条连续的结果: 之前连接已确定的文本在前，当前连接的结果接在后面 */
+
+static char* volc_merge_text(volc_context_t* ctx, volc_response_result* result)
+{
+    size_t text_len = strlen(result->text);
+    size_t size = ctx->prefix_len + text_len + 1;
+    char* transcript;
+
+    if (size > ctx->transcript_size) {
+        transcript = realloc(ctx->transcript, size);
+        if (transcript == NULL)
+            return NULL;
+        ctx->transcript = transcript;
+        ctx->transcript_size = size;
+    }
+
+    memcpy(ctx->transcript + ctx->prefix_len, result->text, text_len + 1);
+    if (result->definite_len > 0 && result->definite_len <= text_len) {
+        ctx->commit_len = ctx->prefix_len + result->definite_len;
+        ctx->commit_ms = result->definite_ms;
+    }
+
+    return ctx->transcript;
+}
+
+#ifdef CONFIG_AI_VOLC_ASR_OPUS
+/* opus只支持这几种采样率、帧长和16bit输入，其他格式仍然上传原始pcm */
+
+static void volc_opus_create(struct volc_lws_state* state)
+{
+    voice_audio_info_t* info = &state->ctx->audio_info;
+    int error;
+
+    switch (VOLC_OPUS_FRAME_MS) {
+    case 10:
+    case 20:
+    case 40:
+    case 60:
+    case 80:
+    case 100:
+    case 120:
+        break;
+    default:
+        AI_WARN("asr_volc opus can't take %dms frames, uploading pcm\n", VOLC_OPUS_FRAME_MS);
+        return;
+    }
+
+    if (info->sample_bit != 16 || info->channels < 1 || info->channels > 2)
+        return;
+
+    switch (info->sample_rate) {
+    case 8000:
+    case 12000:
+    case 16000:
+    case 24000:
+    case 48000:
+        break;
+    default:
+        return;
+    }
+
+    state->opus_pcm = malloc(info->sample_rate / 1000 * VOLC_OPUS_FRAME_MS * info->channels * sizeof(int16_t));
+    if (state->opus_pcm == NULL)
+        return;
+
+    state->opus = opus_encoder_create(info->sample_rate, info->channels, OPUS_APPLICATION_VOIP, &error);
+    if (state->opus == NULL) {
+        AI_WARN("asr_volc opus encoder create failed:%d\n", error);
+        free(state->opus_pcm);
+        state->opus_pcm = NULL;
+        return;
+    }
+
+    opus_encoder_ctl(state->opus, OPUS_SET_BITRATE(VOLC_OPUS_BITRATE));
+    opus_encoder_ctl(state->opus, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+    state->packet_ms = VOLC_OPUS_FRAME_MS;
+    state->ogg_serial = (uint32_t)uv_hrtime();
+    state->ogg_seq = 0;
+    state->ogg_granule = 0;
+}
+
+static void volc_opus_destroy(struct volc_lws_state* state)
+{
+    if (state->opus) {
+        opus_encoder_destroy(state->opus);
+        state->opus = NULL;
+    }
+
+    free(state->opus_pcm);
+    state->opus_pcm = NULL;
+}
+
+/* 从环形缓冲取出take字节pcm，不足一帧补静音后编码进dst */
+
+/* 服务端按ogg容器收opus: 流开头是OpusHead和OpusTags两页，之后每个上传包
+ * 带一页，里面一个opus包，尾包那一页带EOS */
+
+static void volc_put_le(unsigned char* p, uint64_t value, int bytes)
+{
+    while (bytes-- > 0) {
+        *p++ = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static uint32_t volc_ogg_crc(const unsigned char* data, size_t len)
+{
+    uint32_t crc = 0;
+    size_t i;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+        crc ^= (uint32_t)data[i] << 24;
+        for (bit = 0; bit < 8; bit++)
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+
+    return crc;
+}
+
+/* body may already sit in dst past VOLC_OGG_PAGE_MAX, it is moved down */
+
+static int volc_ogg_page(struct volc_lws_state* state, unsigned char* dst,
+    const unsigned char* body, int len, uint8_t flags)
+{
+    int segs = len / 255 + 1;
+
+    memcpy(dst, "OggS", 4);
+    dst[4] = 0;
+    dst[5] = flags;
+    volc_put_le(dst + 6, state->ogg_granule, 8);
+    volc_put_le(dst + 14, state->ogg_serial, 4);
+    volc_put_le(dst + 18, state->ogg_seq++, 4);
+    volc_put_le(dst + 22, 0, 4);
+    dst[26] = segs;
+    memset(dst + VOLC_OGG_HEADER_LEN, 255, segs - 1);
+    dst[VOLC_OGG_HEADER_LEN + segs - 1] = len % 255;
+    memmove(dst + VOLC_OGG_HEADER_LEN + segs, body, len);
+    volc_put_le(dst + 22, volc_ogg_crc(dst, VOLC_OGG_HEADER_LEN + segs + len), 4);
+
+    return VOLC_OGG_HEADER_LEN + segs + len;
+}
+
+static int volc_ogg_stream_header(struct volc_lws_state* state, unsigned char* dst)
+{
+    voice_audio_info_t* info = &state->ctx->audio_info;
+    static const char vendor[] = "ai_volc";
+    unsigned char tags[8 + 4 + sizeof(vendor) - 1 + 4];
+    unsigned char head[19];
+    opus_int32 lookahead = 0;
+    int len;
+
+    opus_encoder_ctl(state->opus, OPUS_GET_LOOKAHEAD(&lookahead));
+
+    memcpy(head, "OpusHead", 8);
+    head[8] = 1;
+    head[9] = info->channels;
+    volc_put_le(head + 10, (uint64_t)lookahead * 48000 / info->sample_rate, 2);
+    volc_put_le(head + 12, info->sample_rate, 4);
+    volc_put_le(head + 16, 0, 2);
+    head[18] = 0;
+
+    memcpy(tags, "OpusTags", 8);
+    volc_put_le(tags + 8, sizeof(vendor) - 1, 4);
+    memcpy(tags + 12, vendor, sizeof(vendor) - 1);
+    volc_put_le(tags + 12 + sizeof(vendor) - 1, 0, 4);
+
+    len = volc_ogg_page(state, dst, head, sizeof(head), VOLC_OGG_BOS);
+    len += volc_ogg_page(state, dst + len, tags, sizeof(tags), 0);
+
+    return len;
+}
+
+/* Returns the bytes written to dst, at most VOLC_OPUS_MAX_PACKET + VOLC_OGG_OVERHEAD */
+
+static int volc_opus_encode(struct volc_lws_state* state, unsigned char* dst, int take, bool last)
+{
+    voice_audio_info_t* info = &state->ctx->audio_info;
+    int samples = info->sample_rate / 1000 * VOLC_OPUS_FRAME_MS;
+    int frame_bytes = samples * info->channels * sizeof(int16_t);
+    unsigned char* packet;
+    int pos = 0;
+    int ret;
+
+    if (take > 0) {
+        ai_ring_buffer_dequeue_arr(&state->buffer, (char*)state->opus_pcm, take);
+        volc_keep_sent(state->ctx, (char*)state->opus_pcm, take);
+    }
+    if (take < frame_bytes)
+        memset((char*)state->opus_pcm + take, 0, frame_bytes - take);
+
+    if (state->ogg_seq == 0)
+        pos = volc_ogg_stream_header(state, dst);
+
+    packet = dst + pos + VOLC_OGG_PAGE_MAX;
+    ret = opus_encode(state->opus, state->opus_pcm, samples, packet, VOLC_OPUS_MAX_PACKET);
+    if (ret < 0) {
+        AI_WARN("asr_volc opus encode failed:%d\n", ret);
+        return -EIO;
+    }
+
+    state->ogg_granule += VOLC_OPUS_FRAME_MS * 48;
+    return pos + volc_ogg_page(state, dst + pos, packet, ret, last ? VOLC_OGG_EOS : 0);
 }
+#endif
+
+/* 发送缓冲随连接常驻，只在遇到更大的帧时扩容，前面预留LWS_PRE给lws写帧头 */
 
-__attribute__((used)) static void volc_free_response_result(volc_response_result* result)
+static unsigned char* volc_send_buf(struct volc_lws_state* state, size_t size)
 {
-    if (result->payload != NULL) {
-        free(result->payload);
-        result->payload = NULL;
+    unsigned char* buf;
+
+    if (size > state->send_buf_size) {
+        buf = realloc(state->send_buf, LWS_PRE + size);
+        if (buf == NULL) {
+            AI_WARN("asr_volc no send buffer for %zu bytes\n", size);
+            return NULL;
+        }
+        state->send_buf = buf;
+        state->send_buf_size = size;
     }
+
+    return state->send_buf + LWS_PRE;
+}
+
+static void volc_put_header(unsigned char* message, char message_type,
+    uint8_t flags, uint8_t compression, int seq, size_t payload_size)
+{
+    volc_generate_message_header((char*)message, message_type, flags, VOLC_JSON, compression);
+    volc_int_to_bytes(seq, message + 4);
+    volc_int_to_bytes(payload_size, message + 8);
 }
 
-static void volc_send_initial_request(struct volc_lws_state* state)
+/* lws keeps whatever the socket did not take and flushes it before the
+ * next writable callback, so only a negative return loses data */
+
+static int volc_write(struct volc_lws_state* state, size_t message_size)
 {
-    const char* compressed;
-    size_t compressed_len;
-    int payload_len = 4;
-    int seq_len = 4;
-    int dest_pos = LWS_PRE;
-    char headers[4];
     int len;
 
+    len = lws_write(state->wsi, state->send_buf + LWS_PRE, message_size, LWS_WRITE_BINARY);
+    if (len < 0) {
+        AI_WARN("asr_volc write %zu bytes failed\n", message_size);
+        return -EIO;
+    }
+
+    if (len < message_size)
+        AI_INFO("asr_volc wrote %d of %zu bytes, rest buffered\n", len, message_size);
+
+    return 0;
+}
+
+static int volc_send_initial_request(struct volc_lws_state* state)
+{
+    ssize_t compressed_len;
+    unsigned char* message;
+    size_t bound;
+    size_t json_len;
+    int ret;
+
     struct json_object* payload = json_object_new_object();
     struct json_object* user = json_object_new_object();
     json_object_object_add(user, "uid", json_object_new_string("test"));
     json_object_object_add(payload, "user", user);
 
     struct json_object* audio = json_object_new_object();
-    json_object_object_add(audio, "format", json_object_new_string("pcm"));
     json_object_object_add(audio, "rate", json_object_new_int(state->ctx->audio_info.sample_rate));
     json_object_object_add(audio, "bits", json_object_new_int(state->ctx->audio_info.sample_bit));
     json_object_object_add(audio, "channel", json_object_new_int(state->ctx->audio_info.channels));
-    json_object_object_add(audio, "codec", json_object_new_string(state->ctx->audio_info.audio_type));
     json_object_object_add(payload, "audio", audio);
 
     struct json_object* request = json_object_new_object();
@@ -359,121 +832,271 @@ static void volc_send_initial_request(struct volc_lws_state* state)
     json_object_object_add(request, "enable_punc", json_object_new_boolean(true));
     json_object_object_add(payload, "request", request);
 
+    const char* format = "pcm";
+    const char* codec = state->ctx->audio_info.audio_type;
+#ifdef CONFIG_AI_VOLC_ASR_OPUS
+    volc_opus_create(state);
+    if (state->opus) {
+        format = "ogg";
+        codec = "opus";
+    }
+#endif
+    json_object_object_add(audio, "format", json_object_new_string(format));
+    json_object_object_add(audio, "codec", json_object_new_string(codec));
+
     const char* json_str = json_object_to_json_string(payload);
+    json_len = strlen(json_str);
+
+    /* 请求体直接压缩进发送缓冲，服务端的响应也会用gzip */
+    bound = ai_zlib_gzip_bound(&state->zlib, json_len);
+    message = volc_send_buf(state, VOLC_HEADER_LEN + bound);
+    if (message == NULL) {
+        json_object_put(payload);
+        return -ENOMEM;
+    }
 
-    // compressed_len = strlen(json_str) + strlen(json_str) / 5;
-    // compressed = malloc(compressed_len);
-    // volc_gzip_compress((const unsigned char*)json_str, strlen(json_str), &compressed, &compressed_len);
-    // todo: free compressed
+    compressed_len = ai_zlib_gzip(&state->zlib, json_str, json_len, message + VOLC_HEADER_LEN, bound);
+    if (compressed_len < 0) {
+        AI_WARN("asr_volc gzip request failed:%zd\n", compressed_len);
+        json_object_put(payload);
+        return compressed_len;
+    }
 
-    compressed_len = strlen(json_str);
-    compressed = json_str;
+    volc_put_header(message, VOLC_FULL_CLIENT_REQUEST, VOLC_POS_SEQUENCE, VOLC_GZIP, state->seq++, compressed_len);
+    ret = volc_write(state, VOLC_HEADER_LEN + compressed_len);
 
-    volc_generate_message_header(headers, VOLC_FULL_CLIENT_REQUEST, VOLC_POS_SEQUENCE, VOLC_JSON, VOLC_NO_COMPRESSION);
+    AI_INFO("asr_volc send initial request:%s gzip:%zu->%zd\n", json_str, json_len, compressed_len);
 
-    size_t message_size = sizeof(headers) + seq_len + payload_len + compressed_len;
-    unsigned char* message = malloc(message_size + LWS_PRE);
+    json_object_put(payload);
+    lws_callback_on_writable(state->wsi);
 
-    memcpy(message + dest_pos, headers, sizeof(headers));
-    dest_pos += sizeof(headers);
+    return ret;
+}
 
-    volc_int_to_bytes(state->seq, message + dest_pos);
-    state->seq++;
-    dest_pos += seq_len;
+static int volc_packet_bytes(struct volc_lws_state* state)
+{
+    voice_audio_info_t* info = &state->ctx->audio_info;
+    int sample_size = info->channels * info->sample_bit / 8;
+    int size;
 
-    volc_int_to_bytes(compressed_len, message + dest_pos);
-    dest_pos += payload_len;
+    if (sample_size <= 0)
+        return 3200;
 
-    memcpy(message + dest_pos, compressed, compressed_len);
+    size = info->sample_rate * sample_size / 1000 * state->packet_ms;
+    size -= size % sample_size;
 
-    len = lws_write(state->wsi, message + LWS_PRE, message_size, LWS_WRITE_BINARY);
-    if (len < message_size)
-        AI_INFO("volc_send_initial_request: len < message_size");
+    return size > 0 ? size : 3200;
+}
 
-    AI_INFO("asr_volc send initial request:%s\n", json_str);
+/* 自适应分包: 链路拥塞(发送管道堵塞或RTT偏高)时加倍包长减少每帧开销，
+ * RTT低时逐步缩短包长以降低首字延迟 */
 
-    free(message);
-    // free(compressed);
-    json_object_put(payload);
-    lws_callback_on_writable(state->wsi);
+static void volc_adapt_packet(struct volc_lws_state* state, bool congested)
+{
+    int packet_ms = state->packet_ms;
+
+    if (!state->ctx->packet_adaptive)
+        return;
+
+#ifdef CONFIG_AI_VOLC_ASR_OPUS
+    /* each upload carries one opus packet of the configured frame size */
+    if (state->opus)
+        return;
+#endif
+
+    if (congested || state->srtt > VOLC_RTT_HIGH) {
+        packet_ms *= 2;
+        if (packet_ms > VOLC_PACKET_MAX)
+            packet_ms = VOLC_PACKET_MAX;
+    } else if (state->srtt < VOLC_RTT_LOW) {
+        packet_ms -= VOLC_PACKET_STEP;
+        if (packet_ms < VOLC_PACKET_MIN)
+            packet_ms = VOLC_PACKET_MIN;
+    }
+
+    if (packet_ms != state->packet_ms) {
+        AI_INFO("asr_volc packet %dms -> %dms srtt:%u congested:%d\n",
+            state->packet_ms, packet_ms, (unsigned)state->srtt, congested);
+        state->packet_ms = packet_ms;
+    }
+}
+
+static void volc_update_rtt(struct volc_lws_state* state)
+{
+    uint32_t sample;
+
+    if (state->sent_at == 0)
+        return;
+
+    sample = uv_now(state->ctx->loop) - state->sent_at;
+    state->sent_at = 0;
+    state->srtt = state->srtt ? (state->srtt * 7 + sample) / 8 : sample;
+    volc_adapt_packet(state, false);
+}
+
+/* 积压超过两帧时合并成整数帧的大包，最多VOLC_PACKET_MAX，减少追赶时的帧数 */
+
+static int volc_coalesce_packet(struct volc_lws_state* state, int buffer_size, int frame_size)
+{
+    int max_size = volc_ms_to_bytes(state->ctx, VOLC_PACKET_MAX);
+
+#ifdef CONFIG_AI_VOLC_ASR_OPUS
+    if (state->opus)
+        return frame_size;
+#endif
+
+    if (buffer_size < 2 * frame_size || max_size <= frame_size)
+        return frame_size;
+
+    if (buffer_size > max_size)
+        buffer_size = max_size;
+
+    return buffer_size - buffer_size % frame_size;
 }
 
-static void volc_send_audio_data(struct volc_lws_state* state)
+/* Returns 1 when a packet went out and more audio may follow */
+
+static int volc_send_audio_data(struct volc_lws_state* state)
 {
-    size_t compressed_len;
     unsigned char* message;
-    char* compressed;
-    char* frame_buffer;
-    int payload_len = 4;
-    size_t message_size;
     int buffer_size;
-    int seq_len = 4;
-    char headers[4];
-    int dest_pos = LWS_PRE;
-    int len;
+    bool last = false;
+    int payload_size;
+    int ret;
 
-    int frame_size = state->ctx->audio_info.sample_rate * state->ctx->audio_info.channels * state->ctx->audio_info.sample_bit / 8 / 10;
-    if (frame_size == 0)
-        frame_size = 3200;
+    int frame_size = volc_packet_bytes(state);
 
-    if (state->ctx->is_finished)
-        buffer_size = 0;
-    else {
-        buffer_size = ai_ring_buffer_num_items(&state->buffer);
-        if (buffer_size <= 0)
-            return;
-    }
+    if (state->eos == VOLC_EOS_SENT)
+        return 0;
 
-    if (buffer_size < frame_size)
-        return;
+    buffer_size = state->buffer.buffer ? ai_ring_buffer_num_items(&state->buffer) : 0;
+    if (state->eos == VOLC_EOS_FLUSH) {
+        /* 剩余不足一帧的音频随尾包一起发出，没有剩余时补一帧静音 */
+        if (buffer_size <= frame_size) {
+            last = true;
+            if (buffer_size > 0)
+                frame_size = buffer_size;
+        }
+    } else if (buffer_size < frame_size)
+        return 0;
+
+    if (!last)
+        frame_size = volc_coalesce_packet(state, buffer_size, frame_size);
+
+    payload_size = frame_size;
+#ifdef CONFIG_AI_VOLC_ASR_OPUS
+    if (state->opus)
+        payload_size = VOLC_OPUS_MAX_PACKET + VOLC_OGG_OVERHEAD;
+#endif
+
+    message = volc_send_buf(state, VOLC_HEADER_LEN + payload_size);
+    if (message == NULL) {
+        lws_callback_on_writable(state->wsi);
+        return 0;
+    }
 
-    frame_buffer = (char*)malloc(frame_size);
-    if (state->ctx->is_finished) {
-        memset(frame_buffer, 0, frame_size);
-        usleep(VOLC_SILENCE_TIMEOUT);
+#ifdef CONFIG_AI_VOLC_ASR_OPUS
+    if (state->opus) {
+        payload_size = volc_opus_encode(state, message + VOLC_HEADER_LEN, buffer_size > 0 ? frame_size : 0, last);
+        if (payload_size < 0)
+            return payload_size;
+    } else
+#endif
+    /* The frame goes straight from the ring into the send buffer */
+    if (buffer_size > 0) {
+        ai_ring_buffer_dequeue_arr(&state->buffer, (char*)message + VOLC_HEADER_LEN, frame_size);
+        volc_keep_sent(state->ctx, (char*)message + VOLC_HEADER_LEN, frame_size);
     } else
-        ai_ring_buffer_dequeue_arr(&state->buffer, frame_buffer, frame_size);
+        memset(message + VOLC_HEADER_LEN, 0, frame_size);
+
+    if (last)
+        state->seq = -state->seq;
+    volc_put_header(message, VOLC_AUDIO_ONLY_REQUEST, last ? VOLC_NEG_WITH_SEQUENCE : VOLC_POS_SEQUENCE,
+        VOLC_NO_COMPRESSION, state->seq++, payload_size);
+
+    AI_INFO("asr_volc Write message of length %d last:%d\n", VOLC_HEADER_LEN + payload_size, last);
+    ret = volc_write(state, VOLC_HEADER_LEN + payload_size);
+    if (ret < 0)
+        return ret;
 
-    // compressed_len = strlen(json_str) + strlen(json_str) / 5;
-    // compressed = malloc(compressed_len);
-    // volc_gzip_compress((const unsigned char *)frame_buffer, frame_size, &compressed, &compressed_len);
-    // todo: free compressed
+    if (state->sent_at == 0)
+        state->sent_at = uv_now(state->ctx->loop);
+
+    if (last) {
+        state->eos = VOLC_EOS_SENT;
+        if (state->buffer.buffer) {
+            AI_INFO("asr_volc buffer dropped:%zu overflows:%zu peak:%zu\n",
+                state->buffer.stats.bytes_dropped,
+                state->buffer.stats.overflow_events,
+                state->buffer.stats.high_watermark);
+            ai_ring_buffer_free(&state->buffer);
+        }
+        return 0;
+    }
+
+    return 1;
+}
 
-    compressed_len = frame_size;
-    compressed = frame_buffer;
+/* 一次可写回调里连续发包直到积压清空、管道堵塞或达到VOLC_SEND_BURST，
+ * 断流恢复后几个回调就能追上，不必每个回调只发一帧 */
 
-    char message_type_specific_flags = state->ctx->is_finished ? VOLC_NEG_WITH_SEQUENCE : VOLC_POS_SEQUENCE;
-    volc_generate_message_header(headers, VOLC_AUDIO_ONLY_REQUEST, message_type_specific_flags, VOLC_JSON, VOLC_NO_COMPRESSION);
+static int volc_send_audio_burst(struct volc_lws_state* state)
+{
+    int ret;
+    int i;
 
-    message_size = sizeof(headers) + seq_len + payload_len + compressed_len;
-    message = malloc(message_size + LWS_PRE);
+    for (i = 0; i < VOLC_SEND_BURST; i++) {
+        ret = volc_send_audio_data(state);
+        if (ret <= 0)
+            return ret;
 
-    memcpy(message + dest_pos, headers, sizeof(headers));
-    dest_pos += sizeof(headers);
+        if (lws_partial_buffered(state->wsi) || lws_send_pipe_choked(state->wsi))
+            break;
+    }
 
-    if (state->ctx->is_finished)
-        state->seq = -state->seq;
-    volc_int_to_bytes(state->seq, message + dest_pos);
-    state->seq++;
-    dest_pos += seq_len;
+    lws_callback_on_writable(state->wsi);
+    return 0;
+}
 
-    volc_int_to_bytes(compressed_len, message + dest_pos);
-    dest_pos += payload_len;
+static void volc_free_lws_state(struct volc_lws_state* state);
+static void volc_schedule_prewarm(struct volc_host* host, bool failed);
 
-    memcpy(message + dest_pos, compressed, compressed_len);
+static void volc_wakeup(struct volc_lws_state* state)
+{
+    /* a resumed session has no connection until the resume timer fires */
+    if (state->wsi)
+        lws_callback_on_writable(state->wsi);
+}
 
-    AI_INFO("asr_volc Write message of length %zu\n", message_size);
-    len = lws_write(state->wsi, message + LWS_PRE, message_size, LWS_WRITE_BINARY);
+static void volc_session_done(struct volc_lws_state* state)
+{
+    volc_context_t* ctx = state->ctx;
 
-    if (len < message_size)
-        AI_INFO("volc_callback_bigasr: len < message_size");
+    /* the replay window is only needed while the session runs */
+    if (ctx->state == state) {
+        uv_timer_stop(&ctx->eos_timer);
+        uv_timer_stop(&ctx->resume_timer);
+        ai_ring_buffer_free(&ctx->replay);
+    }
 
-    free(frame_buffer);
-    free(message);
+    if (state->wsi == NULL) {
+        if (ctx->state == state)
+            ctx->state = NULL;
+        volc_free_lws_state(state);
+        volc_schedule_prewarm(ctx->host, false);
+        return;
+    }
+
+    /* the session connection is not reused, it closes and a new spare
+     * is opened once it is gone */
+    state->eos = VOLC_EOS_NONE;
+    state->closing = true;
     lws_callback_on_writable(state->wsi);
 }
 
 static int volc_callback_bigasr(struct lws* wsi, enum lws_callback_reasons reason, void* user, void* in, size_t len);
+static void volc_session_release(struct volc_context* ctx);
+static bool volc_resume_session(struct volc_context* ctx, struct volc_lws_state* state);
 
 static struct lws_protocols asr_protocols[] = {
     { VOLC_CLIENT_PROTOCOL_NAME, volc_callback_bigasr, 0, 0 },
@@ -488,26 +1111,32 @@ static int volc_callback_bigasr(struct lws* wsi, enum lws_callback_reasons reaso
     int ret;
 
     AI_INFO("websocket_callback reason: %d", reason);
+
+    /* context level events carry no connection */
+    if (state == NULL)
+        return 0;
     
     switch (reason) {
     case LWS_CALLBACK_CLIENT_APPEND_HANDSHAKE_HEADER:
         AI_INFO("asr_volc Add header\n");
         unsigned char** headers = (unsigned char**)in;
         unsigned char* end = (*headers) + len;
+        const char* app_id = state->ctx ? state->ctx->app_id : state->host->app_id;
+        const char* app_key = state->ctx ? state->ctx->app_key : state->host->app_key;
         volc_generate_uuid(state->connect_id, sizeof(state->connect_id));
 
         ret = lws_add_http_header_by_name(wsi,
             (unsigned char*)"X-Api-App-Key:",
-            (unsigned char*)state->ctx->app_id,
-            strlen(state->ctx->app_id),
+            (unsigned char*)app_id,
+            strlen(app_id),
             headers, end);
         if (ret < 0)
             AI_INFO("Add X-Api-App-Key failed\n");
 
         ret = lws_add_http_header_by_name(wsi,
             (unsigned char*)"X-Api-Access-Key:",
-            (unsigned char*)state->ctx->app_key,
-            strlen(state->ctx->app_key),
+            (unsigned char*)app_key,
+            strlen(app_key),
             headers, end);
         if (ret < 0)
             AI_INFO("Add X-Api-Access-Key failed\n");
@@ -546,6 +1175,11 @@ static int volc_callback_bigasr(struct lws* wsi, enum lws_callback_reasons reaso
         break;
     case LWS_CALLBACK_CLIENT_ESTABLISHED:
         AI_INFO("asr_volc Connected to server\n");
+        state->established = true;
+        state->host->retry_count = 0;
+        ai_net_cache_connected(wsi, VOLC_HOST, 443);
+        if (state->session)
+            lws_callback_on_writable(wsi);
         break;
     case LWS_CALLBACK_CLIENT_RECEIVE:
         // AI_INFO("asr_volc Received message of length %zu %d\n", len, lws_is_final_fragment(wsi));
@@ -574,47 +1208,91 @@ static int volc_callback_bigasr(struct lws* wsi, enum lws_callback_reasons reaso
 
         volc_response_result result;
         int frame_size = state->recv_buf_ptr - state->recv_buf;
-        volc_parse_response(state->recv_buf, frame_size, &result);
+        ret = volc_parse_response(state, state->recv_buf, frame_size, &result);
         state->recv_buf_ptr = state->recv_buf;
 
-        if (state->ctx->cb) {
-            voice_result_t cb_result;
-            if (result.text) {
-                cb_result.result = result.text;
+        /* 帧解不开后面的结果也对不上，上报错误并结束这次会话，不重连 */
+        if (ret == -EBADMSG) {
+            ai_arena_reset(&state->arena);
+            if (state->session && !state->closing) {
+                if (state->ctx->cb) {
+                    voice_result_t cb_result = { 0 };
+                    cb_result.error_code = voice_error_unknown;
+                    state->ctx->cb(voice_event_error, &cb_result, state->ctx->cookie);
+                }
+                volc_session_done(state);
+            }
+            break;
+        }
+        volc_update_rtt(state);
+
+        /* 会话请求被正常应答后才开始上传，之前录到的音频都在环形缓冲里 */
+        if (state->session && !state->acked && ret == 0) {
+            state->acked = true;
+            AI_INFO("asr_volc session acked, pre-roll:%zu\n",
+                state->buffer.buffer ? (size_t)ai_ring_buffer_num_items(&state->buffer) : 0);
+            lws_callback_on_writable(wsi);
+        }
+
+        if (state->session && state->ctx->cb) {
+            voice_result_t cb_result = { 0 };
+            if (ret == -EPROTO) {
+                cb_result.error_code = voice_error_unknown;
+                cb_result.result = NULL;
+                state->ctx->cb(voice_event_error, &cb_result, state->ctx->cookie);
+            } else if (result.text) {
+                cb_result.result = volc_merge_text(state->ctx, &result);
+                cb_result.definite_len = result.definite_len + state->ctx->prefix_len;
+                if (cb_result.result == NULL) {
+                    cb_result.result = result.text;
+                    cb_result.definite_len = result.definite_len;
+                }
                 state->ctx->cb(voice_event_result, &cb_result, state->ctx->cookie);
                 if (result.completed)
                     state->ctx->cb(voice_event_complete, NULL, state->ctx->cookie);
-                free(result.text);
             } else if (result.completed) {
                 state->ctx->cb(voice_event_complete, NULL, state->ctx->cookie);
-            } else if (result.error_msg && result.code != 0) {
-                cb_result.error_code = voice_error_unknown;
-                cb_result.result = NULL;
-                state->ctx->cb(voice_event_error, &cb_result, state->ctx->cookie);
             } else {
-                AI_INFO("asr_volc error result!");
+                AI_INFO("asr_volc empty result");
             }
         }
+        ai_arena_reset(&state->arena);
+
+        /* 服务端报错后会话不再继续；尾包之后的最终结果到达即可关闭，不必等超时 */
+        if (state->session && !state->closing
+            && (ret == -EPROTO || (state->eos == VOLC_EOS_SENT && result.completed)))
+            volc_session_done(state);
         break;
     case LWS_CALLBACK_CLIENT_WRITEABLE:
         // AI_INFO("asr_volc Write message of length %zu\n", len);
+        if (state->closing)
+            return -1;
+        if (!state->session)
+            break;
+        if (lws_partial_buffered(wsi)) {
+            lws_callback_on_writable(wsi);
+            break;
+        }
         if (state->seq == 1)
-            volc_send_initial_request(state);
-        else
-            volc_send_audio_data(state);
+            ret = volc_send_initial_request(state);
+        else if (!state->acked)
+            break;
+        else if (lws_send_pipe_choked(wsi)) {
+            volc_adapt_packet(state, true);
+            lws_callback_on_writable(wsi);
+            ret = 0;
+        } else
+            ret = volc_send_audio_burst(state);
+        if (ret == -EIO)
+            return -1;
         break;
     case LWS_CALLBACK_CLOSED:
         AI_INFO("asr_volc Connection closed\n");
         break;
     case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+        /* the session is resumed or reported once the wsi is destroyed */
         AI_INFO("asr_volc Connection error: %s\n", in ? (char*)in : "(no error information)");
-        if (state->ctx->cb) {
-            voice_result_t cb_result;
-            cb_result.error_code = voice_error_network;
-            cb_result.result = NULL;
-            state->ctx->cb(voice_event_error, &cb_result, state->ctx->cookie);
-            lws_cancel_service(state->lws_ctx);
-        }
+        ai_net_cache_failed(VOLC_HOST, 443);
         break;
     case LWS_CALLBACK_ESTABLISHED_CLIENT_HTTP:
         AI_INFO("asr_volc established http\n");
@@ -636,6 +1314,29 @@ static int volc_callback_bigasr(struct lws* wsi, enum lws_callback_reasons reaso
             AI_INFO("asr_volc Peer close reason:%d\n", code);
         }
         break;
+    case LWS_CALLBACK_WSI_DESTROY:
+        /* wsi is only set once connect returned, a synchronous failure
+         * is cleaned up by the caller */
+        if (state->wsi != wsi)
+            break;
+
+        struct volc_context* ctx = state->ctx;
+        volc_host_t* host = state->host;
+        bool failed = !state->established;
+
+        if (host->spare == state)
+            host->spare = NULL;
+        else if (ctx && ctx->state == state) {
+            ctx->state = NULL;
+            if (state->session && !state->closing && !ctx->is_closed && volc_resume_session(ctx, state))
+                failed = false;
+        } else
+            failed = false; // a finished session that was replaced, or a dropped spare
+        volc_free_lws_state(state);
+        if (ctx && ctx->is_detached)
+            volc_session_release(ctx);
+        volc_schedule_prewarm(host, failed);
+        break;
     default:
         AI_INFO("asr_volc Default reason %d \n", reason);
         break;
@@ -644,7 +1345,7 @@ static int volc_callback_bigasr(struct lws* wsi, enum lws_callback_reasons reaso
     return 0;
 }
 
-static struct lws_context* volc_create_websocket_connection(volc_context_t* ctx)
+static struct lws_context* volc_create_lws_context(volc_host_t* host)
 {
     struct lws_context_creation_info info;
     struct lws_context* context;
@@ -655,6 +1356,13 @@ static struct lws_context* volc_create_websocket_connection(volc_context_t* ctx)
     info.gid = -1;
     info.uid = -1;
     info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+    info.retry_and_idle_policy = &volc_retry_policy;
+#ifdef LWS_WITH_LIBUV
+    /* 直接挂在引擎的uv loop上，socket和定时器事件由uv_run分发 */
+    void* foreign_loops[1] = { &host->loop };
+    info.options |= LWS_SERVER_OPTION_LIBUV;
+    info.foreign_loops = foreign_loops;
+#endif
 
     context = lws_create_context(&info);
     if (!context) {
@@ -664,18 +1372,67 @@ static struct lws_context* volc_create_websocket_connection(volc_context_t* ctx)
 
     // lws_set_log_level(LLL_ERR | LLL_WARN | LLL_NOTICE | LLL_INFO | LLL_DEBUG, NULL);
 
-    ctx->state = (struct volc_lws_state*)calloc(1, sizeof(struct volc_lws_state));
-    if (!ctx->state) {
+    return context;
+}
+
+static void volc_free_lws_state(struct volc_lws_state* state)
+{
+    ai_ring_buffer_free(&state->buffer);
+#ifdef CONFIG_AI_VOLC_ASR_OPUS
+    volc_opus_destroy(state);
+#endif
+    AI_INFO("asr_volc session arena peak:%zu\n", state->arena.peak);
+    ai_arena_release(&state->arena);
+    ai_zlib_release(&state->zlib);
+    free(state->send_buf);
+    free(state->recv_buf);
+    if (state->ctx)
+        state->ctx->conns--;
+    free(state);
+}
+
+static void volc_bind_lws_state(struct volc_lws_state* state, volc_context_t* ctx)
+{
+    state->ctx = ctx;
+    state->packet_ms = ctx->packet_ms;
+    ctx->conns++;
+}
+
+/* ctx is NULL for the host spare, it is bound when a session takes it */
+
+static struct volc_lws_state* volc_new_lws_state(volc_host_t* host, volc_context_t* ctx)
+{
+    struct volc_lws_state* state;
+
+    state = (struct volc_lws_state*)calloc(1, sizeof(struct volc_lws_state));
+    if (!state) {
         perror("calloc failed");
-        lws_context_destroy(context);
         return NULL;
     }
-    ctx->state->ctx = ctx;
-    ctx->state->lws_ctx = context;
-    ctx->state->seq = 1;
+    state->host = host;
+    state->seq = 1;
+    if (ctx)
+        volc_bind_lws_state(state, ctx);
+    ai_arena_init(&state->arena, VOLC_ARENA_CHUNK);
+    ai_zlib_init(&state->zlib);
+
+    return state;
+}
+
+static int volc_open(struct volc_lws_state* state)
+{
+    volc_host_t* host = state->host;
+    char addr[AI_NET_ADDR_LEN];
+    struct lws* wsi;
+
+    if (host->lws_ctx == NULL) {
+        host->lws_ctx = volc_create_lws_context(host);
+        if (host->lws_ctx == NULL)
+            return -ENOTCONN;
+    }
 
     struct lws_client_connect_info ccinfo = { 0 };
-    ccinfo.context = context;
+    ccinfo.context = host->lws_ctx;
     ccinfo.address = VOLC_HOST; // 121.228.130.195
     ccinfo.port = 443;
     ccinfo.path = VOLC_PATH;
@@ -683,45 +1440,237 @@ static struct lws_context* volc_create_websocket_connection(volc_context_t* ctx)
     ccinfo.origin = VOLC_HOST;
     ccinfo.protocol = asr_protocols[0].name;
     ccinfo.ssl_connection = LCCSCF_USE_SSL | LCCSCF_ALLOW_SELFSIGNED | LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK;
-    ccinfo.userdata = ctx->state;
+    ccinfo.retry_and_idle_policy = &volc_retry_policy;
+    ccinfo.userdata = state;
+    ai_net_cache_prepare(&ccinfo, addr, sizeof(addr));
 
-    ctx->state->wsi = lws_client_connect_via_info(&ccinfo);
-    if (!ctx->state->wsi) {
+    wsi = lws_client_connect_via_info(&ccinfo);
+    if (!wsi) {
         AI_INFO("Failed to create connection\n");
-        lws_context_destroy(context);
-        ctx->state->lws_ctx = NULL;
-        free(ctx->state);
-        ctx->state = NULL;
+        return -ENOTCONN;
+    }
+    state->wsi = wsi;
+
+    AI_INFO("asr_volc Connecting to server: %s\n", VOLC_URL);
+
+    return 0;
+}
+
+static struct volc_lws_state* volc_connect(volc_host_t* host, volc_context_t* ctx)
+{
+    struct volc_lws_state* state;
+
+    state = volc_new_lws_state(host, ctx);
+    if (state == NULL)
+        return NULL;
+
+    if (volc_open(state) < 0) {
+        volc_free_lws_state(state);
         return NULL;
     }
 
-    AI_INFO("asr_volc Connected to server: %s\n", VOLC_URL);
+    return state;
+}
+
+static void volc_report_network_error(volc_context_t* ctx)
+{
+    voice_result_t cb_result = { 0 };
+
+    if (ctx->cb == NULL)
+        return;
+
+    cb_result.error_code = voice_error_network;
+    cb_result.result = NULL;
+    ctx->cb(voice_event_error, &cb_result, ctx->cookie);
+}
+
+static void volc_eos_timeout_cb(uv_timer_t* handle);
+
+static void volc_resume_cb(uv_timer_t* handle)
+{
+    volc_context_t* ctx = uv_handle_get_data((const uv_handle_t*)handle);
+    struct volc_lws_state* state = ctx->state;
+
+    if (state == NULL || state->wsi || ctx->is_closed)
+        return;
+
+    if (volc_open(state) == 0)
+        return;
+
+    if (ctx->resume_count < LWS_ARRAY_SIZE(volc_resume_ms)) {
+        uv_timer_start(&ctx->resume_timer, volc_resume_cb, volc_resume_ms[ctx->resume_count++], 0);
+        return;
+    }
+
+    AI_WARN("asr_volc resume gave up after %u tries\n", ctx->resume_count);
+    volc_session_done(state);
+    volc_report_network_error(ctx);
+}
+
+/* 断线后换一条新连接继续同一次识别: replay环里最后确定分句之后的音频先重放，
+ * 旧连接还没发出去的音频接在后面，新连接的结果拼在已确定的文本之后 */
+
+static bool volc_resume_session(volc_context_t* ctx, struct volc_lws_state* state)
+{
+    struct volc_lws_state* resumed;
+    uint64_t commit_pos;
+    uint64_t oldest;
+    size_t items;
+    char* data;
+    size_t len;
+
+    /* without a resume window nothing was kept to replay */
+    if (!VOLC_RESUME_WINDOW || ctx->resume_count >= LWS_ARRAY_SIZE(volc_resume_ms))
+        goto failed;
+
+    resumed = volc_new_lws_state(ctx->host, ctx);
+    if (resumed == NULL)
+        goto failed;
+
+    /* drop the replay audio the server already turned into final text */
+    items = ctx->replay.buffer ? ai_ring_buffer_num_items(&ctx->replay) : 0;
+    oldest = ctx->sent_pos - items;
+    commit_pos = ctx->session_pos + volc_ms_to_bytes(ctx, ctx->commit_ms);
+    if (commit_pos > oldest)
+        items -= ai_ring_buffer_clear_arr(&ctx->replay, commit_pos - oldest < items ? commit_pos - oldest : items);
+    else if (commit_pos < oldest)
+        AI_WARN("asr_volc replay window lost %llu bytes\n", (unsigned long long)(oldest - commit_pos));
+
+    ctx->session_pos = ctx->sent_pos - items;
+    ctx->sent_pos = ctx->session_pos;
+    ctx->prefix_len = ctx->commit_len;
+    ctx->commit_ms = 0;
+
+    if (volc_alloc_send_ring(ctx, &resumed->buffer,
+            items + (state->buffer.buffer ? ai_ring_buffer_num_items(&state->buffer) : 0)) < 0) {
+        volc_free_lws_state(resumed);
+        goto failed;
+    }
+
+    while (ctx->replay.buffer && (len = ai_ring_buffer_peek_contiguous(&ctx->replay, &data)) > 0) {
+        ai_ring_buffer_queue_arr(&resumed->buffer, data, len);
+        ai_ring_buffer_consume(&ctx->replay, len);
+    }
+
+    while (state->buffer.buffer && (len = ai_ring_buffer_peek_contiguous(&state->buffer, &data)) > 0) {
+        ai_ring_buffer_queue_arr(&resumed->buffer, data, len);
+        ai_ring_buffer_consume(&state->buffer, len);
+    }
+
+    AI_INFO("asr_volc resume session try:%u replay:%zu pending:%zu text:%zu\n",
+        ctx->resume_count + 1, items, (size_t)ai_ring_buffer_num_items(&resumed->buffer) - items, ctx->prefix_len);
+
+    /* a finished session sends its tail packet again on the new connection */
+    resumed->session = true;
+    if (state->eos != VOLC_EOS_NONE) {
+        resumed->eos = VOLC_EOS_FLUSH;
+        uv_timer_start(&ctx->eos_timer, volc_eos_timeout_cb,
+            volc_resume_ms[ctx->resume_count] + VOLC_EOS_TIMEOUT, 0);
+    }
+    ctx->state = resumed;
+    uv_timer_start(&ctx->resume_timer, volc_resume_cb, volc_resume_ms[ctx->resume_count++], 0);
+
+    return true;
+
+failed:
+    AI_WARN("asr_volc session lost\n");
+    if (state->eos != VOLC_EOS_NONE)
+        uv_timer_stop(&ctx->eos_timer);
+    volc_report_network_error(ctx);
+    return false;
+}
+
+static void volc_prewarm_cb(uv_timer_t* handle)
+{
+    volc_host_t* host = uv_handle_get_data((const uv_handle_t*)handle);
+
+    if (host->spare || host->stopping)
+        return;
+
+    host->spare = volc_connect(host, NULL);
+    if (host->spare == NULL)
+        volc_schedule_prewarm(host, true);
+}
+
+static void volc_schedule_prewarm(volc_host_t* host, bool failed)
+{
+    volc_context_t* ctx;
+    char conceal = 1;
+    uint64_t delay = 0;
+
+    if (!VOLC_PREWARM || host->stopping || host->lws_ctx == NULL || host->spare || host->count == 0
+        || host->app_id == NULL || host->app_key == NULL)
+        return;
+
+    /* 会话进行中不预连，结束后再补一条空闲连接 */
+    for (ctx = host->sessions; ctx; ctx = ctx->next) {
+        if (ctx->state)
+            return;
+    }
+
+    if (failed) {
+        delay = lws_retry_get_delay_ms(host->lws_ctx, &volc_retry_policy,
+            &host->retry_count, &conceal);
+        if (!conceal) {
+            AI_INFO("asr_volc prewarm gave up after %u tries\n", host->retry_count);
+            return;
+        }
+    }
+
+    uv_timer_start(&host->prewarm_timer, volc_prewarm_cb, delay, 0);
+}
+
+static bool volc_str_equal(const char* a, const char* b)
+{
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+/* 空闲连接用最近一个会话的凭据打开，已有空闲连接时不换 */
+
+static void volc_host_adopt(volc_host_t* host, volc_context_t* ctx)
+{
+    if (host->spare)
+        return;
+
+    if (volc_str_equal(host->app_id, ctx->app_id) && volc_str_equal(host->app_key, ctx->app_key))
+        return;
+
+    free(host->app_id);
+    free(host->app_key);
+    host->app_id = ctx->app_id ? strdup(ctx->app_id) : NULL;
+    host->app_key = ctx->app_key ? strdup(ctx->app_key) : NULL;
+}
+
+static void volc_eos_timeout_cb(uv_timer_t* handle)
+{
+    volc_context_t* ctx = uv_handle_get_data((const uv_handle_t*)handle);
+    struct volc_lws_state* state = ctx->state;
+
+    /* state is already gone when the connection dropped mid-flush */
+    if (state) {
+        if (state->eos == VOLC_EOS_NONE)
+            return;
+        volc_session_done(state);
+    }
 
-    return context;
+    AI_WARN("asr_volc no final result after %dms\n", VOLC_EOS_TIMEOUT);
+    if (ctx->cb)
+        ctx->cb(voice_event_complete, NULL, ctx->cookie);
 }
 
 static void volc_uv_handle_close(uv_handle_t* handle, void* arg)
 {
-    if (uv_is_active(handle) && !uv_is_closing(handle))
+    if (!uv_is_closing(handle))
         uv_close(handle, NULL);
 }
 
-static int volc_close_handle(void* engine, int sync)
+static void volc_close_handle(volc_host_t* host)
 {
-    volc_context_t* ctx = (volc_context_t*)engine;
-
-    if (engine == NULL)
-        return -EINVAL;
+    uv_walk(&host->loop, volc_uv_handle_close, NULL);
 
-    uv_walk(&ctx->loop, volc_uv_handle_close, NULL);
-
-    if (sync) {
-        while (uv_loop_alive(&ctx->loop)) {
-            uv_run(&ctx->loop, UV_RUN_ONCE);
-        }
+    while (uv_loop_alive(&host->loop)) {
+        uv_run(&host->loop, UV_RUN_ONCE);
     }
-
-    return 0;
 }
 
 __attribute__((used)) static voice_error_t get_errcode(int code)
@@ -748,31 +1697,17 @@ static void volc_init_data(volc_context_t* ctx)
     strlcpy(ctx->audio_info.audio_type, "raw", sizeof(ctx->audio_info.audio_type));
 }
 
-static void volc_destroy_lws_state(volc_context_t* ctx)
-{
-    if (ctx->state) {
-        if (ctx->state->buffer.buffer) {
-            free(ctx->state->buffer.buffer);
-            ctx->state->buffer.buffer = NULL;
-        }
-
-        if (ctx->state->recv_buf) {
-            free(ctx->state->recv_buf);
-            ctx->state->recv_buf = NULL;
-            ctx->state->recv_buf_ptr = NULL;
-            ctx->state->recv_buf_size = 0;
-        }
-
-        free(ctx->state);
-        ctx->state = NULL;
-    }
-}
-
 static void volc_destroy_data(volc_context_t* ctx)
 {
     sem_destroy(&ctx->sem);
 
-    volc_destroy_lws_state(ctx);
+    ai_ring_buffer_free(&ctx->replay);
+    free(ctx->transcript);
+
+    if (ctx->asyncq) {
+        free(ctx->asyncq);
+        ctx->asyncq = NULL;
+    }
 
     if (ctx->env_params) {
         free(ctx->env_params);
@@ -792,84 +1727,319 @@ static void volc_destroy_data(volc_context_t* ctx)
     free(ctx);
 }
 
-static void* volc_uvloop_thread(void* arg)
+/* 会话的连接和句柄都可能晚于detach才释放，最后一个释放的负责回收会话和宿主引用 */
+
+static void volc_host_release(volc_host_t* host)
 {
-    volc_context_t* ctx = (volc_context_t*)arg;
-    int ret;
+    bool stop = false;
 
-    volc_init_data(ctx);
+    pthread_mutex_lock(&g_volc_host_lock);
+    if (--host->refs == 0) {
+        if (g_volc_host == host)
+            g_volc_host = NULL;
+        stop = true;
+    }
+    pthread_mutex_unlock(&g_volc_host_lock);
+
+    if (stop) {
+        AI_INFO("asr_volc host idle, stopping\n");
+        host->stopping = true;
+        ai_cmd_queue_close(host->cmdq, NULL);
+        host->cmdq = NULL;
+        uv_stop(&host->loop);
+    }
+}
 
-    ret = uv_loop_init(&ctx->loop);
-    if (ret < 0) {
+static void volc_session_release(volc_context_t* ctx)
+{
+    volc_host_t* host = ctx->host;
+
+    if (!ctx->is_detached || ctx->conns > 0 || ctx->closing_handles > 0)
+        return;
+
+    volc_destroy_data(ctx);
+    volc_host_release(host);
+}
+
+static void volc_session_handle_closed(uv_handle_t* handle)
+{
+    volc_context_t* ctx = uv_handle_get_data(handle);
+
+    ctx->closing_handles--;
+    volc_session_release(ctx);
+}
+
+static void volc_session_close_handle(volc_context_t* ctx, uv_handle_t* handle)
+{
+    uv_handle_set_data(handle, ctx);
+    ctx->closing_handles++;
+    uv_close(handle, volc_session_handle_closed);
+}
+
+static void volc_session_drop(struct volc_lws_state* state)
+{
+    if (state == NULL)
+        return;
+
+    if (state->wsi == NULL) {
+        volc_free_lws_state(state);
+        return;
+    }
+
+    /* WSI_DESTROY frees the state once lws has closed the socket */
+    state->closing = true;
+    lws_set_timeout(state->wsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_ASYNC);
+}
+
+/* Only a session with the credentials the spare was opened with can take it */
+
+static struct volc_lws_state* volc_take_spare(volc_context_t* ctx)
+{
+    volc_host_t* host = ctx->host;
+    struct volc_lws_state* state = host->spare;
+
+    uv_timer_stop(&host->prewarm_timer);
+    if (state == NULL)
+        return NULL;
+
+    host->spare = NULL;
+    if (!volc_str_equal(host->app_id, ctx->app_id) || !volc_str_equal(host->app_key, ctx->app_key)) {
+        volc_session_drop(state);
+        volc_host_adopt(host, ctx);
         return NULL;
     }
 
+    volc_bind_lws_state(state, ctx);
+    AI_INFO("asr_volc reuse prewarmed connection established:%d\n", state->established);
+    return state;
+}
+
+static void volc_session_detach(volc_context_t* ctx);
+
+static void volc_session_attach(volc_context_t* ctx)
+{
+    int expected = VOLC_ATTACH_PENDING;
+    volc_host_t* host = ctx->host;
+    int ret = 0;
+
+    /* init stopped waiting, the session goes straight back */
+    if (!atomic_compare_exchange_strong(&ctx->attach_state, &expected, VOLC_ATTACH_DONE)) {
+        AI_WARN("asr_volc session %p abandoned before attach\n", ctx);
+        volc_session_detach(ctx);
+        return;
+    }
+
+    ctx->loop = &host->loop;
+
     if (ctx->uvasyncq_cb) {
         ctx->asyncq = (uv_async_queue_t*)malloc(sizeof(uv_async_queue_t));
-        ctx->asyncq->data = ctx->opaque;
-        ret = uv_async_queue_init(&ctx->loop, ctx->asyncq, ctx->uvasyncq_cb);
-        if (ret < 0)
-            goto out;
+        if (ctx->asyncq == NULL)
+            ret = -ENOMEM;
+        else {
+            ctx->asyncq->data = ctx->opaque;
+            ret = uv_async_queue_init(ctx->loop, ctx->asyncq, ctx->uvasyncq_cb);
+            if (ret < 0) {
+                free(ctx->asyncq);
+                ctx->asyncq = NULL;
+            }
+        }
         AI_INFO("asr_asyncq_init:%p", ctx->asyncq);
     }
 
-    AI_INFO("[%s][%d] asr_running:%d\n", __func__, __LINE__, uv_loop_alive(&ctx->loop));
+    uv_timer_init(ctx->loop, &ctx->eos_timer);
+    uv_handle_set_data((uv_handle_t*)&ctx->eos_timer, ctx);
+    uv_timer_init(ctx->loop, &ctx->resume_timer);
+    uv_handle_set_data((uv_handle_t*)&ctx->resume_timer, ctx);
 
-    while (uv_loop_alive(&ctx->loop) && !ctx->is_closed) {
-        ret = uv_run(&ctx->loop, UV_RUN_NOWAIT);
-        if (ret == 0)
-            break;
+    ctx->next = host->sessions;
+    host->sessions = ctx;
+    host->count++;
+    ctx->is_attached = true;
+    ctx->is_running = ret == 0;
+    volc_host_adopt(host, ctx);
+    volc_schedule_prewarm(host, false);
 
-        if (!ctx->is_finished && ctx->state && ctx->state->lws_ctx) {
-            ret = lws_service(ctx->state->lws_ctx, -1);
-            if (ret < 0) {
-                AI_INFO("asr_service failed\n");
-                if (ctx->cb) {
-                    voice_result_t cb_result;
-                    cb_result.error_code = voice_error_network;
-                    cb_result.result = NULL;
-                    ctx->cb(voice_event_error, &cb_result, ctx->cookie);
-                }
+    AI_INFO("asr_volc session %p attached, sessions:%zu\n", ctx, host->count);
+    sem_post(&ctx->sem);
+}
+
+static void volc_session_detach(volc_context_t* ctx)
+{
+    volc_host_t* host = ctx->host;
+    volc_context_t** pp;
+
+    ctx->is_closed = true;
+    ctx->is_running = false;
+    ctx->is_detached = true;
+
+    if (ctx->is_attached) {
+        for (pp = &host->sessions; *pp; pp = &(*pp)->next) {
+            if (*pp == ctx) {
+                *pp = ctx->next;
+                host->count--;
                 break;
             }
-        } else if (ctx->is_finished && ctx->state && ctx->state->lws_ctx) {
-            lws_context_destroy(ctx->state->lws_ctx);
-            ctx->state->lws_ctx = NULL;
-            volc_destroy_lws_state(ctx);
         }
 
-        if (!ctx->is_running) {
-            sem_post(&ctx->sem);
-            ctx->is_running = true;
+        if (ctx->asyncq)
+            volc_session_close_handle(ctx, (uv_handle_t*)ctx->asyncq);
+        volc_session_close_handle(ctx, (uv_handle_t*)&ctx->eos_timer);
+        volc_session_close_handle(ctx, (uv_handle_t*)&ctx->resume_timer);
+    }
+
+    volc_session_drop(ctx->state);
+    ctx->state = NULL;
+
+    AI_INFO("asr_volc session %p detached, sessions:%zu\n", ctx, host->count);
+    volc_session_release(ctx);
+}
+
+static void volc_host_dispatch(volc_host_cmd_t* message)
+{
+    if (message->type == VOLC_HOST_ATTACH)
+        volc_session_attach(message->ctx);
+    else
+        volc_session_detach(message->ctx);
+}
+
+static void volc_host_cmd_cb(void* data, void* cmd)
+{
+    volc_host_t* host = data;
+
+    volc_host_dispatch(cmd);
+    sem_post(&host->slots);
+}
+
+/* 引擎线程自己调用时直接执行，避免等自己处理队列；其他线程先占一个空槽，
+ * 队列满时阻塞到引擎处理完一条，attach/detach都不能丢 */
+
+static int volc_host_send(volc_context_t* ctx, int type)
+{
+    volc_host_cmd_t message = { type, ctx };
+    volc_host_t* host = ctx->host;
+
+    if (host->running && pthread_equal(pthread_self(), host->thread)) {
+        volc_host_dispatch(&message);
+        return 0;
+    }
+
+    while (sem_wait(&host->slots) < 0) {
+        if (errno != EINTR)
+            return -errno;
+    }
+
+    return ai_cmd_queue_send(host->cmdq, &message, sizeof(message));
+}
+
+#ifndef LWS_WITH_LIBUV
+static void volc_host_report_error(volc_host_t* host)
+{
+    volc_context_t* ctx;
+
+    for (ctx = host->sessions; ctx; ctx = ctx->next) {
+        if (ctx->state)
+            volc_report_network_error(ctx);
+    }
+}
+#endif
+
+static void volc_host_free(volc_host_t* host)
+{
+    sem_destroy(&host->sem);
+    sem_destroy(&host->slots);
+    free(host->app_id);
+    free(host->app_key);
+    free(host);
+}
+
+/* false when acquire already gave up on the thread */
+
+static bool volc_host_started(volc_host_t* host, int state)
+{
+    int expected = VOLC_HOST_STARTING;
+
+    if (!atomic_compare_exchange_strong(&host->start_state, &expected, state))
+        return false;
+
+    sem_post(&host->sem);
+    return true;
+}
+
+static void* volc_host_thread(void* arg)
+{
+    volc_host_t* host = (volc_host_t*)arg;
+    int ret;
+
+    ret = uv_loop_init(&host->loop);
+    if (ret < 0) {
+        AI_ERR("asr_volc host loop init failed:%d\n", ret);
+        if (!volc_host_started(host, VOLC_HOST_FAILED)) {
+            ai_cmd_queue_close(host->cmdq, NULL);
+            volc_host_free(host);
         }
+        return NULL;
+    }
 
-        usleep(VOLC_LOOP_INTERVAL);
+    uv_timer_init(&host->loop, &host->prewarm_timer);
+    uv_handle_set_data((uv_handle_t*)&host->prewarm_timer, host);
+    ai_cmd_queue_attach(host->cmdq, &host->loop);
+    host->lws_ctx = volc_create_lws_context(host);
+    host->running = true;
+
+    /* nobody holds an abandoned host, it only tears down */
+    if (!volc_host_started(host, VOLC_HOST_READY)) {
+        AI_WARN("asr_volc host started after acquire gave up\n");
+        host->stopping = true;
+        ai_cmd_queue_close(host->cmdq, NULL);
+        host->cmdq = NULL;
     }
 
-    sem_post(&ctx->sem);
+    AI_INFO("[%s][%d] asr_running:%d\n", __func__, __LINE__, uv_loop_alive(&host->loop));
+
+#ifdef LWS_WITH_LIBUV
+    if (!host->stopping)
+        uv_run(&host->loop, UV_RUN_DEFAULT);
+#else
+    while (uv_loop_alive(&host->loop) && !host->stopping) {
+        ret = uv_run(&host->loop, UV_RUN_NOWAIT);
+        if (ret == 0)
+            break;
+
+        if (host->lws_ctx) {
+            ret = lws_service(host->lws_ctx, -1);
+            if (ret < 0) {
+                struct lws_context* context = host->lws_ctx;
+
+                /* every connection went down with the context, the next
+                 * connect creates a new one */
+                AI_INFO("asr_service failed\n");
+                volc_host_report_error(host);
+                host->lws_ctx = NULL;
+                lws_context_destroy(context);
+            }
+        }
 
-    if (ctx->state && ctx->state->lws_ctx) {
-        lws_context_destroy(ctx->state->lws_ctx);
-        ctx->state->lws_ctx = NULL;
+        usleep(VOLC_LOOP_INTERVAL);
     }
+#endif
 
-    volc_close_handle(ctx, 1);
-    uv_stop(&ctx->loop);
+    if (host->lws_ctx) {
+        struct lws_context* context = host->lws_ctx;
 
-out:
-    if (ctx->asyncq) {
-        free(ctx->asyncq);
-        ctx->asyncq = NULL;
+        host->lws_ctx = NULL;
+        lws_context_destroy(context);
     }
-    ret = uv_loop_close(&ctx->loop);
-    ctx->is_running = false;
-    volc_destroy_data(ctx);
+
+    volc_close_handle(host);
+    ret = uv_loop_close(&host->loop);
+    host->running = false;
+    volc_host_free(host);
     AI_INFO("[%s][%d] asr_thread_out:%d\n", __func__, __LINE__, ret);
 
     return NULL;
 }
 
-static int volc_create_thread(volc_context_t* ctx)
+static int volc_create_thread(volc_host_t* host)
 {
     struct sched_param param;
     pthread_attr_t attr;
@@ -880,17 +2050,90 @@ static int volc_create_thread(volc_context_t* ctx)
     param.sched_priority = 110;
     pthread_attr_setschedparam(&attr, &param);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    ret = pthread_create(&ctx->thread, &attr, volc_uvloop_thread, ctx);
+    ret = pthread_create(&host->thread, &attr, volc_host_thread, host);
     if (ret != 0) {
         AI_INFO("pthread_create failed\n");
         return ret;
     }
-    pthread_setname_np(ctx->thread, "ai_volc");
+    pthread_setname_np(host->thread, "ai_volc");
     pthread_attr_destroy(&attr);
 
     return ret;
 }
 
+static int volc_timedwait(sem_t* sem)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += VOLC_TIMEOUT % 1000 * 1000000;
+    ts.tv_sec += ts.tv_nsec / 1000000000 + VOLC_TIMEOUT / 1000;
+    ts.tv_nsec %= 1000000000;
+
+    if (sem_timedwait(sem, &ts) == -1) {
+        if (errno == ETIMEDOUT)
+            AI_INFO("sem_timedwait: wait ret timeout\n");
+        perror("sem_timedwait: wait error\n");
+        return -ETIMEDOUT;
+    }
+
+    return 0;
+}
+
+/* The first session starts the host thread, the last one to go stops it */
+
+static volc_host_t* volc_host_acquire(void)
+{
+    volc_host_t* host;
+    int expected;
+
+    pthread_mutex_lock(&g_volc_host_lock);
+    host = g_volc_host;
+    if (host == NULL) {
+        host = (volc_host_t*)calloc(1, sizeof(volc_host_t));
+        if (host == NULL)
+            goto out;
+
+        sem_init(&host->sem, 0, 0);
+        sem_init(&host->slots, 0, VOLC_HOST_QUEUE_DEPTH);
+        atomic_init(&host->start_state, VOLC_HOST_STARTING);
+        host->cmdq = ai_cmd_queue_create(sizeof(volc_host_cmd_t), VOLC_HOST_QUEUE_DEPTH,
+            volc_host_cmd_cb, NULL, host);
+        if (host->cmdq == NULL || volc_create_thread(host) != 0) {
+            ai_cmd_queue_close(host->cmdq, NULL);
+            volc_host_free(host);
+            host = NULL;
+            goto out;
+        }
+
+        /* commands sent before the loop is up are kept by the queue; a
+         * thread that did not start in time is left to free the host */
+        if (volc_timedwait(&host->sem) < 0) {
+            expected = VOLC_HOST_STARTING;
+            if (atomic_compare_exchange_strong(&host->start_state, &expected, VOLC_HOST_ABANDONED)) {
+                AI_ERR("asr_volc host thread did not start\n");
+                host = NULL;
+                goto out;
+            }
+            sem_wait(&host->sem); // the thread decided first, its post is on the way
+        }
+
+        if (atomic_load(&host->start_state) == VOLC_HOST_FAILED) {
+            ai_cmd_queue_close(host->cmdq, NULL);
+            volc_host_free(host);
+            host = NULL;
+            goto out;
+        }
+
+        g_volc_host = host;
+    }
+    host->refs++;
+
+out:
+    pthread_mutex_unlock(&g_volc_host_lock);
+    return host;
+}
+
 /****************************************************************************
  * Public Functions
  ****************************************************************************/
@@ -898,6 +2141,7 @@ static int volc_create_thread(volc_context_t* ctx)
 static int volc_init(void* engine, const voice_init_params_t* param)
 {
     volc_context_t* ctx = (volc_context_t*)engine;
+    int expected;
     int ret;
 
     if (engine == NULL || param == NULL) {
@@ -906,9 +2150,13 @@ static int volc_init(void* engine, const voice_init_params_t* param)
     }
 
     sem_init(&ctx->sem, 0, 0);
+    atomic_init(&ctx->attach_state, VOLC_ATTACH_PENDING);
+    volc_init_data(ctx);
 
     ctx->uvasyncq_cb = param->cb;
     ctx->opaque = param->opaque;
+    ctx->packet_ms = param->packet_duration ?: 100;
+    ctx->packet_adaptive = param->packet_adaptive != 0;
     if (param->app_id) {
         ctx->app_id = (char*)malloc(strlen(param->app_id) + 1);
         strlcpy(ctx->app_id, param->app_id, strlen(param->app_id) + 1);
@@ -917,24 +2165,33 @@ static int volc_init(void* engine, const voice_init_params_t* param)
         ctx->app_key = (char*)malloc(strlen(param->app_key) + 1);
         strlcpy(ctx->app_key, param->app_key, strlen(param->app_key) + 1);
     }
-    ctx->is_running = false;
-    ret = volc_create_thread(ctx);
 
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ts.tv_nsec += VOLC_TIMEOUT % 1000 * 1000000;
-    ts.tv_sec += ts.tv_nsec / 1000000000 + VOLC_TIMEOUT / 1000;
-    ts.tv_nsec %= 1000000000;
+    ctx->host = volc_host_acquire();
+    if (ctx->host == NULL) {
+        volc_destroy_data(ctx);
+        return -ENOMEM;
+    }
 
-    if (sem_timedwait(&ctx->sem, &ts) == -1) {
-        if (errno == ETIMEDOUT)
-            AI_INFO("sem_timedwait: wait ret timeout\n");
-        perror("sem_timedwait: wait error\n");
-        ret = -ETIMEDOUT;
+    /* only a stopped host refuses commands, and our reference keeps it up */
+    ret = volc_host_send(ctx, VOLC_HOST_ATTACH);
+    if (ret < 0) {
+        AI_ERR("asr_volc attach not sent:%d\n", ret);
+        return ret;
+    }
+
+    /* after a timeout the host detaches the session when it gets to the
+     * attach, which frees ctx and drops its host reference */
+    if (volc_timedwait(&ctx->sem) < 0) {
+        expected = VOLC_ATTACH_PENDING;
+        if (atomic_compare_exchange_strong(&ctx->attach_state, &expected, VOLC_ATTACH_ABANDONED)) {
+            AI_ERR("asr_volc attach timed out\n");
+            return -ETIMEDOUT;
+        }
+        sem_wait(&ctx->sem); // the attach is running, its post is on the way
     }
 
     AI_INFO("asr_volc_init");
-    return ret;
+    return 0;
 }
 
 static int volc_uninit(void* engine)
@@ -947,7 +2204,8 @@ static int volc_uninit(void* engine)
     ctx->cb = NULL;
     ctx->cookie = NULL;
     ctx->is_closed = true;
-    // ret = volc_close_handle(engine, 0);
+    if (ctx->host)
+        volc_host_send(ctx, VOLC_HOST_DETACH);
 
     return 0;
 }
@@ -967,7 +2225,7 @@ static int volc_event_cb(void* engine, voice_callback_t callback, void* cookie)
 static int volc_start(void* engine, const voice_audio_info_t* audio_info)
 {
     volc_context_t* ctx = (volc_context_t*)engine;
-    struct lws_context* context;
+    struct volc_lws_state* state;
 
     if (engine == NULL)
         return -EINVAL;
@@ -983,25 +2241,46 @@ static int volc_start(void* engine, const voice_audio_info_t* audio_info)
     if (!ctx->is_running)
         return -EPERM;
 
-    context = volc_create_websocket_connection(ctx);
-    if (context == NULL) {
-        AI_INFO("asr_create_connect failed\n");
-        return -ENOTCONN;
+    /* 上一次会话的连接还在关闭时交给它自己释放 */
+    if (ctx->state) {
+        volc_session_done(ctx->state);
+        ctx->state = NULL;
+    }
+
+    state = volc_take_spare(ctx);
+    if (state == NULL) {
+        state = volc_connect(ctx->host, ctx);
+        if (state == NULL) {
+            AI_INFO("asr_create_connect failed\n");
+            return -ENOTCONN;
+        }
     }
 
+    /* the replay ring only covers the resume window, none without resume */
+    if (VOLC_RESUME_WINDOW && ctx->replay.buffer == NULL
+        && ai_ring_buffer_alloc(&ctx->replay, volc_ring_size(ctx, VOLC_RESUME_WINDOW), 0) < 0)
+        AI_WARN("asr_volc no replay buffer, a dropped session can't resume\n");
+    if (ctx->replay.buffer)
+        ai_ring_buffer_clear_arr(&ctx->replay, ai_ring_buffer_num_items(&ctx->replay));
+    ctx->resume_count = 0;
+    ctx->sent_pos = 0;
+    ctx->session_pos = 0;
+    ctx->commit_ms = 0;
+    ctx->prefix_len = 0;
+    ctx->commit_len = 0;
+
+    state->session = true;
+    ctx->state = state;
     ctx->is_finished = false;
+    if (state->established)
+        lws_callback_on_writable(state->wsi);
 
     return 0;
 }
 
-static int volc_write_audio(void* engine, const char* data, int len)
+static int volc_prepare_buffer(volc_context_t* ctx)
 {
-    volc_context_t* ctx = (volc_context_t*)engine;
-
-    if (engine == NULL || data == NULL || len <= 0 || len > VOLC_BUFFER_MAX_SIZE)
-        return -EINVAL;
-
-    if (ctx->state == NULL || ctx->state->lws_ctx == NULL) {
+    if (ctx->state == NULL) {
         AI_INFO("asr_volc_write_audio: state is NULL\n");
         return -EINVAL;
     }
@@ -1011,16 +2290,61 @@ static int volc_write_audio(void* engine, const char* data, int len)
 
     if (ctx->state->buffer.buffer == NULL) {
         AI_INFO("asr_volc init ring buffer\n");
-        char* buffer = (char*)malloc(VOLC_BUFFER_MAX_SIZE);
-        ai_ring_buffer_init(&ctx->state->buffer, buffer, VOLC_BUFFER_MAX_SIZE);
+        if (volc_alloc_send_ring(ctx, &ctx->state->buffer, 0) < 0)
+            return -ENOMEM;
     }
 
-    if (ai_ring_buffer_is_full(&ctx->state->buffer)) {
+    return 0;
+}
+
+static int volc_write_audio(void* engine, const char* data, int len)
+{
+    volc_context_t* ctx = (volc_context_t*)engine;
+    int ret;
+
+    if (engine == NULL || data == NULL || len <= 0 || len > VOLC_BUFFER_MAX_SIZE)
+        return -EINVAL;
+
+    ret = volc_prepare_buffer(ctx);
+    if (ret < 0)
+        return ret;
+
+    if (len > ai_ring_buffer_num_free(&ctx->state->buffer)
+        && ctx->state->buffer.buffer_mask + 1 >= VOLC_BUFFER_MAX_SIZE)
         AI_INFO("asr_volc ring buffer is full\n");
-        ai_ring_buffer_clear_arr(&ctx->state->buffer, len);
-    }
     ai_ring_buffer_queue_arr(&ctx->state->buffer, data, len);
-    lws_callback_on_writable(ctx->state->wsi);
+    volc_wakeup(ctx->state);
+
+    return 0;
+}
+
+static int volc_reserve_audio(void* engine, char** data, int len)
+{
+    volc_context_t* ctx = (volc_context_t*)engine;
+    int ret;
+
+    if (engine == NULL || data == NULL || len <= 0)
+        return -EINVAL;
+
+    ret = volc_prepare_buffer(ctx);
+    if (ret < 0)
+        return ret;
+
+    return ai_ring_buffer_reserve(&ctx->state->buffer, len, data);
+}
+
+static int volc_commit_audio(void* engine, int len)
+{
+    volc_context_t* ctx = (volc_context_t*)engine;
+
+    if (engine == NULL || len <= 0)
+        return -EINVAL;
+
+    if (ctx->state == NULL || ctx->state->buffer.buffer == NULL)
+        return -EINVAL;
+
+    ai_ring_buffer_commit(&ctx->state->buffer, len);
+    volc_wakeup(ctx->state);
 
     return 0;
 }
@@ -1032,23 +2356,21 @@ static int volc_finish(void* engine)
     if (engine == NULL)
         return -EINVAL;
 
-    // volc_send_audio_data(ctx->state);
-    ctx->is_finished = true;
-
     if (ctx->state == NULL) {
+        ctx->is_finished = true;
         AI_INFO("asr_volc_finish: state is NULL\n");
         return -EINVAL;
     }
 
-    if (ctx->state->buffer.buffer) {
-        free(ctx->state->buffer.buffer);
-        ctx->state->buffer.buffer = NULL;
-    }
-
-    if (ctx->state->recv_buf)
-        ctx->state->recv_buf_ptr = ctx->state->recv_buf;
+    /* finish may be called again by focus loss or close, only the first
+     * one starts the end-of-stream sequence */
+    if (ctx->is_finished)
+        return 0;
+    ctx->is_finished = true;
 
-    lws_callback_on_writable(ctx->state->wsi);
+    ctx->state->eos = VOLC_EOS_FLUSH;
+    uv_timer_start(&ctx->eos_timer, volc_eos_timeout_cb, VOLC_EOS_TIMEOUT, 0);
+    volc_wakeup(ctx->state);
 
     return 0;
 }
@@ -1077,7 +2399,7 @@ static voice_env_params_t* volc_get_env_params(void* engine)
     env_params = (voice_env_params_t*)malloc(sizeof(voice_env_params_t));
     env_params->format = "format=s16le:sample_rate=16000:ch_layout=mono";
     env_params->force_format = 1;
-    env_params->loop = &ctx->loop;
+    env_params->loop = ctx->loop;
     env_params->asyncq = ctx->asyncq;
     ctx->env_params = env_params;
 
@@ -1094,6 +2416,8 @@ voice_plugin_t volc_asr_engine_plugin = {
     .event_cb = volc_event_cb,
     .start = volc_start,
     .write_audio = volc_write_audio,
+    .reserve_audio = volc_reserve_audio,
+    .commit_audio = volc_commit_audio,
     .finish = volc_finish,
     .cancel = volc_cancel,
     .get_env = volc_get_env_params,
@@ -28,9 +28,11 @@
 #include <stdlib.h>
 #include <time.h>
 #include <uv.h>
-#include <uv_async_queue.h>
 
+#include "ai_audio_chain.h"
+#include "ai_cmd_queue.h"
 #include "ai_common.h"
+#include "ai_frame_pool.h"
 #include "ai_ring_buffer.h"
 #include "ai_conversation.h"
 #include "ai_conversation_plugin.h"
@@ -39,6 +41,9 @@
 #define CONVERSATION_MIN_TIMEOUT 5000
 #define CONVERSATION_MAX_TIMEOUT 120000
 #define CONVERSATION_BUFFER_MAX_SIZE 128 * 1024
+#define CONVERSATION_WRITE_SIZE 4096
+#define CONVERSATION_QUEUE_DEPTH 16
+#define CONVERSATION_FORMAT_MAX 96
 
 /****************************************************************************
  * Private Types
@@ -60,8 +65,7 @@ typedef struct conversation_context {
     void* player_handle;   // player handle
     void* focus_handle;
     uv_loop_t* loop;
-    uv_async_queue_t* asyncq;
-    uv_async_queue_t user_asyncq;
+    ai_cmd_queue_t* cmdq; // commands and callbacks, both run on loop
     uv_pipe_t* recorder_pipe;
     uv_pipe_t* player_pipe;
     char* format;
@@ -72,9 +76,11 @@ typedef struct conversation_context {
     int is_send_finished;
     conversation_engine_init_params_t voice_param;
     ai_ring_buffer_t buffer;
-    char* frame_buf;
+    int write_len; // ring bytes lent to the pending player write
     uv_write_t write_req;
     int data_end;
+    ai_audio_chain_t* chain; // NULL without preprocessing
+    char capture_format[CONVERSATION_FORMAT_MAX];
 } conversation_context_t;
 
 typedef enum {
@@ -88,59 +94,48 @@ typedef enum {
     CONVERSATION_MESSAGE_CB
 } message_id_t;
 
-typedef int (*message_handler_t)(void* message_data);
-
-typedef struct message_s {
-    message_id_t message_id;
-    message_handler_t message_handler;
-    void* message_data;
-} message_t;
-
 typedef struct message_data_listener_s {
-    conversation_context_t* ctx;
     conversation_callback_t cb;
     void* cookie;
 } message_data_listener_t;
 
 typedef struct message_data_start_s {
-    conversation_context_t* ctx;
     conversation_audio_info_t audio_info;
+    char format[CONVERSATION_FORMAT_MAX];
 } message_data_start_t;
 
-typedef struct message_data_finish_s {
-    conversation_context_t* ctx;
-} message_data_finish_t;
-
-typedef struct message_data_cancel_s {
-    conversation_context_t* ctx;
-} message_data_cancel_t;
-
-typedef struct message_data_close_s {
-    conversation_context_t* ctx;
-} message_data_close_t;
-
 typedef struct message_data_cb_s {
-    conversation_context_t* ctx;
     conversation_event_t event;
-    conversation_result_t result;
+    conversation_result_t result; // result.result is malloced
 } message_data_cb_t;
 
+typedef struct message_s {
+    message_id_t message_id;
+    conversation_context_t* ctx;
+    union {
+        message_data_listener_t listener;
+        message_data_start_t start;
+        message_data_cb_t cb;
+    } data;
+} message_t;
+
 /****************************************************************************
  * Private Functions
  ****************************************************************************/
 
 static conversation_engine_plugin_t* conversation_get_plugin(conversation_engine_type engine_type);
-static void conversation_async_cb(uv_async_queue_t* asyncq, void* data);
+static void conversation_message_cb(void* data, void* cmd);
+static void conversation_message_discard(void* data, void* cmd);
 static void conversation_engine_event_cb(conversation_engine_event_t event, 
                                         const conversation_engine_result_t* result, 
                                         void* cookie);
 
-static int conversation_message_listener_handler(void* message_data);
-static int conversation_message_start_handler(void* message_data);
-static int conversation_message_finish_handler(void* message_data);
-static int conversation_message_cancel_handler(void* message_data);
-static int conversation_message_close_handler(void* message_data);
-static int conversation_message_cb_handler(void* message_data);
+static int conversation_message_listener_handler(message_t* message);
+static int conversation_message_start_handler(message_t* message);
+static int conversation_message_finish_handler(message_t* message);
+static int conversation_message_cancel_handler(message_t* message);
+static int conversation_message_close_handler(message_t* message);
+static int conversation_message_cb_handler(message_t* message);
 
 // Media callbacks
 static void alloc_read_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
@@ -179,24 +174,60 @@ static conversation_engine_plugin_t* conversation_get_plugin(conversation_engine
 }
 
 /****************************************************************************
- * Async Queue Callbacks
+ * Command Queue Callbacks
  ****************************************************************************/
 
-static void conversation_async_cb(uv_async_queue_t* asyncq, void* data)
+static void conversation_message_cb(void* data, void* cmd)
 {
-    message_t* message = (message_t*)data;
-    
-    if (!message || !message->message_handler) {
-        AI_INFO("Invalid message in conversation async callback");
-        return;
-    }
-    
-    message->message_handler(message->message_data);
-    
-    if (message->message_data) {
-        free(message->message_data);
+    message_t* message = cmd;
+
+    switch (message->message_id) {
+    case CONVERSATION_MESSAGE_LISTENER:
+        conversation_message_listener_handler(message);
+        break;
+    case CONVERSATION_MESSAGE_START:
+        conversation_message_start_handler(message);
+        break;
+    case CONVERSATION_MESSAGE_FINISH:
+        conversation_message_finish_handler(message);
+        break;
+    case CONVERSATION_MESSAGE_CANCEL:
+        conversation_message_cancel_handler(message);
+        break;
+    case CONVERSATION_MESSAGE_CLOSE:
+        conversation_message_close_handler(message);
+        break;
+    case CONVERSATION_MESSAGE_CB:
+        conversation_message_cb_handler(message);
+        break;
+    default:
+        AI_INFO("Invalid message in conversation queue: %d", message->message_id);
+        break;
     }
-    free(message);
+}
+
+static void conversation_message_discard(void* data, void* cmd)
+{
+    message_t* message = cmd;
+
+    // 关闭后未处理的回调只释放结果内存
+    if (message->message_id == CONVERSATION_MESSAGE_CB)
+        free(message->data.cb.result.result);
+}
+
+static int conversation_send_message(conversation_context_t* ctx, message_t* message)
+{
+    ai_cmd_queue_t* cmdq = ctx->cmdq;
+    int ret;
+
+    if (cmdq == NULL)
+        return -EPIPE;
+
+    ret = ai_cmd_queue_post(cmdq, message, sizeof(message_t));
+    if (ret < 0)
+        AI_INFO("conversation message %d not queued:%d", message->message_id, ret);
+
+    return ret;
 }
 
 /****************************************************************************
@@ -245,23 +276,23 @@ static void conversation_engine_event_cb(conversation_engine_event_t event,
     }
     
     // 创建回调消息
-    message_data_cb_t* cb_data = calloc(1, sizeof(message_data_cb_t));
-    if (!cb_data) {
-        AI_INFO("Failed to allocate callback message data");
-        return;
-    }
-    
-    cb_data->ctx = ctx;
+    message_t message = { 0 };
+    message_data_cb_t* cb_data = &message.data.cb;
+
+    message.message_id = CONVERSATION_MESSAGE_CB;
+    message.ctx = ctx;
     cb_data->event = user_event;
     
-    // 复制结果数据
+    // 复制结果数据，长度不定所以不占用录音的帧池，分配失败时只上报事件
     if (result) {
-        if (result->result) {
-            cb_data->result.result = zalloc(result->len + 1);
+        if (result->result && result->len >= 0) {
+            cb_data->result.result = malloc(result->len + 1);
             if (cb_data->result.result) {
                 memcpy(cb_data->result.result, result->result, result->len);
-            }
-            cb_data->result.len = result->len;
+                cb_data->result.result[result->len] = '\0';
+                cb_data->result.len = result->len;
+            } else
+                AI_INFO("Callback result dropped, len:%d", result->len);
         }
         
         // 映射错误码
@@ -293,66 +324,91 @@ static void conversation_engine_event_cb(conversation_engine_event_t event,
         }
     }
     
-    message_t* message = calloc(1, sizeof(message_t));
-    if (!message) {
-        AI_INFO("Failed to allocate callback message");
-        free(cb_data);
-        return;
-    }
-    
-    message->message_id = CONVERSATION_MESSAGE_CB;
-    message->message_handler = conversation_message_cb_handler;
-    message->message_data = cb_data;
-    
-    uv_async_queue_send(&ctx->user_asyncq, message);
+    if (conversation_send_message(ctx, &message) < 0)
+        free(cb_data->result.result);
 }
 
 /****************************************************************************
  * Message Handlers
  ****************************************************************************/
 
-static int conversation_message_listener_handler(void* message_data)
+static int conversation_message_listener_handler(message_t* message)
 {
-    message_data_listener_t* data = (message_data_listener_t*)message_data;
+    message_data_listener_t* data = &message->data.listener;
+    conversation_context_t* ctx = message->ctx;
     
-    if (!data || !data->ctx) {
+    if (!ctx) {
         return -EINVAL;
     }
     
-    data->ctx->cb = data->cb;
-    data->ctx->cookie = data->cookie;
+    ctx->cb = data->cb;
+    ctx->cookie = data->cookie;
     
-    if (data->ctx->plugin && data->ctx->plugin->event_cb && data->ctx->engine) {
-        return data->ctx->plugin->event_cb(data->ctx->engine, conversation_engine_event_cb, data->ctx);
+    if (ctx->plugin && ctx->plugin->event_cb && ctx->engine) {
+        return ctx->plugin->event_cb(ctx->engine, conversation_engine_event_cb, ctx);
     }
     
     return 0;
 }
 
-static int conversation_message_start_handler(void* message_data)
+// 录音预处理：recorder按链路的输入格式采集，链路输出引擎要的格式
+static void conversation_init_audio_chain(conversation_context_t* ctx, const ai_audio_process_t* process)
 {
-    message_data_start_t* data = (message_data_start_t*)message_data;
+    int sample_rate;
+    int channels;
+    int ret;
+
+    free(ctx->chain);
+    ctx->chain = NULL;
+    if (process->stages == 0)
+        return;
+
+    ctx->chain = malloc(sizeof(ai_audio_chain_t));
+    if (!ctx->chain) {
+        AI_INFO("conversation no memory for the audio chain");
+        return;
+    }
+
+    ret = ai_audio_parse_format(ctx->format, &sample_rate, &channels);
+    if (ret >= 0)
+        ret = ai_audio_chain_init(ctx->chain, process, sample_rate, channels);
+    if (ret >= 0)
+        ret = ai_audio_chain_capture_format(ctx->chain, ctx->capture_format, sizeof(ctx->capture_format));
+    if (ret < 0) {
+        AI_INFO("conversation audio chain off for %s:%d", ctx->format, ret);
+        free(ctx->chain);
+        ctx->chain = NULL;
+    }
+}
+
+static int conversation_message_start_handler(message_t* message)
+{
+    message_data_start_t* data = &message->data.start;
     const conversation_audio_info_t* audio_info = &data->audio_info;
+    conversation_context_t* ctx = message->ctx;
     conversation_engine_env_params_t* env;
     int ret;
 
-    if (!data || !data->ctx) {
+    if (!ctx) {
         return -EINVAL;
     }
 
-    conversation_context_t* ctx = data->ctx;
+    // 格式串随消息拷贝进队列，这里重新指向消息内的副本
+    data->audio_info.format = data->format[0] != '\0' ? data->format : NULL;
 
     env = ctx->plugin->get_env(ctx->engine);
-    if (audio_info && audio_info->format && !env->force_format) {
-        if (ctx->format) {
-            free(ctx->format);
-        }
+    if (ctx->format) {
+        free(ctx->format);
+        ctx->format = NULL;
+    }
+    if (audio_info->format && !env->force_format) {
         ctx->format = strdup(data->audio_info.format);
-        free(data->audio_info.format);
     } else {
         ctx->format = strdup(env->format);
     }
 
+    conversation_init_audio_chain(ctx, &audio_info->process);
+
     // 初始化recorder
     ret = ai_conversation_init_recorder(ctx);
     if (ret < 0)
@@ -412,52 +468,50 @@ failed:
 
 
 
-static int conversation_message_finish_handler(void* message_data)
+static int conversation_message_finish_handler(message_t* message)
 {
-    message_data_finish_t* data = (message_data_finish_t*)message_data;
+    conversation_context_t* ctx = message->ctx;
     
-    if (!data || !data->ctx) {
+    if (!ctx) {
         return -EINVAL;
     }
     
-    if (data->ctx->plugin && data->ctx->plugin->finish && data->ctx->engine) {
-        return data->ctx->plugin->finish(data->ctx->engine);
+    if (ctx->plugin && ctx->plugin->finish && ctx->engine) {
+        return ctx->plugin->finish(ctx->engine);
     }
     
     return -ENOSYS;
 }
 
-static int conversation_message_cancel_handler(void* message_data)
+static int conversation_message_cancel_handler(message_t* message)
 {
-    message_data_cancel_t* data = (message_data_cancel_t*)message_data;
+    conversation_context_t* ctx = message->ctx;
     
-    if (!data || !data->ctx) {
+    if (!ctx) {
         return -EINVAL;
     }
     
-    if (data->ctx->plugin && data->ctx->plugin->cancel && data->ctx->engine) {
-        return data->ctx->plugin->cancel(data->ctx->engine);
+    if (ctx->plugin && ctx->plugin->cancel && ctx->engine) {
+        return ctx->plugin->cancel(ctx->engine);
     }
     
     return -ENOSYS;
 }
 
-static int conversation_message_close_handler(void* message_data)
+static int conversation_message_close_handler(message_t* message)
 {
-    message_data_close_t* data = (message_data_close_t*)message_data;
+    conversation_context_t* ctx = message->ctx;
+    ai_cmd_queue_t* cmdq;
     int ret = 0;
     
-    if (!data || !data->ctx) {
+    if (!ctx) {
         return -EINVAL;
     }
     
-    conversation_context_t* ctx = data->ctx;
-    
     if (ctx->state == CONVERSATION_STATE_CLOSE) {
         return 0;
     }
     
-    ctx->is_closed = 1;
     ctx->state = CONVERSATION_STATE_CLOSE;
     
     // 清理格式字符串
@@ -491,37 +545,47 @@ static int conversation_message_close_handler(void* message_data)
     }
     
     // 清理音频缓冲区
-    if (ctx->buffer.buffer) {
-        free(ctx->buffer.buffer);
-        ctx->buffer.buffer = NULL;
+    if (ctx->buffer.buffer)
+        AI_INFO("conversation buffer dropped:%zu overflows:%zu peak:%zu",
+            ctx->buffer.stats.bytes_dropped,
+            ctx->buffer.stats.overflow_events,
+            ctx->buffer.stats.high_watermark);
+
+    // 播放器的写请求还引用着环形缓冲区，等write_audio_data_cb里再释放
+    if (ctx->write_len == 0) {
+        ai_ring_buffer_free(&ctx->buffer);
+        ctx->is_closed = 1;
     }
-    
-    if (ctx->frame_buf) {
-        free(ctx->frame_buf);
-        ctx->frame_buf = NULL;
+
+    if (ctx->chain) {
+        ai_audio_chain_report(ctx->chain, "conversation");
+        free(ctx->chain);
+        ctx->chain = NULL;
     }
+
+    // 先清空指针再关闭队列，队列关闭后自行释放，剩余的回调交给discard处理
+    cmdq = ctx->cmdq;
+    ctx->cmdq = NULL;
+    ai_cmd_queue_close(cmdq, NULL);
     
     AI_INFO("ai_conversation_close_handler");
     
     return ret;
 }
 
-static int conversation_message_cb_handler(void* message_data)
+static int conversation_message_cb_handler(message_t* message)
 {
-    message_data_cb_t* data = (message_data_cb_t*)message_data;
+    message_data_cb_t* data = &message->data.cb;
+    conversation_context_t* ctx = message->ctx;
     
-    if (!data || !data->ctx || !data->ctx->cb) {
-        return -EINVAL;
+    if (ctx && ctx->cb) {
+        ctx->cb(data->event, &data->result, ctx->cookie);
     }
     
-    data->ctx->cb(data->event, &data->result, data->ctx->cookie);
-    
     // 清理结果数据
-    if (data->result.result) {
-        free((void*)data->result.result);
-    }
+    free(data->result.result);
     
-    return 0;
+    return ctx && ctx->cb ? 0 : -EINVAL;
 }
 
 static void ai_conversation_focus_callback(int suggestion, void* cookie)
@@ -542,13 +606,26 @@ static void ai_conversation_focus_callback(int suggestion, void* cookie)
 
 static void alloc_read_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
 {
-    buf->base = (char*)calloc(1, suggested_size);
-    buf->len = suggested_size;
+    conversation_context_t* ctx = uv_handle_get_data(handle);
+
+    if (suggested_size > AI_FRAME_MEDIUM_SIZE)
+        suggested_size = AI_FRAME_MEDIUM_SIZE;
+
+    // 帧池用完时退回堆内存，空缓冲会让libuv报UV_ENOBUFS并反复重试
+    buf->base = ai_frame_buf_alloc_fallback(suggested_size);
+    buf->len = buf->base ? suggested_size : 0;
+
+    // 预处理可能把上次剩下的半帧放到数据前面，留出空间
+    if (buf->base && ctx && ctx->chain)
+        buf->len -= AI_AUDIO_CHAIN_HEADROOM;
 }
 
 static void read_buffer_cb(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf)
 {
     conversation_context_t* ctx = uv_handle_get_data((uv_handle_t*)client);
+
+    if (ctx && ctx->chain && nread > 0)
+        nread = ai_audio_chain_process(ctx->chain, buf->base, nread);
     
     if (ctx && ctx->plugin && ctx->plugin->write_audio && ctx->engine && nread > 0) {
         ctx->plugin->write_audio(ctx->engine, buf->base, nread);
@@ -558,9 +635,7 @@ static void read_buffer_cb(uv_stream_t* client, ssize_t nread, const uv_buf_t* b
         count++;
     }
     
-    if (buf->base) {
-        free(buf->base);
-    }
+    ai_frame_buf_free(buf->base);
 }
 
 static void media_recorder_prepare_connect_cb(void* cookie, int ret, void* obj)
@@ -700,31 +775,57 @@ static void media_player_event_callback(void* cookie, int event, int ret, const
     AI_INFO("conversation player event callback event:%d ret:%d", event, ret);
 }
 
+static void ai_conversation_write_buf(conversation_context_t* ctx)
+{
+    uv_buf_t buf;
+    char* data;
+    size_t to_write;
+
+    if (!ctx->player_pipe || !ctx->buffer.buffer || ctx->write_len > 0)
+        return;
+
+    // 直接把环形缓冲区内存交给player写入，写完再释放
+    to_write = ai_ring_buffer_peek_contiguous(&ctx->buffer, &data);
+    if (to_write == 0)
+        return;
+    if (to_write > CONVERSATION_WRITE_SIZE)
+        to_write = CONVERSATION_WRITE_SIZE;
+
+    buf = uv_buf_init(data, to_write);
+    ctx->write_len = to_write;
+    ctx->write_req.data = ctx;
+    if (uv_write(&ctx->write_req, (uv_stream_t*)ctx->player_pipe, &buf, 1, write_audio_data_cb) < 0)
+        ctx->write_len = 0;
+}
+
 static void write_audio_data_cb(uv_write_t* req, int status)
 {
     conversation_context_t* ctx = (conversation_context_t*)req->data;
-    
+
+    // 关闭时推迟的缓冲区释放在这里完成
+    if (ctx->state == CONVERSATION_STATE_CLOSE) {
+        ai_ring_buffer_free(&ctx->buffer);
+        ctx->write_len = 0;
+        ctx->is_closed = 1;
+        return;
+    }
+
+    if (ctx->buffer.buffer)
+        ai_ring_buffer_consume(&ctx->buffer, ctx->write_len);
+    ctx->write_len = 0;
+
     if (status < 0) {
         AI_INFO("write audio data error:%d", status);
         return;
     }
     
     // 继续写入缓冲区中的数据
-    if (ai_ring_buffer_num_items(&ctx->buffer) > 0) {
-        size_t available = ai_ring_buffer_num_items(&ctx->buffer);
-        size_t to_write = available > 4096 ? 4096 : available;
-        
-        ai_ring_buffer_dequeue_arr(&ctx->buffer, ctx->frame_buf, to_write);
-        
-        uv_buf_t buf = uv_buf_init(ctx->frame_buf, to_write);
-        ctx->write_req.data = ctx;
-        uv_write(&ctx->write_req, (uv_stream_t*)ctx->player_pipe, &buf, 1, write_audio_data_cb);
-    }
+    ai_conversation_write_buf(ctx);
 }
 
 static int ai_conversation_init_recorder(conversation_context_t* ctx)
 {
-    const char* format = ctx->format;
+    const char* format = ctx->chain ? ctx->capture_format : ctx->format;
     int init_suggestion;
     char* stream = "cap";
     void* handle = NULL;
@@ -806,22 +907,12 @@ static int ai_conversation_init_player(conversation_context_t* ctx)
     ctx->player_handle = handle;
     
     // 初始化音频缓冲区
-    ctx->frame_buf = malloc(4096);
-    if (!ctx->frame_buf) {
-        AI_INFO("Failed to allocate audio frame buffer");
-        media_uv_player_close(handle, 0, media_player_close_cb);
-        goto failed;
-    }
-    
-    char* buffer_data = malloc(CONVERSATION_BUFFER_MAX_SIZE);
-    if (!buffer_data) {
+    if (ai_ring_buffer_alloc(&ctx->buffer, CONVERSATION_BUFFER_MAX_SIZE, AI_RING_BUFFER_MIRRORED) < 0) {
         AI_INFO("Failed to allocate audio buffer");
-        free(ctx->frame_buf);
         media_uv_player_close(handle, 0, media_player_close_cb);
         goto failed;
     }
-    
-    ai_ring_buffer_init(&ctx->buffer, buffer_data, CONVERSATION_BUFFER_MAX_SIZE);
+    ai_ring_buffer_set_policy(&ctx->buffer, AI_RING_BUFFER_REJECT, 0);
     
     AI_INFO("ai_conversation_init_player %p\n", ctx->player_handle);
 
@@ -832,29 +923,21 @@ failed:
 
 static int ai_conversation_play_audio(conversation_context_t* ctx, const void* data, int length)
 {
+    int ret;
+
     if (!ctx || !data || length <= 0 || !ctx->player_pipe) {
         return -EINVAL;
     }
     
-    // 将音频数据加入缓冲区
-    if (ai_ring_buffer_is_full(&ctx->buffer)) {
+    // 将音频数据加入缓冲区，放不下时整段丢弃，正在写入player的数据不会被覆盖
+    ret = ai_ring_buffer_queue_arr(&ctx->buffer, (const char*)data, length);
+    if (ret < 0) {
         AI_INFO("Audio buffer full, dropping data");
-        return -ENOSPC;
+        return ret;
     }
     
-    ai_ring_buffer_queue_arr(&ctx->buffer, (const char*)data, length);
-    
     // 如果当前没有写操作在进行，启动写操作
-    if (ai_ring_buffer_num_items(&ctx->buffer) > 0 && !ctx->write_req.data) {
-        size_t available = ai_ring_buffer_num_items(&ctx->buffer);
-        size_t to_write = available > 4096 ? 4096 : available;
-        
-        ai_ring_buffer_dequeue_arr(&ctx->buffer, ctx->frame_buf, to_write);
-        
-        uv_buf_t buf = uv_buf_init(ctx->frame_buf, to_write);
-        ctx->write_req.data = ctx;
-        return uv_write(&ctx->write_req, (uv_stream_t*)ctx->player_pipe, &buf, 1, write_audio_data_cb);
-    }
+    ai_conversation_write_buf(ctx);
     
     return 0;
 }
@@ -887,19 +970,20 @@ conversation_handle_t ai_conversation_create_engine(const conversation_init_para
         return NULL;
     }
     
-    // 初始化异步队列
+    // 初始化命令队列，命令和回调都在用户loop上执行
     ctx->loop = param->loop;
     
-    ctx->asyncq = calloc(1, sizeof(uv_async_queue_t));
-    if (!ctx->asyncq) {
-        AI_INFO("Failed to allocate async queue");
+    ctx->cmdq = ai_cmd_queue_create(sizeof(message_t), CONVERSATION_QUEUE_DEPTH,
+        conversation_message_cb, conversation_message_discard, ctx);
+    if (!ctx->cmdq) {
+        AI_INFO("Failed to allocate command queue");
         free(ctx);
         return NULL;
     }
     
-    if (uv_async_queue_init(ctx->loop, ctx->asyncq, conversation_async_cb) < 0) {
-        AI_INFO("Failed to initialize async queue");
-        free(ctx->asyncq);
+    if (ai_cmd_queue_attach(ctx->cmdq, ctx->loop) < 0) {
+        AI_INFO("Failed to initialize command queue");
+        ai_cmd_queue_close(ctx->cmdq, NULL);
         free(ctx);
         return NULL;
     }
@@ -907,14 +991,14 @@ conversation_handle_t ai_conversation_create_engine(const conversation_init_para
     // 设置引擎参数
     ctx->voice_param.loop = ctx->loop;
     ctx->voice_param.api_key = param->api_key;
-    ctx->voice_param.cb = conversation_async_cb;
+    ctx->voice_param.cb = NULL;
     
     // 初始化插件
     ctx->plugin = plugin;
     ctx->engine = conversation_plugin_init(plugin, &ctx->voice_param);
     if (!ctx->engine) {
         AI_INFO("Failed to initialize conversation plugin");
-        free(ctx->asyncq);
+        ai_cmd_queue_close(ctx->cmdq, NULL);
         free(ctx);
         return NULL;
     }
@@ -930,6 +1014,7 @@ int ai_conversation_set_listener(conversation_handle_t handle,
                                 void* cookie)
 {
     conversation_context_t* ctx = (conversation_context_t*)handle;
+    message_t message = { 0 };
     
     if (!ctx || !callback) {
         return -EINVAL;
@@ -939,32 +1024,19 @@ int ai_conversation_set_listener(conversation_handle_t handle,
         return -EBADF;
     }
     
-    message_data_listener_t* data = calloc(1, sizeof(message_data_listener_t));
-    if (!data) {
-        return -ENOMEM;
-    }
+    message.message_id = CONVERSATION_MESSAGE_LISTENER;
+    message.ctx = ctx;
+    message.data.listener.cb = callback;
+    message.data.listener.cookie = cookie;
     
-    data->ctx = ctx;
-    data->cb = callback;
-    data->cookie = cookie;
-    
-    message_t* message = calloc(1, sizeof(message_t));
-    if (!message) {
-        free(data);
-        return -ENOMEM;
-    }
-    
-    message->message_id = CONVERSATION_MESSAGE_LISTENER;
-    message->message_handler = conversation_message_listener_handler;
-    message->message_data = data;
-    
-    return uv_async_queue_send(ctx->asyncq, message);
+    return conversation_send_message(ctx, &message);
 }
 
 int ai_conversation_start(conversation_handle_t handle, 
                          const conversation_audio_info_t* audio_info)
 {
     conversation_context_t* ctx = (conversation_context_t*)handle;
+    message_t message = { 0 };
     
     if (!ctx) {
         return -EINVAL;
@@ -974,39 +1046,27 @@ int ai_conversation_start(conversation_handle_t handle,
         return -EBADF;
     }
     
-    message_data_start_t* data = zalloc(sizeof(message_data_start_t));
-    if (!data) {
-        return -ENOMEM;
-    }
-    
-    data->ctx = ctx;
+    message.message_id = CONVERSATION_MESSAGE_START;
+    message.ctx = ctx;
 
     if (audio_info) {
-        memcpy(&data->audio_info, audio_info, sizeof(conversation_audio_info_t));
-        if (audio_info->format && strlen(audio_info->format) > 0) {
-            data->audio_info.format = strdup(audio_info->format);
-        }
-    }
-    
-    message_t* message = zalloc(sizeof(message_t));
-    if (!message) {
-        if (data->audio_info.format) {
-            free(data->audio_info.format);
+        memcpy(&message.data.start.audio_info, audio_info, sizeof(conversation_audio_info_t));
+        message.data.start.audio_info.format = NULL;
+        if (audio_info->format) {
+            if (strlen(audio_info->format) >= CONVERSATION_FORMAT_MAX) {
+                return -EINVAL;
+            }
+            strlcpy(message.data.start.format, audio_info->format, CONVERSATION_FORMAT_MAX);
         }
-        free(data);
-        return -ENOMEM;
     }
     
-    message->message_id = CONVERSATION_MESSAGE_START;
-    message->message_handler = conversation_message_start_handler;
-    message->message_data = data;
-    
-    return uv_async_queue_send(ctx->asyncq, message);
+    return conversation_send_message(ctx, &message);
 }
 
 int ai_conversation_finish(conversation_handle_t handle)
 {
     conversation_context_t* ctx = (conversation_context_t*)handle;
+    message_t message = { 0 };
     
     if (!ctx) {
         return -EINVAL;
@@ -1016,29 +1076,16 @@ int ai_conversation_finish(conversation_handle_t handle)
         return -EBADF;
     }
     
-    message_data_finish_t* data = calloc(1, sizeof(message_data_finish_t));
-    if (!data) {
-        return -ENOMEM;
-    }
-    
-    data->ctx = ctx;
+    message.message_id = CONVERSATION_MESSAGE_FINISH;
+    message.ctx = ctx;
     
-    message_t* message = calloc(1, sizeof(message_t));
-    if (!message) {
-        free(data);
-        return -ENOMEM;
-    }
-    
-    message->message_id = CONVERSATION_MESSAGE_FINISH;
-    message->message_handler = conversation_message_finish_handler;
-    message->message_data = data;
-    
-    return uv_async_queue_send(ctx->asyncq, message);
+    return conversation_send_message(ctx, &message);
 }
 
 int ai_conversation_cancel(conversation_handle_t handle)
 {
     conversation_context_t* ctx = (conversation_context_t*)handle;
+    message_t message = { 0 };
     
     if (!ctx) {
         return -EINVAL;
@@ -1048,24 +1095,10 @@ int ai_conversation_cancel(conversation_handle_t handle)
         return -EBADF;
     }
     
-    message_data_cancel_t* data = calloc(1, sizeof(message_data_cancel_t));
-    if (!data) {
-        return -ENOMEM;
-    }
-    
-    data->ctx = ctx;
-    
-    message_t* message = calloc(1, sizeof(message_t));
-    if (!message) {
-        free(data);
-        return -ENOMEM;
-    }
+    message.message_id = CONVERSATION_MESSAGE_CANCEL;
+    message.ctx = ctx;
     
-    message->message_id = CONVERSATION_MESSAGE_CANCEL;
-    message->message_handler = conversation_message_cancel_handler;
-    message->message_data = data;
-    
-    return uv_async_queue_send(ctx->asyncq, message);
+    return conversation_send_message(ctx, &message);
 }
 
 int ai_conversation_is_busy(conversation_handle_t handle)
@@ -1095,33 +1128,21 @@ int ai_conversation_close(conversation_handle_t handle)
         return 0;
     }
     
-    message_data_close_t* data = calloc(1, sizeof(message_data_close_t));
-    if (!data) {
-        return -ENOMEM;
-    }
+    message_t message = { 0 };
     
-    data->ctx = ctx;
+    message.message_id = CONVERSATION_MESSAGE_CLOSE;
+    message.ctx = ctx;
     
-    message_t* message = calloc(1, sizeof(message_t));
-    if (!message) {
-        free(data);
-        return -ENOMEM;
-    }
-    
-    message->message_id = CONVERSATION_MESSAGE_CLOSE;
-    message->message_handler = conversation_message_close_handler;
-    message->message_data = data;
-    
-    int ret = uv_async_queue_send(ctx->asyncq, message);
+    int ret = conversation_send_message(ctx, &message);
     
     // 等待关闭完成
-    while (!ctx->is_closed && uv_loop_alive(ctx->loop)) {
+    while (ret == 0 && !ctx->is_closed && uv_loop_alive(ctx->loop)) {
         uv_run(ctx->loop, UV_RUN_ONCE);
     }
     
-    // 清理资源
-    free(ctx->asyncq);
-    free(ctx);
+    // 清理资源，命令队列在关闭回调里自行释放
+    if (ctx->is_closed)
+        free(ctx);
     
     AI_INFO("Conversation engine closed");
     return ret;
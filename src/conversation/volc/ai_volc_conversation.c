@@ -37,6 +37,7 @@
 
 #include "ai_common.h"
 #include "ai_conversation_plugin.h"
+#include "ai_net_cache.h"
 #include "ai_ring_buffer.h"
 
 /****************************************************************************
@@ -188,6 +189,7 @@ static int volc_conversation_websocket_callback(struct lws* wsi, enum lws_callba
 
         case LWS_CALLBACK_CLIENT_ESTABLISHED:
             AI_INFO("conversation_volc Connected to server: %s\n", VOLC_URL);
+            ai_net_cache_connected(wsi, VOLC_HOST, 443);
             engine->state = VOLC_STATE_CONNECTED;
                     volc_conversation_send_event(engine, conversation_engine_event_start,
                                      NULL, 0, conversation_engine_error_success);
@@ -229,6 +231,7 @@ static int volc_conversation_websocket_callback(struct lws* wsi, enum lws_callba
             
         case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
             AI_INFO("WebSocket connection error: %s", in ? (char*)in : "Unknown error");
+            ai_net_cache_failed(VOLC_HOST, 443);
             engine->state = VOLC_STATE_ERROR;
             const char *result = in ? (char*)in : "Connection error";
             volc_conversation_send_event(engine, conversation_engine_event_error, 
@@ -575,6 +578,7 @@ static int volc_conversation_event_cb(void* engine, conversation_engine_callback
 static int volc_conversation_start(void* engine, const conversation_engine_audio_info_t* audio_info)
 {
     volc_conversation_engine_t* volc_engine = (volc_conversation_engine_t*)engine;
+    char addr[AI_NET_ADDR_LEN];
     
     if (!volc_engine) {
         return -EINVAL;
@@ -611,6 +615,7 @@ static int volc_conversation_start(void* engine, const conversation_engine_audio
     ccinfo.origin = VOLC_HOST;
     ccinfo.protocol = volc_conversation_protocols[0].name;
     ccinfo.ssl_connection = LCCSCF_USE_SSL | LCCSCF_ALLOW_SELFSIGNED | LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK;
+    ai_net_cache_prepare(&ccinfo, addr, sizeof(addr));
     
     // 发起连接
     volc_engine->wsi = lws_client_connect_via_info(&ccinfo);
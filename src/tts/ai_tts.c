@@ -30,7 +30,10 @@
 #include <uv.h>
 #include <uv_async_queue.h>
 
+#include "ai_arena.h"
+#include "ai_cmd_queue.h"
 #include "ai_common.h"
+#include "ai_frame_pool.h"
 #include "ai_ring_buffer.h"
 #include "ai_tts.h"
 #include "ai_tts_plugin.h"
@@ -38,6 +41,9 @@
 #define TTS_DEFAULT_SILENCE_TIMEOUT 3000
 #define TTS_MAX_SILENCE_TIMEOUT 15000
 #define TTS_BUFFER_MAX_SIZE 128 * 1024
+#define TTS_QUEUE_DEPTH 16
+#define TTS_FORMAT_MAX 96
+#define TTS_ARENA_CHUNK 256
 
 /****************************************************************************
  * Private Types
@@ -58,9 +64,11 @@ typedef struct tts_context {
     uv_loop_t* loop;
     uv_loop_t* user_loop;
     uv_async_queue_t* asyncq;
-    uv_async_queue_t user_asyncq;
+    ai_cmd_queue_t* cmdq; // commands for the engine loop
+    ai_cmd_queue_t* user_cmdq; // callbacks for the user loop
     uv_pipe_t* pipe;
-    char* format;
+    char* format; // lives in arena
+    ai_arena_t arena; // session scoped allocations
     tts_callback_t cb;
     void* cookie;
     tts_state_t state;
@@ -68,7 +76,8 @@ typedef struct tts_context {
     tts_engine_init_params_t voice_param;
     uv_write_t write_req;
     ai_ring_buffer_t buffer;
-    char* frame_buf;
+    ai_ring_buffer_t retired; // ring of an ended session, still lent to the pending write
+    int write_len; // ring bytes lent to the pending player write
     int data_end;
 } tts_context_t;
 
@@ -79,51 +88,45 @@ typedef enum {
     TTS_MESSAGE_FINISH,
     TTS_MESSAGE_IS_BUSY,
     TTS_MESSAGE_CLOSE,
-    TTS_MESSAGE_CB
+    TTS_MESSAGE_CB,
+    TTS_MESSAGE_CLOSED
 } message_id_t;
 
-typedef int (*message_handler_t)(void* message_data);
-
-typedef struct message_s {
-    message_id_t message_id;
-    message_handler_t message_handler;
-    void* message_data;
-} message_t;
-
 typedef struct message_data_listener_s {
-    tts_context_t* ctx;
     tts_callback_t cb;
     void* cookie;
 } message_data_listener_t;
 
 typedef struct message_data_speak_s {
-    tts_context_t* ctx;
-    tts_audio_info_t audio_info;
-    char* text;
+    int version;
+    char format[TTS_FORMAT_MAX];
+    char* text; // malloced
 } message_data_speak_t;
 
-typedef struct message_data_finish_s {
-    tts_context_t* ctx;
-} message_data_finish_t;
-
-typedef struct message_data_is_busy_s {
-    tts_context_t* ctx;
-} message_data_is_busy_t;
-
-typedef struct message_data_close_s {
-    tts_context_t* ctx;
-} message_data_close_t;
-
 typedef struct message_data_cb_s {
-    tts_context_t* ctx;
     tts_engine_event_t event;
-    tts_result_t* result;
+    int has_result;
+    tts_result_t result; // audio lives in a pool frame
 } message_data_cb_t;
 
+/* Messages are copied by value into the command queues */
+
+typedef struct message_s {
+    message_id_t message_id;
+    tts_context_t* ctx;
+    union {
+        message_data_listener_t listener;
+        message_data_speak_t speak;
+        message_data_cb_t cb;
+    } data;
+} message_t;
+
 extern tts_engine_plugin_t volc_tts_engine_plugin;
 static void ai_tts_voice_callback(tts_engine_event_t event, const tts_engine_result_t* result, void* cookie);
 static void ai_tts_write_buf(tts_context_t* ctx);
 static int ai_tts_finish_handler(tts_context_t* ctx, int pending);
+static int ai_tts_send_user_message(tts_context_t* ctx, message_t* message);
+static int ai_tts_close_done(tts_context_t* ctx);
 
 /****************************************************************************
  * Private Functions
@@ -137,39 +140,98 @@ static void media_player_write_cb(uv_write_t* req, int status)
     if (status < 0)
         AI_INFO("tts player write cb error:%d", status);
 
+    /* The write came out of a ring whose session is gone */
+    if (ctx->retired.buffer != NULL) {
+        ai_ring_buffer_free(&ctx->retired);
+        ctx->write_len = 0;
+        if (ctx->state == TTS_STATE_CLOSE)
+            ai_tts_close_done(ctx);
+        else
+            ai_tts_write_buf(ctx);
+        return;
+    }
+
+    if (ctx->buffer.buffer == NULL)
+        return;
+
+    ai_ring_buffer_consume(&ctx->buffer, ctx->write_len);
+    ctx->write_len = 0;
+
     len = ai_ring_buffer_num_items(&ctx->buffer);
     if (ctx->data_end && len == 0) {
         ai_tts_finish_handler(ctx, 1);
         ai_tts_voice_callback(tts_engine_event_complete, NULL, ctx);
     }
 
-    free(ctx->frame_buf);
-    ctx->frame_buf = NULL;
     ai_tts_write_buf(ctx);
 }
 
 static void ai_tts_write_buf(tts_context_t* ctx)
 {
-    char* frame_buffer;
     uv_buf_t iov;
+    char* data;
     int len;
 
     if (!ctx || !ctx->pipe || !ctx->buffer.buffer)
         return;
 
-    len = ai_ring_buffer_num_items(&ctx->buffer);
-    if (len <= 0 || ctx->frame_buf) {
+    if (ctx->write_len > 0)
         return;
-    }
 
-    frame_buffer = (char*)malloc(len);
-    ai_ring_buffer_dequeue_arr(&ctx->buffer, frame_buffer, len);
-    iov = uv_buf_init(frame_buffer, len);
-    ctx->frame_buf = frame_buffer;
+    /* The player reads straight out of the ring, the span stays queued
+     * until the write completes */
+    len = ai_ring_buffer_peek_contiguous(&ctx->buffer, &data);
+    if (len <= 0)
+        return;
+
+    iov = uv_buf_init(data, len);
+    ctx->write_len = len;
     uv_req_set_data((uv_req_t*)&ctx->write_req, ctx);
     uv_write((uv_write_t*)&ctx->write_req, (uv_stream_t*)ctx->pipe, &iov, 1, media_player_write_cb);
 }
 
+static char* ai_tts_share_audio(const tts_engine_result_t* result)
+{
+    ai_frame_t* frame = result->frame;
+
+    /* The user callback runs later, possibly on another thread, so it
+     * keeps the engine's frame alive or gets a copy of its own. A slow
+     * user loop can hold every pool frame, the copy then goes to the heap */
+    if (frame != NULL && ai_frame_data(frame) == result->result)
+        return ai_frame_data(ai_frame_ref(frame));
+
+    frame = ai_frame_alloc_fallback(result->len);
+    if (frame == NULL) {
+        AI_WARN("ai_tts no memory for %d bytes of audio\n", result->len);
+        return NULL;
+    }
+
+    memcpy(ai_frame_data(frame), result->result, result->len);
+    return ai_frame_data(frame);
+}
+
+/* libuv still reads a pending player write out of the ring, so that ring
+ * is parked until media_player_write_cb runs instead of freed now */
+
+static void ai_tts_release_buffer(tts_context_t* ctx)
+{
+    if (ctx->buffer.buffer)
+        AI_INFO("ai_tts buffer dropped:%zu overflows:%zu peak:%zu\n",
+            ctx->buffer.stats.bytes_dropped,
+            ctx->buffer.stats.overflow_events,
+            ctx->buffer.stats.high_watermark);
+
+    if (ctx->write_len > 0 && ctx->retired.buffer == NULL && ctx->buffer.buffer != NULL) {
+        ctx->retired = ctx->buffer;
+        memset(&ctx->buffer, 0, sizeof(ctx->buffer));
+        return;
+    }
+
+    ai_ring_buffer_free(&ctx->buffer);
+    if (ctx->retired.buffer == NULL)
+        ctx->write_len = 0;
+}
+
 static void ai_tts_send_error(tts_context_t* ctx, tts_error_t error)
 {
     tts_engine_result_t result;
@@ -177,6 +239,7 @@ static void ai_tts_send_error(tts_context_t* ctx, tts_error_t error)
     result.len = 0;
     result.result = NULL;
     result.error_code = error;
+    result.frame = NULL;
     ai_tts_voice_callback(tts_engine_event_error, &result, ctx);
 }
 
@@ -250,6 +313,8 @@ static void media_player_event_callback(void* cookie, int event, int ret,
 
 static int ai_tts_close_handler(tts_context_t* ctx)
 {
+    ai_frame_pool_stats_t stats;
+    ai_cmd_queue_t* cmdq;
     int ret = 0;
 
     if (ctx == NULL)
@@ -259,10 +324,8 @@ static int ai_tts_close_handler(tts_context_t* ctx)
         return 0;
     ctx->state = TTS_STATE_CLOSE;
 
-    if (ctx->format) {
-        free(ctx->format);
-        ctx->format = NULL;
-    }
+    ctx->format = NULL;
+    ai_arena_release(&ctx->arena);
 
     if (ctx->engine) {
         tts_plugin_uninit(ctx->plugin, ctx->engine, 0);
@@ -279,17 +342,40 @@ static int ai_tts_close_handler(tts_context_t* ctx)
         ctx->focus_handle = NULL;
     }
 
-    if (ctx->buffer.buffer) {
-        free(ctx->buffer.buffer);
-        ctx->buffer.buffer = NULL;
-    }
+    ai_tts_release_buffer(ctx);
 
-    free(ctx);
-    ctx = NULL;
+    ai_frame_pool_get_stats(&stats);
+    AI_INFO("ai_tts frames in use:%zu peak:%zu failures:%zu heap:%zu\n",
+        stats.in_use, stats.peak, stats.failures, stats.fallbacks);
+
+    /* Nothing reaches the engine loop after close, the context itself
+     * goes away on the user loop once its queue is drained. Clear the
+     * pointer first so new senders see NULL */
+    cmdq = ctx->cmdq;
+    ctx->cmdq = NULL;
+    ai_cmd_queue_close(cmdq, NULL);
 
     AI_INFO("ai_tts_close_handler");
 
-    return ret;
+    /* media_player_write_cb finishes the close */
+    if (ctx->retired.buffer != NULL)
+        return ret;
+
+    return ai_tts_close_done(ctx);
+}
+
+static int ai_tts_close_done(tts_context_t* ctx)
+{
+    message_t message = { 0 };
+
+    if (ctx->user_loop == NULL) {
+        free(ctx);
+        return 0;
+    }
+
+    message.message_id = TTS_MESSAGE_CLOSED;
+    message.ctx = ctx;
+    return ai_tts_send_user_message(ctx, &message);
 }
 
 static int ai_tts_finish_handler(tts_context_t* ctx, int pending)
@@ -321,10 +407,11 @@ static int ai_tts_finish_handler(tts_context_t* ctx, int pending)
         AI_INFO("ai_tts stop tts!\n");
     }
 
-    if (ctx->buffer.buffer) {
-        free(ctx->buffer.buffer);
-        ctx->buffer.buffer = NULL;
-    }
+    ai_tts_release_buffer(ctx);
+
+    AI_INFO("ai_tts session arena used:%zu peak:%zu", ctx->arena.used, ctx->arena.peak);
+    ctx->format = NULL;
+    ai_arena_reset(&ctx->arena);
 
     ctx->state = TTS_STATE_FINISH;
     AI_INFO("ai_tts_finish_handler");
@@ -388,29 +475,55 @@ failed:
     return -EPERM;
 }
 
-static int ai_tts_callback_l(void* message_data)
+static int ai_tts_callback_l(message_t* message)
 {
-    message_data_cb_t* data = (message_data_cb_t*)message_data;
-    tts_context_t* ctx = data->ctx;
+    message_data_cb_t* data = &message->data.cb;
+    tts_context_t* ctx = message->ctx;
     tts_event_t event = data->event;
-    tts_result_t* tts_result = data->result;
+    tts_result_t* tts_result = data->has_result ? &data->result : NULL;
 
     if (ctx->cb)
         ctx->cb(event, tts_result, ctx->cookie);
 
-    if (tts_result) {
-        free(tts_result->result);
-        free(tts_result);
-    }
+    if (tts_result)
+        ai_frame_buf_free(tts_result->result);
+
+    return 0;
+}
+
+static void ai_tts_user_cmdq_close_cb(void* data)
+{
+    free(data);
+    AI_INFO("ai_tts_user_cmdq_close_cb");
+}
 
+static int ai_tts_closed_l(message_t* message)
+{
+    tts_context_t* ctx = message->ctx;
+    ai_cmd_queue_t* user_cmdq = ctx->user_cmdq;
+
+    ctx->user_cmdq = NULL;
+    ai_cmd_queue_close(user_cmdq, ai_tts_user_cmdq_close_cb);
     return 0;
 }
 
+static int ai_tts_send_user_message(tts_context_t* ctx, message_t* message)
+{
+    int ret;
+
+    /* Audio and the final events must all arrive, never drop on a full queue */
+    ret = ai_cmd_queue_post(ctx->user_cmdq, message, sizeof(message_t));
+    if (ret < 0)
+        AI_ERR("ai_tts user message %d dropped:%d", message->message_id, ret);
+
+    return ret;
+}
+
 static void ai_tts_voice_callback(tts_engine_event_t event, const tts_engine_result_t* result, void* cookie)
 {
     tts_context_t* ctx = cookie;
     tts_result_t* tts_result = NULL;
-    int buf_num;
+    message_t message = { 0 };
 
     if (ctx->cb == NULL)
         return;
@@ -422,40 +535,44 @@ static void ai_tts_voice_callback(tts_engine_event_t event, const tts_engine_res
         AI_INFO("ai_tts result info event:%d len:%d error:%d\n", event, result->len, result->error_code);
 
     if (result) {
-        tts_result = (tts_result_t*)malloc(sizeof(tts_result_t));
+        int len = result->len;
+
+        tts_result = &message.data.cb.result;
+        message.data.cb.has_result = 1;
         if (result->result != NULL && result->len > 0) {
-            tts_result->result = (char*)malloc(result->len);
-            strlcpy(tts_result->result, result->result, result->len);
+            tts_result->result = ai_tts_share_audio(result);
+            if (tts_result->result == NULL)
+                len = 0;
 
             if (ctx->buffer.buffer == NULL) {
                 AI_INFO("asr_tts init ring buffer\n");
-                char* buffer = (char*)malloc(TTS_BUFFER_MAX_SIZE);
-                ai_ring_buffer_init(&ctx->buffer, buffer, TTS_BUFFER_MAX_SIZE);
-            }
-
-            if (ai_ring_buffer_is_full(&ctx->buffer)) {
-                AI_INFO("asr_volc ring buffer is full\n");
-                ai_ring_buffer_clear_arr(&ctx->buffer, result->len);
+                /* The player reads its pending write straight out of the
+                 * ring, so a full ring cuts the new audio rather than
+                 * overwrite bytes lent to that write */
+                if (ai_ring_buffer_alloc(&ctx->buffer, TTS_BUFFER_MAX_SIZE, AI_RING_BUFFER_MIRRORED) == 0)
+                    ai_ring_buffer_set_policy(&ctx->buffer, AI_RING_BUFFER_DROP_NEWEST, 0);
             }
 
-            buf_num = ai_ring_buffer_num_items(&ctx->buffer);
-            if (buf_num == 0) {
+            if (ctx->buffer.buffer != NULL) {
                 ai_ring_buffer_queue_arr(&ctx->buffer, result->result, result->len);
                 ai_tts_write_buf(ctx);
-            } else
-                ai_ring_buffer_queue_arr(&ctx->buffer, result->result, result->len);
+            }
+
+            /* only running out of memory leaves no copy, never report empty audio */
+            if (tts_result->result == NULL && event == tts_engine_event_result)
+                return;
         } else if (tts_engine_event_result == event && result->len == 0) {
             ai_tts_write_buf(ctx);
             char zero_buf[32000] = { 0 };
-            ai_ring_buffer_queue_arr(&ctx->buffer, zero_buf, 32000);
+            if (ctx->buffer.buffer != NULL)
+                ai_ring_buffer_queue_arr(&ctx->buffer, zero_buf, 32000);
             ai_tts_write_buf(ctx);
             ctx->data_end = 1;
-            free(tts_result);
             AI_INFO("ai_tts_voice_callback data end");
             return;
         } else
             tts_result->result = NULL;
-        tts_result->len = result->len;
+        tts_result->len = len;
         if (result->error_code != 0)
             tts_result->error_code = tts_error_failed;
         else
@@ -469,33 +586,84 @@ static void ai_tts_voice_callback(tts_engine_event_t event, const tts_engine_res
         ctx->is_send_finished = true;
     }
 
-    message_data_cb_t* cb = (message_data_cb_t*)malloc(sizeof(message_data_cb_t));
-    cb->ctx = ctx;
-    cb->event = event;
-    cb->result = tts_result;
-    if (ctx->user_loop) {
-        message_t* message = (message_t*)malloc(sizeof(message_t));
-        message->message_id = TTS_MESSAGE_CB;
-        message->message_handler = ai_tts_callback_l;
-        message->message_data = cb;
-        uv_async_queue_send(&(ctx->user_asyncq), message);
-    } else {
-        ai_tts_callback_l(cb);
-        free(cb);
+    message.message_id = TTS_MESSAGE_CB;
+    message.ctx = ctx;
+    message.data.cb.event = event;
+    if (ctx->user_loop == NULL)
+        ai_tts_callback_l(&message);
+    else if (ai_tts_send_user_message(ctx, &message) < 0 && tts_result)
+        ai_frame_buf_free(tts_result->result);
+}
+
+static int ai_tts_set_listener_l(message_t* message);
+static int ai_tts_speak_l(message_t* message);
+static int ai_tts_stop_l(message_t* message);
+static int ai_tts_close_l(message_t* message);
+
+static void ai_tts_message_cb(void* data, void* cmd)
+{
+    message_t* message = cmd;
+
+    switch (message->message_id) {
+    case TTS_MESSAGE_LISTENER:
+        ai_tts_set_listener_l(message);
+        break;
+    case TTS_MESSAGE_START:
+        ai_tts_speak_l(message);
+        break;
+    case TTS_MESSAGE_FINISH:
+        ai_tts_stop_l(message);
+        break;
+    case TTS_MESSAGE_CLOSE:
+        ai_tts_close_l(message);
+        break;
+    case TTS_MESSAGE_CB:
+        ai_tts_callback_l(message);
+        break;
+    case TTS_MESSAGE_CLOSED:
+        ai_tts_closed_l(message);
+        break;
+    default:
+        AI_WARN("ai_tts unknown message:%d", message->message_id);
+        break;
     }
 }
 
+static void ai_tts_message_discard(void* data, void* cmd)
+{
+    message_t* message = cmd;
+
+    if (message->message_id == TTS_MESSAGE_CB && message->data.cb.has_result)
+        ai_frame_buf_free(message->data.cb.result.result);
+    else if (message->message_id == TTS_MESSAGE_START)
+        free(message->data.speak.text);
+}
+
 static void ai_tts_async_cb(uv_async_queue_t* handle, void* data)
 {
-    AI_INFO("ai_tts_async_cb");
+    tts_context_t* ctx = handle->data;
+    int ret;
+
+    /* The plugin queue only carries the request to attach the command
+     * queue to the engine loop, everything else goes through cmdq */
+    ret = ai_cmd_queue_attach(data, ctx->loop);
+    AI_INFO("ai_tts_async_cb attach:%d", ret);
+}
+
+static int ai_tts_send_message(tts_context_t* ctx, message_t* message)
+{
+    ai_cmd_queue_t* cmdq = ctx->cmdq;
+    int ret;
 
-    message_t* message = (message_t*)data;
+    /* Read once, close clears it before the queue goes away */
+    if (cmdq == NULL)
+        return -EPIPE;
 
-    if (message->message_handler)
-        message->message_handler(message->message_data);
+    ret = ai_cmd_queue_send(cmdq, message, sizeof(message_t));
+    if (ret < 0)
+        AI_WARN("ai_tts message %d not queued:%d", message->message_id, ret);
 
-    free(message->message_data);
-    free(message);
+    return ret;
 }
 
 static void ai_tts_map_params(tts_context_t* ctx, const tts_init_params_t* in_param, tts_engine_init_params_t* out_param)
@@ -514,10 +682,10 @@ static void ai_tts_map_params(tts_context_t* ctx, const tts_init_params_t* in_pa
     out_param->opaque = ctx;
 }
 
-static int ai_tts_set_listener_l(void* message_data)
+static int ai_tts_set_listener_l(message_t* message)
 {
-    message_data_listener_t* data = (message_data_listener_t*)message_data;
-    tts_context_t* ctx = data->ctx;
+    message_data_listener_t* data = &message->data.listener;
+    tts_context_t* ctx = message->ctx;
     tts_callback_t callback = data->cb;
     void* cookie = data->cookie;
 
@@ -534,54 +702,49 @@ static int ai_tts_set_listener_l(void* message_data)
 
 static int ai_tts_create_format(tts_context_t* ctx, const char* format)
 {
-    int len;
-
     if (!format)
         return -EINVAL;
 
-    len = strlen(format) + 1;
-    char* temp = (char*)realloc(ctx->format, len);
-    if (temp == NULL) {
+    ctx->format = ai_arena_strdup(&ctx->arena, format);
+    if (ctx->format == NULL)
         return -ENOMEM;
-    }
-    ctx->format = temp;
-    strlcpy(ctx->format, format, len);
 
     return 0;
 }
 
-static int ai_tts_speak_l(void* message_data)
+static int ai_tts_speak_l(message_t* message)
 {
-    message_data_speak_t* data = (message_data_speak_t*)message_data;
-    tts_context_t* ctx = data->ctx;
-    const tts_audio_info_t* audio_info = &data->audio_info;
+    message_data_speak_t* data = &message->data.speak;
+    tts_context_t* ctx = message->ctx;
     tts_engine_env_params_t* env;
     int ret = 0;
 
     AI_INFO("ai_tts_speak_l before\n");
 
-    if (ctx == NULL || ctx->engine == NULL)
-        return -EINVAL;
-
-    if (ctx->state == TTS_STATE_START)
-        return 0;
+    if (ctx == NULL || ctx->engine == NULL || ctx->state == TTS_STATE_START) {
+        free(data->text);
+        return ctx && ctx->state == TTS_STATE_START ? 0 : -EINVAL;
+    }
     ctx->state = TTS_STATE_START;
 
+    ai_arena_reset(&ctx->arena);
+    ctx->format = NULL;
+
     env = ctx->plugin->get_env(ctx->engine);
-    if (audio_info && audio_info->format && !env->force_format) {
-        ret = ai_tts_create_format(ctx, audio_info->format);
-        free(audio_info->format);
-    } else
+    if (data->format[0] != '\0' && !env->force_format)
+        ret = ai_tts_create_format(ctx, data->format);
+    else
         ret = ai_tts_create_format(ctx, env->format);
-    if (ret < 0)
+    if (ret < 0) {
+        free(data->text);
         goto failed;
+    }
 
     ctx->is_send_finished = false;
     ctx->data_end = 0;
 
     ret = ctx->plugin->speak(ctx->engine, data->text, NULL);
-    if (data->text)
-        free(data->text);
+    free(data->text);
     if (ret < 0)
         goto failed;
 
@@ -610,22 +773,20 @@ failed:
     return ret;
 }
 
-static int ai_tts_stop_l(void* message_data)
+static int ai_tts_stop_l(message_t* message)
 {
     int ret;
 
     AI_INFO("ai_tts_stop_l");
-    message_data_finish_t* data = (message_data_finish_t*)message_data;
-    ret = ai_tts_finish_handler(data->ctx, 0);
-    ai_tts_voice_callback(tts_engine_event_complete, NULL, data->ctx);
+    ret = ai_tts_finish_handler(message->ctx, 0);
+    ai_tts_voice_callback(tts_engine_event_complete, NULL, message->ctx);
     return ret;
 }
 
-static int ai_tts_close_l(void* message_data)
+static int ai_tts_close_l(message_t* message)
 {
     AI_INFO("ai_tts_close_l");
-    message_data_close_t* data = (message_data_close_t*)message_data;
-    return ai_tts_close_handler(data->ctx);
+    return ai_tts_close_handler(message->ctx);
 }
 
 /****************************************************************************
@@ -652,24 +813,33 @@ tts_handle_t ai_tts_create_engine(const tts_init_params_t* param)
     }
 
     ctx = zalloc(sizeof(tts_context_t));
+    if (ctx == NULL)
+        return NULL;
+    ai_arena_init(&ctx->arena, TTS_ARENA_CHUNK);
+
+    ctx->cmdq = ai_cmd_queue_create(sizeof(message_t), TTS_QUEUE_DEPTH,
+        ai_tts_message_cb, ai_tts_message_discard, ctx);
+    if (ctx->cmdq == NULL)
+        goto failed;
 
     ctx->user_loop = param->loop;
     if (param->loop) {
-        ctx->user_asyncq.data = ctx;
-        ret = uv_async_queue_init(param->loop, &ctx->user_asyncq, ai_tts_async_cb);
-        if (ret < 0) {
-            free(ctx);
-            return NULL;
-        }
+        ctx->user_cmdq = ai_cmd_queue_create(sizeof(message_t), TTS_QUEUE_DEPTH,
+            ai_tts_message_cb, ai_tts_message_discard, ctx);
+        if (ctx->user_cmdq == NULL)
+            goto failed;
+
+        ret = ai_cmd_queue_attach(ctx->user_cmdq, param->loop);
+        if (ret < 0)
+            goto failed;
     }
 
     ctx->plugin = plugin;
     ai_tts_map_params(ctx, param, &ctx->voice_param);
     ctx->engine = tts_plugin_init(plugin, &ctx->voice_param);
     if (ctx->engine == NULL) {
-        free(ctx);
         AI_INFO("ai_tts_create_engine failed");
-        return NULL;
+        goto failed;
     }
 
     env = ctx->plugin->get_env(ctx->engine);
@@ -678,80 +848,90 @@ tts_handle_t ai_tts_create_engine(const tts_init_params_t* param)
 
     AI_INFO("ai_tts_create_engine:%p", ctx->loop);
 
-    if (ctx->loop == NULL) {
+    if (ctx->loop == NULL || ctx->asyncq == NULL
+        || uv_async_queue_send(ctx->asyncq, ctx->cmdq) < 0) {
         tts_plugin_uninit(plugin, ctx->engine, 1);
-        free(ctx);
-        return NULL;
+        goto failed;
     }
 
     return ctx;
+
+failed:
+    ai_cmd_queue_close(ctx->user_cmdq, NULL);
+    ai_cmd_queue_close(ctx->cmdq, NULL);
+    free(ctx);
+    return NULL;
 }
 
 int ai_tts_set_listener(tts_handle_t handle, tts_callback_t callback, void* cookie)
 {
     tts_context_t* ctx = (tts_context_t*)handle;
 
-    AI_INFO("ai_tts_set_listener:%p", ctx->asyncq);
+    message_t message = { 0 };
+
+    AI_INFO("ai_tts_set_listener:%p", ctx->cmdq);
 
-    if (ctx == NULL || ctx->engine == NULL || ctx->asyncq == NULL)
+    if (ctx == NULL || ctx->engine == NULL || ctx->cmdq == NULL)
         return -1;
 
-    message_t* message = (message_t*)malloc(sizeof(message_t));
-    message_data_listener_t* data = (message_data_listener_t*)calloc(1, sizeof(message_data_listener_t));
-    data->ctx = ctx;
-    data->cb = callback;
-    data->cookie = cookie;
-    message->message_id = TTS_MESSAGE_LISTENER;
-    message->message_handler = ai_tts_set_listener_l;
-    message->message_data = data;
-    return uv_async_queue_send(ctx->asyncq, message);
+    message.message_id = TTS_MESSAGE_LISTENER;
+    message.ctx = ctx;
+    message.data.listener.cb = callback;
+    message.data.listener.cookie = cookie;
+    return ai_tts_send_message(ctx, &message);
 }
 
 int ai_tts_speak(tts_handle_t handle, const char* text, const tts_audio_info_t* audio_info)
 {
     tts_context_t* ctx = (tts_context_t*)handle;
 
-    AI_INFO("ai_tts_speak:%p", ctx->asyncq);
+    message_t message = { 0 };
+    size_t len;
+    int ret;
+
+    AI_INFO("ai_tts_speak:%p", ctx->cmdq);
 
-    if (ctx == NULL || ctx->engine == NULL || ctx->asyncq == NULL)
+    if (ctx == NULL || ctx->engine == NULL || ctx->cmdq == NULL)
         return -EINVAL;
 
-    message_t* message = (message_t*)malloc(sizeof(message_t));
-    message_data_speak_t* data = (message_data_speak_t*)calloc(1, sizeof(message_data_speak_t));
-    data->ctx = ctx;
+    message.message_id = TTS_MESSAGE_START;
+    message.ctx = ctx;
     if (audio_info) {
-        data->audio_info.version = audio_info->version;
-        if (audio_info->format && strlen(audio_info->format) > 0) {
-            data->audio_info.format = (char*)malloc(strlen(audio_info->format) + 1);
-            strlcpy(data->audio_info.format, audio_info->format, strlen(audio_info->format) + 1);
-        }
+        message.data.speak.version = audio_info->version;
+        if (audio_info->format && strlen(audio_info->format) >= TTS_FORMAT_MAX)
+            return -EINVAL;
+        if (audio_info->format)
+            strlcpy(message.data.speak.format, audio_info->format, TTS_FORMAT_MAX);
     }
     if (text) {
-        data->text = (char*)malloc(strlen(text) + 1);
-        strlcpy(data->text, text, strlen(text) + 1);
+        len = strlen(text) + 1;
+        message.data.speak.text = malloc(len);
+        if (message.data.speak.text == NULL)
+            return -ENOMEM;
+        memcpy(message.data.speak.text, text, len);
     }
-    message->message_id = TTS_MESSAGE_START;
-    message->message_handler = ai_tts_speak_l;
-    message->message_data = data;
-    return uv_async_queue_send(ctx->asyncq, message);
+
+    ret = ai_tts_send_message(ctx, &message);
+    if (ret < 0)
+        free(message.data.speak.text);
+
+    return ret;
 }
 
 int ai_tts_stop(tts_handle_t handle)
 {
     tts_context_t* ctx = (tts_context_t*)handle;
 
+    message_t message = { 0 };
+
     AI_INFO("ai_tts_finish");
 
-    if (ctx == NULL || ctx->asyncq == NULL)
+    if (ctx == NULL || ctx->cmdq == NULL)
         return -EINVAL;
 
-    message_t* message = (message_t*)malloc(sizeof(message_t));
-    message_data_finish_t* data = (message_data_finish_t*)calloc(1, sizeof(message_data_finish_t));
-    data->ctx = ctx;
-    message->message_id = TTS_MESSAGE_FINISH;
-    message->message_handler = ai_tts_stop_l;
-    message->message_data = data;
-    return uv_async_queue_send(ctx->asyncq, message);
+    message.message_id = TTS_MESSAGE_FINISH;
+    message.ctx = ctx;
+    return ai_tts_send_message(ctx, &message);
 }
 
 int ai_tts_is_busy(tts_handle_t handle)
@@ -760,44 +940,24 @@ int ai_tts_is_busy(tts_handle_t handle)
 
     AI_INFO("ai_tts_is_busy");
 
-    if (ctx == NULL || ctx->handle == NULL || ctx->engine == NULL || ctx->asyncq == NULL)
+    if (ctx == NULL || ctx->handle == NULL || ctx->engine == NULL || ctx->cmdq == NULL)
         return -EINVAL;
 
     return 0;
 }
 
-static int ai_tts_send_close_message(tts_context_t* ctx)
-{
-    message_t* message = (message_t*)malloc(sizeof(message_t));
-    message_data_close_t* data = (message_data_close_t*)calloc(1, sizeof(message_data_close_t));
-    data->ctx = ctx;
-    message->message_id = TTS_MESSAGE_CLOSE;
-    message->message_handler = ai_tts_close_l;
-    message->message_data = data;
-    return uv_async_queue_send(ctx->asyncq, message);
-}
-
-static void ai_tts_uvasyncq_close_cb(uv_handle_t* handle)
-{
-    tts_context_t* ctx = uv_handle_get_data((const uv_handle_t*)handle);
-    ai_tts_send_close_message(ctx);
-    AI_INFO("ai_tts_uvasyncq_close_cb");
-}
-
 int ai_tts_close(tts_handle_t handle)
 {
     tts_context_t* ctx = (tts_context_t*)handle;
 
+    message_t message = { 0 };
+
     AI_INFO("ai_tts_close");
 
-    if (ctx == NULL || ctx->asyncq == NULL)
+    if (ctx == NULL || ctx->cmdq == NULL)
         return -EINVAL;
 
-    if (ctx->user_loop) {
-        uv_handle_set_data((uv_handle_t*)&(ctx->user_asyncq), ctx);
-        uv_close((uv_handle_t*)&(ctx->user_asyncq), ai_tts_uvasyncq_close_cb);
-        return 0;
-    } else {
-        return ai_tts_send_close_message(ctx);
-    }
+    message.message_id = TTS_MESSAGE_CLOSE;
+    message.ctx = ctx;
+    return ai_tts_send_message(ctx, &message);
 }
@@ -48,6 +48,7 @@ typedef struct tts_engine_result {
     const char* result;
     int len;
     tts_engine_error_t error_code;
+    void* frame; // optional ai_frame_t holding result, callers may take a ref
 } tts_engine_result_t;
 
 typedef struct tts_engine_audio_info {
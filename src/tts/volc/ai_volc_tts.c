@@ -22,8 +22,6 @@
  * Included Files
  ****************************************************************************/
 
-#include <archive.h>
-#include <archive_entry.h>
 #include <errno.h>
 #include <json_object.h>
 #include <json_tokener.h>
@@ -39,8 +37,12 @@
 #include <uv.h>
 #include <uv_async_queue.h>
 
+#include "ai_arena.h"
 #include "ai_common.h"
+#include "ai_frame_pool.h"
+#include "ai_net_cache.h"
 #include "ai_tts_plugin.h"
+#include "ai_zlib.h"
 
 // Message Type
 #define VOLC_PROTOCOL_VERSION 0x01
@@ -92,6 +94,7 @@
 
 #define VOLC_HEADER_LEN 12
 #define VOLC_TIMEOUT 1000 // milliseconds
+#define VOLC_PAYLOAD_MAX_SIZE 64 * 1024 // largest inflated json payload
 
 #define VOLC_LOOP_INTERVAL 10000
 
@@ -111,6 +114,9 @@ struct volc_tts_lws_state {
     unsigned char* recv_buf;
     unsigned char* recv_buf_ptr;
     int recv_buf_size;
+    ai_zlib_t zlib; // gzip state kept for the whole connection
+    unsigned char* send_buf; // LWS_PRE headroom + the largest request sent so far
+    size_t send_buf_size; // usable bytes after the headroom
 };
 
 typedef struct {
@@ -127,6 +133,7 @@ typedef struct {
     int code;
     char* error_msg;
     char* data;
+    ai_frame_t* frame;
     int completed;
     int need_cb;
 } volc_tts_response_result;
@@ -141,12 +148,15 @@ typedef struct volc_tts_context {
     void* opaque;
     tts_engine_env_params_t* env_params;
     sem_t sem;
-    char* cache_text;
+    char* cache_text; // lives in arena
     int cache_len;
+    ai_arena_t arena; // 单次合成的文本和错误信息，speak时重置
     bool is_running;
     bool is_finished;
     bool is_closed;
     struct volc_tts_lws_state* state;
+    uv_async_t release_async; // drops the connection outside lws callbacks
+    uv_async_t stop_async; // wakes the loop for uninit
     tts_engine_audio_info_t audio_info;
 } volc_tts_context_t;
 
@@ -195,6 +205,29 @@ static void volc_tts_generate_message_header(unsigned char* header,
     header[3] = 0;
 }
 
+static char* volc_tts_gunzip_payload(struct volc_tts_lws_state* state, const unsigned char* data, size_t len)
+{
+    size_t size = ai_zlib_gunzip_size(data, len);
+    ssize_t ret;
+    char* out;
+
+    if (size == 0 || size > VOLC_PAYLOAD_MAX_SIZE)
+        return NULL;
+
+    out = ai_arena_alloc(&state->ctx->arena, size + 1);
+    if (out == NULL)
+        return NULL;
+
+    ret = ai_zlib_gunzip(&state->zlib, data, len, out, size);
+    if (ret < 0) {
+        AI_WARN("tts_volc gunzip payload failed:%zd\n", ret);
+        return NULL;
+    }
+    out[ret] = '\0';
+
+    return out;
+}
+
 static int volc_tts_parse_response(struct volc_tts_lws_state* state,
     const unsigned char* res,
     size_t length,
@@ -243,10 +276,16 @@ static int volc_tts_parse_response(struct volc_tts_lws_state* state,
                 memcpy(temp, res + 12 + sid_len, sizeof(temp));
                 result->payload_size = volc_tts_bytes_to_int(temp);
 
-                if (result->payload_size > 0) {
+                if (result->payload_size > 0 && 16 + sid_len + result->payload_size <= length) {
                     AI_INFO("tts_volc audio only response len:%d\n", result->payload_size);
-                    result->data = (char*)malloc(result->payload_size);
-                    memcpy(result->data, res + 16 + sid_len, result->payload_size);
+                    // 优先放进帧池, 上层可以直接引用而不用再拷贝一份;
+                    // 帧池用完时指向接收缓冲, 由ai_tts拷贝到堆上, 音频不会丢
+                    result->frame = ai_frame_alloc(result->payload_size);
+                    if (result->frame) {
+                        result->data = ai_frame_data(result->frame);
+                        memcpy(result->data, res + 16 + sid_len, result->payload_size);
+                    } else
+                        result->data = (char*)res + 16 + sid_len;
                     result->need_cb = 1;
                 } else
                     AI_INFO("tts_volc audio only response null!\n");
@@ -278,12 +317,13 @@ static int volc_tts_parse_response(struct volc_tts_lws_state* state,
         result->payload_size = volc_tts_bytes_to_int(temp);
 
         payload_len = length - VOLC_HEADER_LEN;
-        result->payload = malloc(payload_len + 1);
+        if (result->message_compression == VOLC_GZIP)
+            result->payload = volc_tts_gunzip_payload(state, res + VOLC_HEADER_LEN, payload_len);
+        else
+            result->payload = ai_arena_memdup(&state->ctx->arena, res + VOLC_HEADER_LEN, payload_len);
         if (result->payload == NULL) {
             return -1;
         }
-        memcpy(result->payload, res + VOLC_HEADER_LEN, payload_len);
-        result->payload[payload_len] = '\0';
 
         result->code = result->event;
         result->error_msg = result->payload;
@@ -292,65 +332,111 @@ static int volc_tts_parse_response(struct volc_tts_lws_state* state,
             result->code, result->error_msg);
     }
 
-    if (result->payload) {
-        free(result->payload);
-        result->payload = NULL;
-    }
     return result->event;
 }
 
-static void volc_tts_send_start_connection(struct volc_tts_lws_state* state)
+/* 发送缓冲随连接常驻，只在遇到更大的请求时扩容，前面预留LWS_PRE给lws写帧头 */
+
+static unsigned char* volc_tts_send_buf(struct volc_tts_lws_state* state, size_t size)
 {
-    size_t message_size;
-    unsigned char* message;
-    int payload_len = 4;
-    int dest_pos = LWS_PRE;
-    unsigned char headers[4];
-    unsigned char event[4];
-    char* payload;
-    int len;
+    unsigned char* buf;
 
-    volc_tts_generate_message_header(headers, VOLC_FULL_CLIENT_REQUEST, VOLC_FLAG_EVENT, VOLC_JSON, VOLC_NO_COMPRESSION);
+    if (size > state->send_buf_size) {
+        buf = realloc(state->send_buf, LWS_PRE + size);
+        if (buf == NULL) {
+            AI_WARN("tts_volc no send buffer for %zu bytes\n", size);
+            return NULL;
+        }
+        state->send_buf = buf;
+        state->send_buf_size = size;
+    }
 
-    volc_tts_int_to_bytes(VOLC_EVENT_START_CONNECTION, event);
-    payload = "{}";
+    return state->send_buf + LWS_PRE;
+}
 
-    message_size = sizeof(headers) + sizeof(event) + payload_len + strlen(payload);
-    message = (unsigned char*)malloc(message_size + LWS_PRE);
+/* lws keeps whatever the socket did not take and flushes it before the
+ * next writable callback, so only a negative return loses data */
 
-    memcpy(message + dest_pos, headers, sizeof(headers));
-    dest_pos += sizeof(headers);
+static int volc_tts_write(struct volc_tts_lws_state* state, size_t message_size)
+{
+    int len;
 
-    memcpy(message + dest_pos, event, sizeof(event));
-    dest_pos += sizeof(event);
+    len = lws_write(state->wsi, state->send_buf + LWS_PRE, message_size, LWS_WRITE_BINARY);
+    if (len < 0) {
+        AI_WARN("tts_volc write %zu bytes failed\n", message_size);
+        return -EIO;
+    }
 
-    volc_tts_int_to_bytes(strlen(payload), message + dest_pos);
-    dest_pos += payload_len;
+    if (len < message_size)
+        AI_INFO("tts_volc wrote %d of %zu bytes, rest buffered\n", len, message_size);
 
-    memcpy(message + dest_pos, payload, strlen(payload));
+    return 0;
+}
 
-    len = lws_write(state->wsi, message + LWS_PRE, message_size, LWS_WRITE_BINARY);
-    if (len < message_size)
-        AI_INFO("volc_tts_send_start_connection: len < message_size");
+static int volc_tts_send_start_connection(struct volc_tts_lws_state* state)
+{
+    const char* payload = "{}";
+    unsigned char* message;
+    size_t message_size;
+    int ret;
+
+    message_size = 4 + 4 + 4 + strlen(payload); // header + event + payload size
+    message = volc_tts_send_buf(state, message_size);
+    if (message == NULL)
+        return -ENOMEM;
+
+    volc_tts_generate_message_header(message, VOLC_FULL_CLIENT_REQUEST, VOLC_FLAG_EVENT, VOLC_JSON, VOLC_NO_COMPRESSION);
+    volc_tts_int_to_bytes(VOLC_EVENT_START_CONNECTION, message + 4);
+    volc_tts_int_to_bytes(strlen(payload), message + 8);
+    memcpy(message + 12, payload, strlen(payload));
+
+    ret = volc_tts_write(state, message_size);
 
     AI_INFO("tts_volc send start connection\n");
 
-    free(message);
     lws_callback_on_writable(state->wsi);
+    return ret;
 }
 
-static void volc_tts_send_start_session(struct volc_tts_lws_state* state)
+/* 会话内的json请求: header + event + session id + gzip压缩后的payload */
+
+static int volc_tts_send_session_request(struct volc_tts_lws_state* state, int event_id, const char* json_str)
 {
-    const char* compressed;
-    size_t compressed_len;
-    size_t message_size;
+    ssize_t compressed_len;
+    size_t json_len = strlen(json_str);
+    size_t sid = strlen(state->session_id);
+    size_t bound = ai_zlib_gzip_bound(&state->zlib, json_len);
     unsigned char* message;
-    int payload_len = 4;
-    int sid_len = 4;
-    int dest_pos = LWS_PRE;
-    unsigned char headers[4];
-    unsigned char event[4];
-    int len;
+    size_t pos;
+    int ret;
+
+    pos = 4 + 4 + 4 + sid + 4; // header + event + sid size + sid + payload size
+    message = volc_tts_send_buf(state, pos + bound);
+    if (message == NULL)
+        return -ENOMEM;
+
+    compressed_len = ai_zlib_gzip(&state->zlib, json_str, json_len, message + pos, bound);
+    if (compressed_len < 0) {
+        AI_WARN("tts_volc gzip event %d failed:%zd\n", event_id, compressed_len);
+        return compressed_len;
+    }
+
+    volc_tts_generate_message_header(message, VOLC_FULL_CLIENT_REQUEST, VOLC_FLAG_EVENT, VOLC_JSON, VOLC_GZIP);
+    volc_tts_int_to_bytes(event_id, message + 4);
+    volc_tts_int_to_bytes(sid, message + 8);
+    memcpy(message + 12, state->session_id, sid);
+    volc_tts_int_to_bytes(compressed_len, message + 12 + sid);
+
+    ret = volc_tts_write(state, pos + compressed_len);
+
+    AI_INFO("tts_volc send event %d:%s gzip:%zu->%zd\n", event_id, json_str, json_len, compressed_len);
+
+    return ret;
+}
+
+static int volc_tts_send_start_session(struct volc_tts_lws_state* state)
+{
+    int ret;
 
     struct json_object* payload = json_object_new_object();
     struct json_object* user = json_object_new_object();
@@ -369,61 +455,20 @@ static void volc_tts_send_start_session(struct volc_tts_lws_state* state)
     json_object_object_add(request_params, "audio_params", audio);
 
     json_object_object_add(payload, "req_params", request_params);
-    const char* json_str = json_object_to_json_string(payload);
-
-    compressed_len = strlen(json_str);
-    compressed = json_str;
-
-    volc_tts_generate_message_header(headers, VOLC_FULL_CLIENT_REQUEST, VOLC_FLAG_EVENT, VOLC_JSON, VOLC_NO_COMPRESSION);
-    volc_tts_int_to_bytes(VOLC_EVENT_START_SESSION, event);
+    ret = volc_tts_send_session_request(state, VOLC_EVENT_START_SESSION, json_object_to_json_string(payload));
 
-    message_size = sizeof(headers) + sizeof(event) + sid_len + strlen(state->session_id) + payload_len + compressed_len;
-    message = malloc(message_size + LWS_PRE);
-
-    memcpy(message + dest_pos, headers, sizeof(headers));
-    dest_pos += sizeof(headers);
-
-    memcpy(message + dest_pos, event, sizeof(event));
-    dest_pos += sizeof(event);
-
-    volc_tts_int_to_bytes(strlen(state->session_id), message + dest_pos);
-    dest_pos += sid_len;
-
-    memcpy(message + dest_pos, state->session_id, strlen(state->session_id));
-    dest_pos += strlen(state->session_id);
-
-    volc_tts_int_to_bytes(compressed_len, message + dest_pos);
-    dest_pos += payload_len;
-
-    memcpy(message + dest_pos, compressed, compressed_len);
-
-    len = lws_write(state->wsi, message + LWS_PRE, message_size, LWS_WRITE_BINARY);
-    if (len < message_size)
-        AI_INFO("volc_tts_send_start_session: len < message_size");
-
-    AI_INFO("tts_volc send start session:%s\n", json_str);
-
-    free(message);
-    // free(compressed);
     json_object_put(payload);
     lws_callback_on_writable(state->wsi);
+
+    return ret;
 }
 
-static void volc_tts_send_text(struct volc_tts_lws_state* state)
+static int volc_tts_send_text(struct volc_tts_lws_state* state)
 {
-    const char* compressed;
-    size_t compressed_len;
-    size_t message_size;
-    unsigned char* message;
-    int payload_len = 4;
-    int sid_len = 4;
-    int dest_pos = LWS_PRE;
-    unsigned char headers[4];
-    unsigned char event[4];
-    int len;
+    int ret;
 
     if (state->ctx->is_finished || !state->ctx->cache_text || strlen(state->ctx->cache_text) <= 0)
-        return;
+        return 0;
 
     struct json_object* payload = json_object_new_object();
     struct json_object* user = json_object_new_object();
@@ -442,44 +487,13 @@ static void volc_tts_send_text(struct volc_tts_lws_state* state)
     json_object_object_add(request_params, "audio_params", audio);
 
     json_object_object_add(payload, "req_params", request_params);
-    const char* json_str = json_object_to_json_string(payload);
-
-    compressed_len = strlen(json_str);
-    compressed = json_str;
-
-    volc_tts_generate_message_header(headers, VOLC_FULL_CLIENT_REQUEST, VOLC_FLAG_EVENT, VOLC_JSON, VOLC_NO_COMPRESSION);
-    volc_tts_int_to_bytes(VOLC_EVENT_TASK_REQUEST, event);
-
-    message_size = sizeof(headers) + sizeof(event) + sid_len + strlen(state->session_id) + payload_len + compressed_len;
-    message = malloc(message_size + LWS_PRE);
-
-    memcpy(message + dest_pos, headers, sizeof(headers));
-    dest_pos += sizeof(headers);
-
-    memcpy(message + dest_pos, event, sizeof(event));
-    dest_pos += sizeof(event);
-
-    volc_tts_int_to_bytes(strlen(state->session_id), message + dest_pos);
-    dest_pos += sid_len;
-
-    memcpy(message + dest_pos, state->session_id, strlen(state->session_id));
-    dest_pos += strlen(state->session_id);
-
-    volc_tts_int_to_bytes(compressed_len, message + dest_pos);
-    dest_pos += payload_len;
-
-    memcpy(message + dest_pos, compressed, compressed_len);
-
-    len = lws_write(state->wsi, message + LWS_PRE, message_size, LWS_WRITE_BINARY);
-    if (len < message_size)
-        AI_INFO("volc_tts_send_text: len < message_size");
+    ret = volc_tts_send_session_request(state, VOLC_EVENT_TASK_REQUEST, json_object_to_json_string(payload));
 
-    free(message);
-    // free(compressed);
     json_object_put(payload);
     lws_callback_on_writable(state->wsi);
 
     memset(state->ctx->cache_text, 0, state->ctx->cache_len);
+    return ret;
 }
 
 static int volc_tts_callback_bigtts(struct lws* wsi, enum lws_callback_reasons reason, void* user, void* in, size_t len);
@@ -553,6 +567,7 @@ static int volc_tts_callback_bigtts(struct lws* wsi, enum lws_callback_reasons r
         break;
     case LWS_CALLBACK_CLIENT_ESTABLISHED:
         AI_INFO("tts_volc Connected to server\n");
+        ai_net_cache_connected(wsi, VOLC_HOST, 443);
         lws_callback_on_writable(state->wsi);
         break;
     case LWS_CALLBACK_CLIENT_RECEIVE:
@@ -588,13 +603,14 @@ static int volc_tts_callback_bigtts(struct lws* wsi, enum lws_callback_reasons r
         state->recv_buf_ptr = state->recv_buf;
 
         if (state->ctx->cb && result.need_cb) {
-            tts_engine_result_t cb_result;
+            tts_engine_result_t cb_result = { 0 };
             if (result.data) {
                 cb_result.result = result.data;
                 cb_result.len = result.payload_size;
                 cb_result.error_code = 0;
+                cb_result.frame = result.frame;
                 state->ctx->cb(tts_engine_event_result, &cb_result, state->ctx->cookie);
-                free(result.data);
+                ai_frame_unref(result.frame);
             } else if (result.completed) {
                 cb_result.result = NULL;
                 cb_result.len = result.payload_size;
@@ -616,22 +632,30 @@ static int volc_tts_callback_bigtts(struct lws* wsi, enum lws_callback_reasons r
         break;
     case LWS_CALLBACK_CLIENT_WRITEABLE:
         // AI_INFO("tts_volc Write message of length %zu\n", len);
+        if (lws_partial_buffered(wsi)) {
+            lws_callback_on_writable(wsi);
+            break;
+        }
+        ret = 0;
         if (state->conn_state == VOLC_EVENT_NONE) {
-            volc_tts_send_start_connection(state);
+            ret = volc_tts_send_start_connection(state);
             state->conn_state = VOLC_EVENT_START_CONNECTION;
         } else if (state->conn_state == VOLC_EVENT_CONNECTION_STARTED) {
-            volc_tts_send_start_session(state);
+            ret = volc_tts_send_start_session(state);
             state->conn_state = VOLC_EVENT_START_SESSION;
         } else if (state->conn_state == VOLC_EVENT_SESSION_STARTED)
-            volc_tts_send_text(state);
+            ret = volc_tts_send_text(state);
+        if (ret == -EIO)
+            return -1;
         break;
     case LWS_CALLBACK_CLOSED:
         AI_INFO("tts_volc Connection closed\n");
         break;
     case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
         AI_INFO("tts_volc Connection error: %s\n", in ? (char*)in : "(no error information)");
+        ai_net_cache_failed(VOLC_HOST, 443);
         if (state->ctx->cb) {
-            tts_engine_result_t cb_result;
+            tts_engine_result_t cb_result = { 0 };
             cb_result.error_code = tts_engine_error_network;
             cb_result.result = NULL;
             cb_result.len = 0;
@@ -685,6 +709,7 @@ static void volc_tts_remove_char(char* str, char c)
 static struct lws_context* volc_tts_create_websocket_connection(volc_tts_context_t* ctx)
 {
     struct lws_context_creation_info info;
+    char addr[AI_NET_ADDR_LEN];
     struct lws_context* context;
 
     memset(&info, 0, sizeof(info));
@@ -693,6 +718,12 @@ static struct lws_context* volc_tts_create_websocket_connection(volc_tts_context
     info.gid = -1;
     info.uid = -1;
     info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+#ifdef LWS_WITH_LIBUV
+    /* 直接挂在引擎的uv loop上，socket和定时器事件由uv_run分发 */
+    void* foreign_loops[1] = { &ctx->loop };
+    info.options |= LWS_SERVER_OPTION_LIBUV;
+    info.foreign_loops = foreign_loops;
+#endif
 
     context = lws_create_context(&info);
     if (!context) {
@@ -711,6 +742,7 @@ static struct lws_context* volc_tts_create_websocket_connection(volc_tts_context
     ctx->state->ctx = ctx;
     ctx->state->lws_ctx = context;
     ctx->state->conn_state = VOLC_EVENT_NONE;
+    ai_zlib_init(&ctx->state->zlib);
     volc_tts_generate_uuid(ctx->state->session_id, sizeof(ctx->state->session_id));
     volc_tts_remove_char(ctx->state->session_id, '-');
 
@@ -724,6 +756,7 @@ static struct lws_context* volc_tts_create_websocket_connection(volc_tts_context
     ccinfo.protocol = tts_protocols[0].name;
     ccinfo.ssl_connection = LCCSCF_USE_SSL | LCCSCF_ALLOW_SELFSIGNED | LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK;
     ccinfo.userdata = ctx->state;
+    ai_net_cache_prepare(&ccinfo, addr, sizeof(addr));
 
     ctx->state->wsi = lws_client_connect_via_info(&ccinfo);
     if (!ctx->state->wsi) {
@@ -742,7 +775,7 @@ static struct lws_context* volc_tts_create_websocket_connection(volc_tts_context
 
 static void volc_tts_uv_handle_close(uv_handle_t* handle, void* arg)
 {
-    if (uv_is_active(handle) && !uv_is_closing(handle))
+    if (!uv_is_closing(handle))
         uv_close(handle, NULL);
 }
 
@@ -777,11 +810,12 @@ static void volc_tts_init_data(volc_tts_context_t* ctx)
 
 static void volc_tts_destroy_lws_state(volc_tts_context_t* ctx)
 {
+    ctx->cache_text = NULL;
+    ctx->cache_len = 0;
+    ai_arena_release(&ctx->arena);
+
     if (ctx->state) {
-        if (ctx->cache_text) {
-            free(ctx->cache_text);
-            ctx->cache_text = NULL;
-        }
+        AI_INFO("tts_volc session arena peak:%zu\n", ctx->arena.peak);
 
         if (ctx->state->recv_buf) {
             free(ctx->state->recv_buf);
@@ -790,6 +824,8 @@ static void volc_tts_destroy_lws_state(volc_tts_context_t* ctx)
             ctx->state->recv_buf_size = 0;
         }
 
+        ai_zlib_release(&ctx->state->zlib);
+        free(ctx->state->send_buf);
         free(ctx->state);
         ctx->state = NULL;
     }
@@ -809,6 +845,26 @@ static void volc_tts_destroy_data(volc_tts_context_t* ctx)
     free(ctx);
 }
 
+static void volc_tts_release_connection(volc_tts_context_t* ctx)
+{
+    if (ctx->is_finished && ctx->state && ctx->state->lws_ctx) {
+        lws_context_destroy(ctx->state->lws_ctx);
+        ctx->state->lws_ctx = NULL;
+        volc_tts_destroy_lws_state(ctx);
+        AI_INFO("tts_service stopped!\n");
+    }
+}
+
+static void volc_tts_release_async_cb(uv_async_t* handle)
+{
+    volc_tts_release_connection(uv_handle_get_data((const uv_handle_t*)handle));
+}
+
+static void volc_tts_stop_async_cb(uv_async_t* handle)
+{
+    uv_stop(uv_handle_get_loop((uv_handle_t*)handle));
+}
+
 static void* volc_tts_uvloop_thread(void* arg)
 {
     volc_tts_context_t* ctx = (volc_tts_context_t*)arg;
@@ -830,8 +886,17 @@ static void* volc_tts_uvloop_thread(void* arg)
         AI_INFO("tts_asyncq_init:%p", ctx->asyncq);
     }
 
+    uv_async_init(&ctx->loop, &ctx->stop_async, volc_tts_stop_async_cb);
+    uv_async_init(&ctx->loop, &ctx->release_async, volc_tts_release_async_cb);
+    uv_handle_set_data((uv_handle_t*)&ctx->release_async, ctx);
+
     AI_INFO("[%s][%d] tts_running:%d\n", __func__, __LINE__, uv_loop_alive(&ctx->loop));
 
+#ifdef LWS_WITH_LIBUV
+    sem_post(&ctx->sem);
+    ctx->is_running = true;
+    uv_run(&ctx->loop, UV_RUN_DEFAULT);
+#else
     while (uv_loop_alive(&ctx->loop) && !ctx->is_closed) {
         ret = uv_run(&ctx->loop, UV_RUN_NOWAIT);
         if (ret == 0)
@@ -842,7 +907,7 @@ static void* volc_tts_uvloop_thread(void* arg)
             if (ret < 0) {
                 AI_INFO("tts_service failed\n");
                 if (ctx->cb) {
-                    tts_engine_result_t cb_result;
+                    tts_engine_result_t cb_result = { 0 };
                     cb_result.error_code = tts_engine_error_network;
                     cb_result.result = NULL;
                     cb_result.len = 0;
@@ -850,12 +915,8 @@ static void* volc_tts_uvloop_thread(void* arg)
                 }
                 break;
             }
-        } else if (ctx->is_finished && ctx->state && ctx->state->lws_ctx) {
-            lws_context_destroy(ctx->state->lws_ctx);
-            ctx->state->lws_ctx = NULL;
-            volc_tts_destroy_lws_state(ctx);
-            AI_INFO("tts_service stopped!\n");
-        }
+        } else
+            volc_tts_release_connection(ctx);
 
         if (!ctx->is_running) {
             sem_post(&ctx->sem);
@@ -864,6 +925,7 @@ static void* volc_tts_uvloop_thread(void* arg)
 
         usleep(VOLC_LOOP_INTERVAL);
     }
+#endif
 
     sem_post(&ctx->sem);
 
@@ -925,6 +987,7 @@ static int volc_tts_init(void* engine, const tts_engine_init_params_t* param)
     }
 
     sem_init(&ctx->sem, 0, 0);
+    ai_arena_init(&ctx->arena, 0);
 
     ctx->uvasyncq_cb = param->cb;
     ctx->opaque = param->opaque;
@@ -958,6 +1021,8 @@ static int volc_tts_uninit(void* engine)
     ctx->cb = NULL;
     ctx->cookie = NULL;
     ctx->is_closed = true;
+    if (ctx->is_running)
+        uv_async_send(&ctx->stop_async);
 
     return 0;
 }
@@ -993,13 +1058,11 @@ static int volc_tts_speak(void* engine, const char* text, const tts_engine_audio
     if (!ctx->is_running)
         return -EPERM;
 
-    if (ctx->cache_text == NULL || ctx->cache_len < strlen(text) + 1) {
-        ctx->cache_text = realloc(ctx->cache_text, strlen(text) + 1);
-        if (!ctx->cache_text)
-            return -ENOMEM;
-        ctx->cache_len = strlen(text) + 1;
-    }
-    strlcpy(ctx->cache_text, text, ctx->cache_len);
+    ai_arena_reset(&ctx->arena);
+    ctx->cache_text = ai_arena_strdup(&ctx->arena, text);
+    if (!ctx->cache_text)
+        return -ENOMEM;
+    ctx->cache_len = strlen(text) + 1;
 
     if (!ctx->state || !ctx->state->lws_ctx) {
         context = volc_tts_create_websocket_connection(ctx);
@@ -1023,23 +1086,26 @@ static int volc_tts_stop(void* engine)
         return -EINVAL;
 
     ctx->is_finished = true;
-    ctx->state->conn_state = VOLC_EVENT_NONE;
 
     if (ctx->state == NULL) {
         AI_INFO("tts_volc_tts_stop: state is NULL\n");
         return -EINVAL;
     }
+    ctx->state->conn_state = VOLC_EVENT_NONE;
 
-    if (ctx->cache_text) {
-        free(ctx->cache_text);
-        ctx->cache_text = NULL;
-    }
+    ctx->cache_text = NULL;
+    ctx->cache_len = 0;
+    ai_arena_reset(&ctx->arena);
 
     if (ctx->state->recv_buf)
         ctx->state->recv_buf_ptr = ctx->state->recv_buf;
 
     lws_callback_on_writable(ctx->state->wsi);
 
+    /* stop may run inside an lws callback or on another thread,
+     * release on the next loop turn */
+    uv_async_send(&ctx->release_async);
+
     return 0;
 }
 
@@ -0,0 +1,161 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_arena.c
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ai_arena.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define AI_ARENA_ALIGN(x) (((x) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+#define AI_ARENA_DEFAULT_CHUNK 1024
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+struct ai_arena_chunk_s {
+    ai_arena_chunk_t* prev; // older chunk
+    size_t size;
+    size_t offset;
+    max_align_t data[];
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static ai_arena_chunk_t* ai_arena_new_chunk(ai_arena_t* arena, size_t size)
+{
+    ai_arena_chunk_t* chunk;
+
+    if (size < arena->chunk_size)
+        size = arena->chunk_size;
+
+    chunk = malloc(sizeof(ai_arena_chunk_t) + size);
+    if (chunk == NULL)
+        return NULL;
+
+    chunk->prev = arena->chunk;
+    chunk->size = size;
+    chunk->offset = 0;
+    arena->chunk = chunk;
+    return chunk;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+void ai_arena_init(ai_arena_t* arena, size_t chunk_size)
+{
+    memset(arena, 0, sizeof(ai_arena_t));
+    arena->chunk_size = AI_ARENA_ALIGN(chunk_size ? chunk_size : AI_ARENA_DEFAULT_CHUNK);
+}
+
+void* ai_arena_alloc(ai_arena_t* arena, size_t size)
+{
+    ai_arena_chunk_t* chunk = arena->chunk;
+    void* ptr;
+
+    if (size == 0 || size > SIZE_MAX / 2)
+        return NULL;
+
+    size = AI_ARENA_ALIGN(size);
+    if (chunk == NULL || chunk->size - chunk->offset < size) {
+        chunk = ai_arena_new_chunk(arena, size);
+        if (chunk == NULL)
+            return NULL;
+    }
+
+    ptr = (char*)chunk->data + chunk->offset;
+    chunk->offset += size;
+
+    arena->used += size;
+    if (arena->used > arena->peak)
+        arena->peak = arena->used;
+
+    return ptr;
+}
+
+char* ai_arena_memdup(ai_arena_t* arena, const void* data, size_t len)
+{
+    char* ptr;
+
+    ptr = ai_arena_alloc(arena, len + 1);
+    if (ptr == NULL)
+        return NULL;
+
+    if (len > 0)
+        memcpy(ptr, data, len);
+    ptr[len] = '\0';
+    return ptr;
+}
+
+char* ai_arena_strdup(ai_arena_t* arena, const char* str)
+{
+    if (str == NULL)
+        return NULL;
+
+    return ai_arena_memdup(arena, str, strlen(str));
+}
+
+void ai_arena_reset(ai_arena_t* arena)
+{
+    ai_arena_chunk_t* chunk = arena->chunk;
+    ai_arena_chunk_t* prev;
+
+    if (chunk == NULL)
+        return;
+
+    /* Keep the oldest chunk, anything newer only existed for this session */
+    while (chunk->prev) {
+        prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+
+    chunk->offset = 0;
+    arena->chunk = chunk;
+    arena->used = 0;
+}
+
+void ai_arena_release(ai_arena_t* arena)
+{
+    ai_arena_chunk_t* chunk = arena->chunk;
+    ai_arena_chunk_t* prev;
+
+    while (chunk) {
+        prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+
+    arena->chunk = NULL;
+    arena->used = 0;
+}
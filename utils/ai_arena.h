@@ -0,0 +1,70 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_arena.h
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+#ifndef FRAMEWORKS_AI_ARENA_H_
+#define FRAMEWORKS_AI_ARENA_H_
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* Bump allocator for objects that live exactly as long as a session.
+ *
+ * Memory comes from chunks of chunk_size bytes, larger requests get a
+ * chunk of their own. Nothing is freed individually: ai_arena_reset drops
+ * everything at once but keeps the first chunk for the next session, and
+ * ai_arena_release gives all chunks back to the heap. An arena belongs to
+ * one thread, it does no locking. */
+
+typedef struct ai_arena_chunk_s ai_arena_chunk_t;
+
+typedef struct ai_arena_s {
+    ai_arena_chunk_t* chunk; // newest chunk, allocations come from here
+    size_t chunk_size;
+    size_t used; // bytes handed out since the last reset
+    size_t peak; // largest used ever seen
+} ai_arena_t;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+void ai_arena_init(ai_arena_t* arena, size_t chunk_size);
+void* ai_arena_alloc(ai_arena_t* arena, size_t size);
+char* ai_arena_strdup(ai_arena_t* arena, const char* str);
+char* ai_arena_memdup(ai_arena_t* arena, const void* data, size_t len); // NUL terminated
+void ai_arena_reset(ai_arena_t* arena);
+void ai_arena_release(ai_arena_t* arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAMEWORKS_AI_ARENA_H_
@@ -0,0 +1,540 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_audio_chain.c
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ai_audio_chain.h"
+#include "ai_common.h"
+
+#if defined(CONFIG_AI_AUDIO_CHAIN_SIMD) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define AI_AUDIO_NEON 1
+#elif defined(CONFIG_AI_AUDIO_CHAIN_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define AI_AUDIO_SSE2 1
+#endif
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define AI_AUDIO_MAX_FACTOR 6
+#define AI_AUDIO_UNITY 256 // Q8 gain of 1
+#define AI_AUDIO_DC_POLE 32604 // 0.995 in Q15, about 13Hz at 16kHz
+#define AI_AUDIO_DENOISE_FLOOR 64 // -12dB
+#define AI_AUDIO_DENOISE_RATIO 4 // blocks 6dB over the floor pass
+#define AI_AUDIO_AGC_MIN_ENERGY 10000 // mean square, quieter blocks keep the gain
+#define AI_AUDIO_AGC_MIN 64 // -12dB
+#define AI_AUDIO_AGC_MAX 4096 // +24dB
+#define AI_AUDIO_DEFAULT_AGC_LEVEL (-20)
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static const char* g_audio_stage_names[AI_AUDIO_STAGE_MAX] = {
+    "downmix", "resample", "dc", "denoise", "gain", "agc"
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static uint64_t ai_audio_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline int16_t ai_audio_clamp(int32_t value)
+{
+    if (value > INT16_MAX)
+        return INT16_MAX;
+    if (value < INT16_MIN)
+        return INT16_MIN;
+    return value;
+}
+
+/* Kernels. Each SIMD path handles whole vectors and leaves the tail to
+ * the scalar loop, so both give the same result. */
+
+static void ai_audio_downmix_kernel(int16_t* data, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(AI_AUDIO_NEON)
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t lr = vld2q_s16(data + 2 * i);
+        vst1q_s16(data + i, vhaddq_s16(lr.val[0], lr.val[1]));
+    }
+#elif defined(AI_AUDIO_SSE2)
+    const __m128i ones = _mm_set1_epi16(1);
+
+    for (; i + 8 <= frames; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(data + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(data + 2 * i + 8));
+        a = _mm_srai_epi32(_mm_madd_epi16(a, ones), 1);
+        b = _mm_srai_epi32(_mm_madd_epi16(b, ones), 1);
+        _mm_storeu_si128((__m128i*)(data + i), _mm_packs_epi32(a, b));
+    }
+#endif
+
+    for (; i < frames; i++)
+        data[i] = ((int32_t)data[2 * i] + data[2 * i + 1]) >> 1;
+}
+
+static void ai_audio_scale_kernel(int16_t* data, size_t n, int16_t gain)
+{
+    size_t i = 0;
+
+#if defined(AI_AUDIO_NEON)
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t x = vld1q_s16(data + i);
+        int32x4_t lo = vmull_n_s16(vget_low_s16(x), gain);
+        int32x4_t hi = vmull_n_s16(vget_high_s16(x), gain);
+        vst1q_s16(data + i, vcombine_s16(vqrshrn_n_s32(lo, 8), vqrshrn_n_s32(hi, 8)));
+    }
+#elif defined(AI_AUDIO_SSE2)
+    const __m128i g = _mm_set1_epi16(gain);
+    const __m128i round = _mm_set1_epi32(AI_AUDIO_UNITY / 2);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i pl = _mm_mullo_epi16(x, g);
+        __m128i ph = _mm_mulhi_epi16(x, g);
+        __m128i lo = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(pl, ph), round), 8);
+        __m128i hi = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(pl, ph), round), 8);
+        _mm_storeu_si128((__m128i*)(data + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+
+    for (; i < n; i++)
+        data[i] = ai_audio_clamp(((int32_t)data[i] * gain + AI_AUDIO_UNITY / 2) >> 8);
+}
+
+static uint64_t ai_audio_energy_kernel(const int16_t* data, size_t n)
+{
+    uint64_t sum = 0;
+    size_t i = 0;
+
+#if defined(AI_AUDIO_NEON)
+    int64x2_t acc = vdupq_n_s64(0);
+
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t x = vld1q_s16(data + i);
+        acc = vpadalq_s32(acc, vmull_s16(vget_low_s16(x), vget_low_s16(x)));
+        acc = vpadalq_s32(acc, vmull_s16(vget_high_s16(x), vget_high_s16(x)));
+    }
+    sum = vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1);
+#elif defined(AI_AUDIO_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    uint64_t lanes[2];
+
+    /* a pair of squares can reach 2^31, so widen as unsigned */
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i sq = _mm_madd_epi16(x, x);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+
+    for (; i < n; i++)
+        sum += (int32_t)data[i] * data[i];
+
+    return sum;
+}
+
+/* n is a multiple of 8 */
+
+static int32_t ai_audio_dot_kernel(const int16_t* a, const int16_t* b, size_t n)
+{
+    int32_t sum = 0;
+    size_t i = 0;
+
+#if defined(AI_AUDIO_NEON)
+    int32x4_t acc = vdupq_n_s32(0);
+
+    for (; i < n; i += 8) {
+        int16x8_t x = vld1q_s16(a + i);
+        int16x8_t y = vld1q_s16(b + i);
+        acc = vmlal_s16(acc, vget_low_s16(x), vget_low_s16(y));
+        acc = vmlal_s16(acc, vget_high_s16(x), vget_high_s16(y));
+    }
+    sum = vgetq_lane_s32(acc, 0) + vgetq_lane_s32(acc, 1) + vgetq_lane_s32(acc, 2) + vgetq_lane_s32(acc, 3);
+#elif defined(AI_AUDIO_SSE2)
+    __m128i acc = _mm_setzero_si128();
+    int32_t lanes[4];
+
+    for (; i < n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(x, y));
+    }
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+    for (; i < n; i++)
+        sum += (int32_t)a[i] * b[i];
+
+    return sum;
+}
+
+/* Windowed-sinc low-pass with its cutoff a little under the new Nyquist
+ * rate, normalized to unity gain at DC */
+
+static void ai_audio_design_fir(ai_audio_chain_t* chain)
+{
+    float taps[AI_AUDIO_FIR_TAPS];
+    float fc = 0.45f / chain->factor;
+    float center = (AI_AUDIO_FIR_TAPS - 1) / 2.0f;
+    float sum = 0;
+    float x;
+    int i;
+
+    for (i = 0; i < AI_AUDIO_FIR_TAPS; i++) {
+        x = i - center;
+        taps[i] = 2 * fc * sinf(2 * (float)M_PI * fc * x) / (2 * (float)M_PI * fc * x);
+        taps[i] *= 0.54f - 0.46f * cosf(2 * (float)M_PI * i / (AI_AUDIO_FIR_TAPS - 1));
+        sum += taps[i];
+    }
+
+    for (i = 0; i < AI_AUDIO_FIR_TAPS; i++)
+        chain->fir[i] = lrintf(taps[i] / sum * 32767);
+}
+
+/* Runs in fir_buf, so outputs written back to data never overtake the
+ * input still to be read. n is a multiple of factor. */
+
+static size_t ai_audio_decimate(ai_audio_chain_t* chain, int16_t* data, size_t n)
+{
+    const size_t history = AI_AUDIO_FIR_TAPS - 1;
+    int16_t* buf = chain->fir_buf;
+    size_t out = 0;
+    size_t pos;
+    size_t take;
+    size_t i;
+
+    for (pos = 0; pos < n; pos += take) {
+        take = n - pos < AI_AUDIO_FIR_BLOCK ? n - pos : AI_AUDIO_FIR_BLOCK;
+        memcpy(buf + history, data + pos, take * sizeof(int16_t));
+
+        for (i = chain->factor - 1; i < take; i += chain->factor)
+            data[out++] = ai_audio_clamp((ai_audio_dot_kernel(buf + i, chain->fir, AI_AUDIO_FIR_TAPS) + (1 << 14)) >> 15);
+
+        memmove(buf, buf + take, history * sizeof(int16_t));
+    }
+
+    return out;
+}
+
+/* One-pole high-pass per channel: y = x - x[-1] + 0.995 * y[-1] */
+
+static void ai_audio_dc_remove(ai_audio_chain_t* chain, int16_t* data, size_t frames)
+{
+    int channels = chain->out_channels;
+    int32_t x;
+    int32_t y;
+    size_t i;
+    int ch;
+
+    for (ch = 0; ch < channels; ch++) {
+        for (i = ch; i < frames * channels; i += channels) {
+            x = data[i];
+            y = x - chain->dc_x[ch] + (int32_t)(((int64_t)chain->dc_y[ch] * AI_AUDIO_DC_POLE + (1 << 14)) >> 15);
+            chain->dc_x[ch] = x;
+            chain->dc_y[ch] = y;
+            data[i] = ai_audio_clamp(y);
+        }
+    }
+}
+
+/* The floor drops quickly and creeps up slowly, like the vad. Blocks near
+ * it fade to the floor gain and come back at once when speech returns. */
+
+static void ai_audio_denoise(ai_audio_chain_t* chain, int16_t* data, size_t n)
+{
+    uint64_t energy;
+    int16_t target;
+
+    energy = ai_audio_energy_kernel(data, n) / n;
+    if (chain->noise == 0)
+        chain->noise = energy ? energy : 1;
+    else if (energy < chain->noise)
+        chain->noise -= (chain->noise - energy) / 4;
+    else
+        chain->noise += chain->noise / 64 + 1;
+
+    target = energy > chain->noise * AI_AUDIO_DENOISE_RATIO ? AI_AUDIO_UNITY : AI_AUDIO_DENOISE_FLOOR;
+    if (target > chain->denoise_gain)
+        chain->denoise_gain += (target - chain->denoise_gain + 1) / 2;
+    else
+        chain->denoise_gain -= (chain->denoise_gain - target) / 8;
+
+    if (chain->denoise_gain != AI_AUDIO_UNITY)
+        ai_audio_scale_kernel(data, n, chain->denoise_gain);
+}
+
+/* The gain falls at once to stay out of clipping and rises slowly, quiet
+ * blocks leave it alone so pauses are not pumped up */
+
+static void ai_audio_agc(ai_audio_chain_t* chain, int16_t* data, size_t n)
+{
+    uint64_t energy = ai_audio_energy_kernel(data, n) / n;
+    int32_t desired;
+
+    if (energy >= AI_AUDIO_AGC_MIN_ENERGY) {
+        desired = AI_AUDIO_UNITY * sqrtf((float)chain->agc_target / energy);
+        if (desired < AI_AUDIO_AGC_MIN)
+            desired = AI_AUDIO_AGC_MIN;
+        else if (desired > AI_AUDIO_AGC_MAX)
+            desired = AI_AUDIO_AGC_MAX;
+
+        if (desired < chain->agc_gain)
+            chain->agc_gain = desired;
+        else
+            chain->agc_gain += (desired - chain->agc_gain) / 32;
+    }
+
+    if (chain->agc_gain != AI_AUDIO_UNITY)
+        ai_audio_scale_kernel(data, n, chain->agc_gain);
+}
+
+static void ai_audio_blocks(ai_audio_chain_t* chain, int16_t* data, size_t frames,
+    void (*stage)(ai_audio_chain_t* chain, int16_t* data, size_t n))
+{
+    size_t block = chain->block * chain->out_channels;
+    size_t n = frames * chain->out_channels;
+    size_t pos;
+
+    for (pos = 0; pos < n; pos += block)
+        stage(chain, data + pos, n - pos < block ? n - pos : block);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int ai_audio_parse_format(const char* format, int* sample_rate, int* channels)
+{
+    const char* value;
+
+    if (format == NULL || strstr(format, "s16le") == NULL)
+        return -ENOTSUP;
+
+    *sample_rate = 16000;
+    value = strstr(format, "sample_rate=");
+    if (value)
+        *sample_rate = atoi(value + strlen("sample_rate="));
+    *channels = strstr(format, "stereo") ? 2 : 1;
+
+    return *sample_rate > 0 ? 0 : -EINVAL;
+}
+
+int ai_audio_chain_init(ai_audio_chain_t* chain, const ai_audio_process_t* params,
+    int out_rate, int out_channels)
+{
+    int channels;
+    int gain_db;
+    int level;
+
+    if (chain == NULL || params == NULL || params->stages == 0 || out_rate <= 0)
+        return -EINVAL;
+
+    memset(chain, 0, sizeof(ai_audio_chain_t));
+    chain->stages = params->stages;
+    chain->in_rate = params->sample_rate ? params->sample_rate : out_rate;
+    chain->in_channels = params->channels ? params->channels : out_channels;
+    chain->out_rate = out_rate;
+    chain->out_channels = out_channels;
+    chain->factor = 1;
+
+    if (chain->in_channels < 1 || chain->in_channels > 2)
+        return -EINVAL;
+
+    channels = chain->in_channels;
+    if (chain->stages & AI_AUDIO_DOWNMIX) {
+        if (channels != 2)
+            return -EINVAL;
+        channels = 1;
+    }
+    if (channels != out_channels)
+        return -EINVAL;
+
+    if (chain->stages & AI_AUDIO_RESAMPLE) {
+        chain->factor = chain->in_rate / out_rate;
+        if (channels != 1 || chain->in_rate % out_rate != 0
+            || chain->factor < 2 || chain->factor > AI_AUDIO_MAX_FACTOR)
+            return -ENOTSUP;
+        ai_audio_design_fir(chain);
+    } else if (chain->in_rate != out_rate) {
+        return -EINVAL;
+    }
+
+    chain->unit_bytes = chain->in_channels * chain->factor * sizeof(int16_t);
+    chain->block = out_rate / 100 > 0 ? out_rate / 100 : 1;
+
+    gain_db = params->gain_db < -20 ? -20 : params->gain_db > 30 ? 30 : params->gain_db;
+    chain->gain = lrintf(AI_AUDIO_UNITY * powf(10, gain_db / 20.0f));
+
+    level = params->agc_level_db ? params->agc_level_db : AI_AUDIO_DEFAULT_AGC_LEVEL;
+    if (level > 0)
+        level = 0;
+    chain->agc_target = powf(32768 * powf(10, level / 20.0f), 2);
+
+    ai_audio_chain_reset(chain);
+    return 0;
+}
+
+void ai_audio_chain_reset(ai_audio_chain_t* chain)
+{
+    chain->carry_len = 0;
+    memset(chain->fir_buf, 0, sizeof(chain->fir_buf));
+    memset(chain->dc_x, 0, sizeof(chain->dc_x));
+    memset(chain->dc_y, 0, sizeof(chain->dc_y));
+    chain->noise = 0;
+    chain->denoise_gain = AI_AUDIO_UNITY;
+    chain->agc_gain = AI_AUDIO_UNITY;
+}
+
+int ai_audio_chain_capture_format(const ai_audio_chain_t* chain, char* format, size_t size)
+{
+    int ret;
+
+    ret = snprintf(format, size, "format=s16le:sample_rate=%d:ch_layout=%s",
+        chain->in_rate, chain->in_channels == 2 ? "stereo" : "mono");
+
+    return ret > 0 && (size_t)ret < size ? 0 : -ENOSPC;
+}
+
+size_t ai_audio_chain_process(ai_audio_chain_t* chain, char* data, size_t len)
+{
+    int16_t* samples = (int16_t*)data;
+    size_t frames;
+    uint64_t start;
+    uint64_t now;
+    size_t tail;
+
+    if (chain->carry_len) {
+        memmove(data + chain->carry_len, data, len);
+        memcpy(data, chain->carry, chain->carry_len);
+        len += chain->carry_len;
+        chain->carry_len = 0;
+    }
+
+    tail = len % chain->unit_bytes;
+    len -= tail;
+    memcpy(chain->carry, data + len, tail);
+    chain->carry_len = tail;
+
+    frames = len / (chain->in_channels * sizeof(int16_t));
+    if (frames == 0)
+        return 0;
+
+    start = ai_audio_now_us();
+
+    if (chain->stages & AI_AUDIO_DOWNMIX) {
+        ai_audio_downmix_kernel(samples, frames);
+        now = ai_audio_now_us();
+        chain->cpu_us[AI_AUDIO_STAGE_DOWNMIX] += now - start;
+        start = now;
+    }
+
+    if (chain->stages & AI_AUDIO_RESAMPLE) {
+        frames = ai_audio_decimate(chain, samples, frames);
+        now = ai_audio_now_us();
+        chain->cpu_us[AI_AUDIO_STAGE_RESAMPLE] += now - start;
+        start = now;
+    }
+
+    if (chain->stages & AI_AUDIO_DC_REMOVE) {
+        ai_audio_dc_remove(chain, samples, frames);
+        now = ai_audio_now_us();
+        chain->cpu_us[AI_AUDIO_STAGE_DC_REMOVE] += now - start;
+        start = now;
+    }
+
+    if (chain->stages & AI_AUDIO_DENOISE) {
+        ai_audio_blocks(chain, samples, frames, ai_audio_denoise);
+        now = ai_audio_now_us();
+        chain->cpu_us[AI_AUDIO_STAGE_DENOISE] += now - start;
+        start = now;
+    }
+
+    if ((chain->stages & AI_AUDIO_GAIN) && chain->gain != AI_AUDIO_UNITY) {
+        ai_audio_scale_kernel(samples, frames * chain->out_channels, chain->gain);
+        now = ai_audio_now_us();
+        chain->cpu_us[AI_AUDIO_STAGE_GAIN] += now - start;
+        start = now;
+    }
+
+    if (chain->stages & AI_AUDIO_AGC) {
+        ai_audio_blocks(chain, samples, frames, ai_audio_agc);
+        chain->cpu_us[AI_AUDIO_STAGE_AGC] += ai_audio_now_us() - start;
+    }
+
+    chain->samples += frames;
+    return frames * chain->out_channels * sizeof(int16_t);
+}
+
+void ai_audio_chain_report(ai_audio_chain_t* chain, const char* tag)
+{
+    char line[160];
+    size_t len = 0;
+    int ret;
+    int i;
+
+    (void)tag; // only read by AI_INFO, which the log level may compile out
+
+    if (chain->samples == 0)
+        return;
+
+    line[0] = '\0';
+    for (i = 0; i < AI_AUDIO_STAGE_MAX && len < sizeof(line); i++) {
+        if (!(chain->stages & (1 << i)))
+            continue;
+        ret = snprintf(line + len, sizeof(line) - len, " %s:%lluus",
+            g_audio_stage_names[i], (unsigned long long)chain->cpu_us[i]);
+        if (ret < 0)
+            break;
+        len += ret;
+    }
+
+    AI_INFO("%s audio chain %llums of audio,%s\n", tag,
+        (unsigned long long)(chain->samples * 1000 / chain->out_rate), line);
+
+    memset(chain->cpu_us, 0, sizeof(chain->cpu_us));
+    chain->samples = 0;
+}
@@ -0,0 +1,115 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_audio_chain.h
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+#ifndef FRAMEWORKS_AI_AUDIO_CHAIN_H_
+#define FRAMEWORKS_AI_AUDIO_CHAIN_H_
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ai_defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define AI_AUDIO_CHAIN_HEADROOM 32 // spare bytes process needs after the data
+#define AI_AUDIO_FIR_TAPS 32
+#define AI_AUDIO_FIR_BLOCK 480 // input samples per decimation pass, a multiple of 2-6
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+typedef enum {
+    AI_AUDIO_STAGE_DOWNMIX,
+    AI_AUDIO_STAGE_RESAMPLE,
+    AI_AUDIO_STAGE_DC_REMOVE,
+    AI_AUDIO_STAGE_DENOISE,
+    AI_AUDIO_STAGE_GAIN,
+    AI_AUDIO_STAGE_AGC,
+    AI_AUDIO_STAGE_MAX,
+} ai_audio_stage_t;
+
+/* Preprocessing between the recorder and an engine, on s16le pcm.
+ *
+ * process works in place on a 16-bit aligned buffer and returns how many
+ * bytes of engine format audio it left at the start of it. Input may be
+ * split anywhere; a partial sample frame is carried into the next call,
+ * which is why the buffer needs AI_AUDIO_CHAIN_HEADROOM spare bytes after
+ * the data. The hot loops have NEON and SSE2 kernels with CONFIG_AI_AUDIO_
+ * CHAIN_SIMD and a scalar fallback. Time spent in each stage accumulates
+ * until report logs and clears it. */
+
+typedef struct ai_audio_chain_s {
+    int stages; // AI_AUDIO_* bits
+    int in_rate;
+    int in_channels;
+    int out_rate;
+    int out_channels;
+    int factor; // decimation factor, 1 without AI_AUDIO_RESAMPLE
+    int unit_bytes; // input bytes per output sample frame
+    int block; // output samples per 10ms block
+    uint8_t carry[AI_AUDIO_CHAIN_HEADROOM];
+    int carry_len;
+    int16_t fir[AI_AUDIO_FIR_TAPS]; // low-pass taps, Q15
+    int16_t fir_buf[AI_AUDIO_FIR_TAPS - 1 + AI_AUDIO_FIR_BLOCK]; // history, then the input
+    int32_t dc_x[2];
+    int32_t dc_y[2];
+    uint64_t noise; // noise floor, mean square
+    int16_t denoise_gain; // Q8
+    int16_t gain; // Q8
+    int16_t agc_gain; // Q8
+    uint64_t agc_target; // mean square
+    uint64_t cpu_us[AI_AUDIO_STAGE_MAX];
+    uint64_t samples; // output sample frames since the last report
+} ai_audio_chain_t;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/* Read format=s16le:sample_rate=16000:ch_layout=mono style formats */
+
+int ai_audio_parse_format(const char* format, int* sample_rate, int* channels);
+
+/* out_rate and out_channels describe what the engine takes, capture_format
+ * then writes the recorder format that feeds the chain */
+
+int ai_audio_chain_init(ai_audio_chain_t* chain, const ai_audio_process_t* params,
+    int out_rate, int out_channels);
+void ai_audio_chain_reset(ai_audio_chain_t* chain);
+int ai_audio_chain_capture_format(const ai_audio_chain_t* chain, char* format, size_t size);
+size_t ai_audio_chain_process(ai_audio_chain_t* chain, char* data, size_t len);
+void ai_audio_chain_report(ai_audio_chain_t* chain, const char* tag);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAMEWORKS_AI_AUDIO_CHAIN_H_
@@ -0,0 +1,359 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_cmd_queue.c
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ai_cmd_queue.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define AI_CMD_ALIGN(x) (((x) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+#define AI_CMD_SLOT_HEADER AI_CMD_ALIGN(sizeof(atomic_size_t))
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+typedef struct ai_cmd_node_s {
+    struct ai_cmd_node_s* next;
+    max_align_t cmd[]; // cmd_size bytes
+} ai_cmd_node_t;
+
+struct ai_cmd_queue_s {
+    uv_async_t async;
+    ai_cmd_queue_cb_t cb;
+    ai_cmd_queue_cb_t discard;
+    ai_cmd_queue_close_cb_t close_cb;
+    void* data;
+    size_t cmd_size;
+    size_t stride;
+    size_t mask;
+    atomic_size_t head; // next slot to claim, shared by producers
+    size_t tail; // next slot to dispatch, loop thread only
+    atomic_bool attached;
+    atomic_bool closed;
+    atomic_int senders; // send/post calls still touching the queue
+    atomic_size_t overflowed; // commands waiting in the heap list
+    pthread_mutex_t lock; // guards the heap list
+    ai_cmd_node_t* overflow_head;
+    ai_cmd_node_t* overflow_tail;
+    char* slots;
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* Each slot starts with a sequence number: pos while it is free for the
+ * producer claiming pos, pos + 1 once the command at pos is readable. */
+
+static inline atomic_size_t* ai_cmd_queue_seq(ai_cmd_queue_t* queue, size_t pos)
+{
+    return (atomic_size_t*)(queue->slots + (pos & queue->mask) * queue->stride);
+}
+
+static inline void* ai_cmd_queue_payload(ai_cmd_queue_t* queue, size_t pos)
+{
+    return queue->slots + (pos & queue->mask) * queue->stride + AI_CMD_SLOT_HEADER;
+}
+
+static ai_cmd_node_t* ai_cmd_queue_pop_overflow(ai_cmd_queue_t* queue)
+{
+    ai_cmd_node_t* node;
+
+    pthread_mutex_lock(&queue->lock);
+    node = queue->overflow_head;
+    if (node) {
+        queue->overflow_head = node->next;
+        if (queue->overflow_head == NULL)
+            queue->overflow_tail = NULL;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return node;
+}
+
+/* The slots are drained first: while the heap list is non-empty every new
+ * command joins it, so it only ever holds commands newer than the slots. */
+
+static void ai_cmd_queue_drain(ai_cmd_queue_t* queue, ai_cmd_queue_cb_t cb)
+{
+    ai_cmd_node_t* node;
+    atomic_size_t* seq;
+
+    for (;;) {
+        seq = ai_cmd_queue_seq(queue, queue->tail);
+        if (atomic_load_explicit(seq, memory_order_acquire) != queue->tail + 1)
+            break;
+
+        if (cb)
+            cb(queue->data, ai_cmd_queue_payload(queue, queue->tail));
+
+        atomic_store_explicit(seq, queue->tail + queue->mask + 1, memory_order_release);
+        queue->tail++;
+
+        /* A handler may close the queue, the rest go to discard */
+        if (cb == queue->cb && atomic_load_explicit(&queue->closed, memory_order_relaxed))
+            return;
+    }
+
+    while ((node = ai_cmd_queue_pop_overflow(queue)) != NULL) {
+        if (cb)
+            cb(queue->data, node->cmd);
+        free(node);
+        atomic_fetch_sub(&queue->overflowed, 1);
+
+        if (cb == queue->cb && atomic_load_explicit(&queue->closed, memory_order_relaxed))
+            return;
+    }
+}
+
+static void ai_cmd_queue_release(ai_cmd_queue_t* queue)
+{
+    ai_cmd_queue_close_cb_t close_cb = queue->close_cb;
+    void* data = queue->data;
+
+    /* closed is set, so a sender still counted here is already past that
+     * check and only has a copy and a wakeup left, let it finish */
+    while (atomic_load(&queue->senders) > 0)
+        sched_yield();
+
+    ai_cmd_queue_drain(queue, queue->discard);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+
+    if (close_cb)
+        close_cb(data);
+}
+
+static void ai_cmd_queue_async_cb(uv_async_t* handle)
+{
+    ai_cmd_queue_t* queue = uv_handle_get_data((const uv_handle_t*)handle);
+
+    if (!atomic_load_explicit(&queue->closed, memory_order_relaxed))
+        ai_cmd_queue_drain(queue, queue->cb);
+}
+
+static void ai_cmd_queue_close_cb(uv_handle_t* handle)
+{
+    ai_cmd_queue_release(uv_handle_get_data(handle));
+}
+
+static int ai_cmd_queue_push(ai_cmd_queue_t* queue, const void* cmd, size_t len)
+{
+    atomic_size_t* seq;
+    size_t pos;
+    intptr_t diff;
+
+    /* Keep the order behind commands that went to the heap */
+    if (atomic_load(&queue->overflowed) > 0)
+        return -EAGAIN;
+
+    pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    for (;;) {
+        seq = ai_cmd_queue_seq(queue, pos);
+        diff = (intptr_t)atomic_load_explicit(seq, memory_order_acquire) - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0)
+            return -EAGAIN;
+        else
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    }
+
+    memcpy(ai_cmd_queue_payload(queue, pos), cmd, len);
+    atomic_store_explicit(seq, pos + 1, memory_order_release);
+
+    /* Pairs with attach: either we see the handle or its first drain
+     * sees this command */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->attached, memory_order_relaxed))
+        uv_async_send(&queue->async);
+
+    return 0;
+}
+
+static int ai_cmd_queue_push_heap(ai_cmd_queue_t* queue, const void* cmd, size_t len)
+{
+    ai_cmd_node_t* node;
+
+    node = malloc(sizeof(ai_cmd_node_t) + queue->cmd_size);
+    if (node == NULL)
+        return -ENOMEM;
+
+    memcpy(node->cmd, cmd, len);
+    node->next = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->overflow_tail)
+        queue->overflow_tail->next = node;
+    else
+        queue->overflow_head = node;
+    queue->overflow_tail = node;
+    atomic_fetch_add(&queue->overflowed, 1);
+    pthread_mutex_unlock(&queue->lock);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->attached, memory_order_relaxed))
+        uv_async_send(&queue->async);
+
+    return 0;
+}
+
+/* The caller counts as a sender before it looks at closed. Both are
+ * seq_cst, so either release sees the count and waits for it, or the
+ * sender sees closed and backs out. */
+
+static bool ai_cmd_queue_enter(ai_cmd_queue_t* queue)
+{
+    atomic_fetch_add(&queue->senders, 1);
+    if (atomic_load(&queue->closed)) {
+        atomic_fetch_sub(&queue->senders, 1);
+        return false;
+    }
+
+    return true;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+ai_cmd_queue_t* ai_cmd_queue_create(size_t cmd_size, size_t capacity,
+    ai_cmd_queue_cb_t cb, ai_cmd_queue_cb_t discard, void* data)
+{
+    ai_cmd_queue_t* queue;
+    size_t slots = 2;
+    size_t stride;
+    size_t i;
+
+    if (cmd_size == 0 || capacity == 0 || cb == NULL)
+        return NULL;
+
+    while (slots < capacity)
+        slots <<= 1;
+
+    stride = AI_CMD_SLOT_HEADER + AI_CMD_ALIGN(cmd_size);
+    queue = malloc(AI_CMD_ALIGN(sizeof(ai_cmd_queue_t)) + slots * stride);
+    if (queue == NULL)
+        return NULL;
+
+    memset(queue, 0, sizeof(ai_cmd_queue_t));
+    queue->cb = cb;
+    queue->discard = discard;
+    queue->data = data;
+    queue->cmd_size = cmd_size;
+    queue->stride = stride;
+    queue->mask = slots - 1;
+    queue->slots = (char*)queue + AI_CMD_ALIGN(sizeof(ai_cmd_queue_t));
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->attached, false);
+    atomic_init(&queue->closed, false);
+    atomic_init(&queue->senders, 0);
+    atomic_init(&queue->overflowed, 0);
+    pthread_mutex_init(&queue->lock, NULL);
+
+    for (i = 0; i < slots; i++)
+        atomic_init(ai_cmd_queue_seq(queue, i), i);
+
+    return queue;
+}
+
+int ai_cmd_queue_attach(ai_cmd_queue_t* queue, uv_loop_t* loop)
+{
+    int ret;
+
+    if (queue == NULL || loop == NULL)
+        return -EINVAL;
+
+    ret = uv_async_init(loop, &queue->async, ai_cmd_queue_async_cb);
+    if (ret < 0)
+        return ret;
+
+    uv_handle_set_data((uv_handle_t*)&queue->async, queue);
+    atomic_store(&queue->attached, true);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    /* Pick up whatever was sent before the handle existed */
+    return uv_async_send(&queue->async);
+}
+
+int ai_cmd_queue_send(ai_cmd_queue_t* queue, const void* cmd, size_t len)
+{
+    int ret;
+
+    if (queue == NULL || cmd == NULL || len > queue->cmd_size)
+        return -EINVAL;
+
+    if (!ai_cmd_queue_enter(queue))
+        return -EPIPE;
+
+    ret = ai_cmd_queue_push(queue, cmd, len);
+    atomic_fetch_sub(&queue->senders, 1);
+
+    return ret;
+}
+
+int ai_cmd_queue_post(ai_cmd_queue_t* queue, const void* cmd, size_t len)
+{
+    int ret;
+
+    if (queue == NULL || cmd == NULL || len > queue->cmd_size)
+        return -EINVAL;
+
+    if (!ai_cmd_queue_enter(queue))
+        return -EPIPE;
+
+    ret = ai_cmd_queue_push(queue, cmd, len);
+    if (ret == -EAGAIN)
+        ret = ai_cmd_queue_push_heap(queue, cmd, len);
+    atomic_fetch_sub(&queue->senders, 1);
+
+    return ret;
+}
+
+void ai_cmd_queue_close(ai_cmd_queue_t* queue, ai_cmd_queue_close_cb_t cb)
+{
+    if (queue == NULL)
+        return;
+
+    queue->close_cb = cb;
+    atomic_store(&queue->closed, true);
+
+    if (atomic_load(&queue->attached))
+        uv_close((uv_handle_t*)&queue->async, ai_cmd_queue_close_cb);
+    else
+        ai_cmd_queue_release(queue);
+}
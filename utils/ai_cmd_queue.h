@@ -0,0 +1,91 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_cmd_queue.h
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+#ifndef FRAMEWORKS_AI_CMD_QUEUE_H_
+#define FRAMEWORKS_AI_CMD_QUEUE_H_
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stddef.h>
+#include <uv.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* Bounded multi-producer command queue drained on a libuv loop.
+ *
+ * Commands are copied by value into slots that are allocated once at
+ * create time, so send never touches the heap; post may, when full.
+ * The handler runs on the loop the queue is attached to and sees the
+ * command in place, it must not keep the pointer. Commands sent before
+ * attach are kept and dispatched once the queue is attached.
+ *
+ * Any thread may send until close. Close waits for sends already inside
+ * the queue, later ones get -EPIPE, but the owner must stop handing out
+ * the pointer first: a sender that loads it after the memory is freed is
+ * not covered, so owners clear their copy before they call close.
+ *
+ * The queue owns its memory and frees it after close, so it can outlive
+ * the context that created it. Commands still queued at close go to the
+ * discard callback, which should only release what the command carries. */
+
+typedef struct ai_cmd_queue_s ai_cmd_queue_t;
+
+typedef void (*ai_cmd_queue_cb_t)(void* data, void* cmd);
+typedef void (*ai_cmd_queue_close_cb_t)(void* data);
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+ai_cmd_queue_t* ai_cmd_queue_create(size_t cmd_size, size_t capacity,
+    ai_cmd_queue_cb_t cb, ai_cmd_queue_cb_t discard, void* data);
+
+/* Must be called on the loop thread */
+
+int ai_cmd_queue_attach(ai_cmd_queue_t* queue, uv_loop_t* loop);
+
+/* Returns -EAGAIN when every slot is in use and -EPIPE after close */
+
+int ai_cmd_queue_send(ai_cmd_queue_t* queue, const void* cmd, size_t len);
+
+/* Like send, but a command that finds every slot in use is copied to the
+ * heap instead of refused, for the ones that must not be lost. Order is
+ * kept: plain sends get -EAGAIN until the heap copies are dispatched. */
+
+int ai_cmd_queue_post(ai_cmd_queue_t* queue, const void* cmd, size_t len);
+
+/* Must be called on the loop thread, or before attach. cb runs once the
+ * queue is gone and may be NULL. */
+
+void ai_cmd_queue_close(ai_cmd_queue_t* queue, ai_cmd_queue_close_cb_t cb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAMEWORKS_AI_CMD_QUEUE_H_
@@ -0,0 +1,231 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_frame_pool.c
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "ai_frame_pool.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define AI_FRAME_CLASSES 2
+#define AI_FRAME_HEAP UINT16_MAX // klass of a frame that came from malloc
+
+#define AI_FRAME_STRIDE(size) \
+    ((offsetof(ai_frame_t, data) + (size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+typedef struct ai_frame_class_s {
+    size_t size;
+    size_t count;
+    pthread_mutex_t lock;
+    ai_frame_t* free_list;
+} ai_frame_class_t;
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static ai_frame_class_t g_frame_classes[AI_FRAME_CLASSES] = {
+    { AI_FRAME_MEDIUM_SIZE, CONFIG_AI_FRAME_POOL_MEDIUM, PTHREAD_MUTEX_INITIALIZER, NULL },
+    { AI_FRAME_LARGE_SIZE, CONFIG_AI_FRAME_POOL_LARGE, PTHREAD_MUTEX_INITIALIZER, NULL },
+};
+
+static pthread_once_t g_frame_once = PTHREAD_ONCE_INIT;
+static char* g_frame_memory;
+static atomic_size_t g_frame_in_use;
+static atomic_size_t g_frame_peak;
+static atomic_size_t g_frame_failures;
+static atomic_size_t g_frame_fallbacks;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static void ai_frame_pool_init(void)
+{
+    size_t total = 0;
+    char* ptr;
+    size_t j;
+    int i;
+
+    for (i = 0; i < AI_FRAME_CLASSES; i++)
+        total += AI_FRAME_STRIDE(g_frame_classes[i].size) * g_frame_classes[i].count;
+
+    /* One block for the whole pool, carved up once and never returned */
+    g_frame_memory = malloc(total);
+    if (g_frame_memory == NULL)
+        return;
+
+    ptr = g_frame_memory;
+    for (i = 0; i < AI_FRAME_CLASSES; i++) {
+        ai_frame_class_t* klass = &g_frame_classes[i];
+
+        for (j = 0; j < klass->count; j++) {
+            ai_frame_t* frame = (ai_frame_t*)ptr;
+
+            frame->klass = i;
+            frame->size = klass->size;
+            atomic_init(&frame->refs, 0);
+            frame->next = klass->free_list;
+            klass->free_list = frame;
+            ptr += AI_FRAME_STRIDE(klass->size);
+        }
+    }
+}
+
+static void ai_frame_update_peak(size_t in_use)
+{
+    size_t peak = atomic_load_explicit(&g_frame_peak, memory_order_relaxed);
+
+    while (in_use > peak
+        && !atomic_compare_exchange_weak_explicit(&g_frame_peak, &peak, in_use,
+            memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+ai_frame_t* ai_frame_alloc(size_t size)
+{
+    ai_frame_t* frame = NULL;
+    int i;
+
+    pthread_once(&g_frame_once, ai_frame_pool_init);
+
+    /* Fall back to the next class up before giving up */
+    for (i = 0; i < AI_FRAME_CLASSES && frame == NULL; i++) {
+        ai_frame_class_t* klass = &g_frame_classes[i];
+
+        if (klass->size < size)
+            continue;
+
+        pthread_mutex_lock(&klass->lock);
+        frame = klass->free_list;
+        if (frame != NULL)
+            klass->free_list = frame->next;
+        pthread_mutex_unlock(&klass->lock);
+    }
+
+    if (frame == NULL) {
+        atomic_fetch_add_explicit(&g_frame_failures, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    frame->next = NULL;
+    atomic_store_explicit(&frame->refs, 1, memory_order_relaxed);
+    ai_frame_update_peak(atomic_fetch_add_explicit(&g_frame_in_use, 1, memory_order_relaxed) + 1);
+
+    return frame;
+}
+
+ai_frame_t* ai_frame_alloc_fallback(size_t size)
+{
+    ai_frame_t* frame = ai_frame_alloc(size);
+
+    if (frame != NULL)
+        return frame;
+
+    frame = malloc(AI_FRAME_STRIDE(size));
+    if (frame == NULL)
+        return NULL;
+
+    frame->next = NULL;
+    frame->klass = AI_FRAME_HEAP;
+    frame->size = size;
+    atomic_init(&frame->refs, 1);
+    atomic_fetch_add_explicit(&g_frame_fallbacks, 1, memory_order_relaxed);
+
+    return frame;
+}
+
+ai_frame_t* ai_frame_ref(ai_frame_t* frame)
+{
+    if (frame != NULL)
+        atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+
+    return frame;
+}
+
+void ai_frame_unref(ai_frame_t* frame)
+{
+    ai_frame_class_t* klass;
+
+    if (frame == NULL)
+        return;
+
+    if (atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    if (frame->klass == AI_FRAME_HEAP) {
+        free(frame);
+        return;
+    }
+
+    klass = &g_frame_classes[frame->klass];
+    pthread_mutex_lock(&klass->lock);
+    frame->next = klass->free_list;
+    klass->free_list = frame;
+    pthread_mutex_unlock(&klass->lock);
+
+    atomic_fetch_sub_explicit(&g_frame_in_use, 1, memory_order_relaxed);
+}
+
+void* ai_frame_buf_alloc(size_t size)
+{
+    ai_frame_t* frame = ai_frame_alloc(size);
+
+    return frame ? ai_frame_data(frame) : NULL;
+}
+
+void* ai_frame_buf_alloc_fallback(size_t size)
+{
+    ai_frame_t* frame = ai_frame_alloc_fallback(size);
+
+    return frame ? ai_frame_data(frame) : NULL;
+}
+
+void ai_frame_buf_free(void* data)
+{
+    if (data != NULL)
+        ai_frame_unref(ai_frame_from_data(data));
+}
+
+void ai_frame_pool_get_stats(ai_frame_pool_stats_t* stats)
+{
+    if (stats == NULL)
+        return;
+
+    stats->in_use = atomic_load_explicit(&g_frame_in_use, memory_order_relaxed);
+    stats->peak = atomic_load_explicit(&g_frame_peak, memory_order_relaxed);
+    stats->failures = atomic_load_explicit(&g_frame_failures, memory_order_relaxed);
+    stats->fallbacks = atomic_load_explicit(&g_frame_fallbacks, memory_order_relaxed);
+}
@@ -0,0 +1,116 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_frame_pool.h
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+#ifndef FRAMEWORKS_AI_FRAME_POOL_H_
+#define FRAMEWORKS_AI_FRAME_POOL_H_
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Frames per size class, the pool never grows past these */
+
+#ifndef CONFIG_AI_FRAME_POOL_MEDIUM
+#define CONFIG_AI_FRAME_POOL_MEDIUM 16 // 4 KB, recorder reads and ASR packets
+#endif
+
+#ifndef CONFIG_AI_FRAME_POOL_LARGE
+#define CONFIG_AI_FRAME_POOL_LARGE 4 // 32 KB, TTS audio chunks
+#endif
+
+#define AI_FRAME_MEDIUM_SIZE 4096
+#define AI_FRAME_LARGE_SIZE 32768
+#define AI_FRAME_MAX_SIZE AI_FRAME_LARGE_SIZE
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* A refcounted buffer from a fixed pool of size classes.
+ *
+ * ai_frame_alloc hands out the smallest free frame that fits and returns
+ * NULL when the request is larger than AI_FRAME_MAX_SIZE or every frame of
+ * a fitting class is in use, so the worst-case footprint is fixed at build
+ * time. ai_frame_alloc_fallback takes a heap frame instead of failing, for
+ * data that must not be lost; it is refcounted and freed the same way.
+ * Frames may be passed between threads; the last ai_frame_unref puts the
+ * frame back on its freelist. */
+
+typedef struct ai_frame_s ai_frame_t;
+
+struct ai_frame_s {
+    ai_frame_t* next; // freelist link, only valid while free
+    atomic_int refs;
+    uint16_t klass;
+    uint32_t size; // usable bytes in data
+    char data[] __attribute__((aligned(sizeof(void*))));
+};
+
+typedef struct ai_frame_pool_stats_s {
+    size_t in_use; // frames currently handed out
+    size_t peak; // most frames ever handed out at once
+    size_t failures; // allocations that found no frame
+    size_t fallbacks; // of those, served from the heap
+} ai_frame_pool_stats_t;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+ai_frame_t* ai_frame_alloc(size_t size);
+ai_frame_t* ai_frame_alloc_fallback(size_t size);
+ai_frame_t* ai_frame_ref(ai_frame_t* frame);
+void ai_frame_unref(ai_frame_t* frame);
+
+static inline char* ai_frame_data(ai_frame_t* frame)
+{
+    return frame->data;
+}
+
+static inline ai_frame_t* ai_frame_from_data(void* data)
+{
+    return (ai_frame_t*)((char*)data - offsetof(ai_frame_t, data));
+}
+
+/* Convenience wrappers for callers that only carry the data pointer */
+
+void* ai_frame_buf_alloc(size_t size);
+void* ai_frame_buf_alloc_fallback(size_t size);
+void ai_frame_buf_free(void* data);
+
+void ai_frame_pool_get_stats(ai_frame_pool_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAMEWORKS_AI_FRAME_POOL_H_
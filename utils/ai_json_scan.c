@@ -0,0 +1,388 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_json_scan.c
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ai_json_scan.h"
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static const char* ai_json_skip_ws(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+
+    return p;
+}
+
+/* Returns the byte after the closing quote, p is on the opening one */
+
+static const char* ai_json_skip_string(const char* p, const char* end)
+{
+    for (p++; p < end; p++) {
+        if (*p == '\\')
+            p++;
+        else if (*p == '"')
+            return p + 1;
+    }
+
+    return NULL;
+}
+
+/* Containers are skipped flat by counting brackets, strings are the
+ * only thing that can hide one */
+
+static const char* ai_json_skip_value(const char* p, const char* end, ai_json_type_t* type)
+{
+    int depth = 0;
+
+    if (p >= end)
+        return NULL;
+
+    switch (*p) {
+    case '"':
+        *type = AI_JSON_STRING;
+        return ai_json_skip_string(p, end);
+    case '{':
+    case '[':
+        *type = *p == '{' ? AI_JSON_OBJECT : AI_JSON_ARRAY;
+        for (; p < end; p++) {
+            if (*p == '"') {
+                p = ai_json_skip_string(p, end);
+                if (p == NULL)
+                    return NULL;
+                p--;
+            } else if (*p == '{' || *p == '[')
+                depth++;
+            else if ((*p == '}' || *p == ']') && --depth == 0)
+                return p + 1;
+        }
+        return NULL;
+    case 't':
+        *type = AI_JSON_TRUE;
+        return end - p >= 4 && !memcmp(p, "true", 4) ? p + 4 : NULL;
+    case 'f':
+        *type = AI_JSON_FALSE;
+        return end - p >= 5 && !memcmp(p, "false", 5) ? p + 5 : NULL;
+    case 'n':
+        *type = AI_JSON_NULL;
+        return end - p >= 4 && !memcmp(p, "null", 4) ? p + 4 : NULL;
+    default:
+        if (*p != '-' && (*p < '0' || *p > '9'))
+            return NULL;
+        *type = AI_JSON_NUMBER;
+        for (p++; p < end; p++) {
+            if ((*p < '0' || *p > '9') && *p != '.' && *p != 'e' && *p != 'E'
+                && *p != '+' && *p != '-')
+                break;
+        }
+        return p;
+    }
+}
+
+static int ai_json_parse_value(const char* p, const char* end, ai_json_value_t* out)
+{
+    const char* next;
+
+    p = ai_json_skip_ws(p, end);
+    next = ai_json_skip_value(p, end, &out->type);
+    if (next == NULL)
+        return -EINVAL;
+
+    out->ptr = p;
+    out->len = next - p;
+    return 0;
+}
+
+static int ai_json_find_member(const ai_json_value_t* object, const char* key,
+    size_t key_len, ai_json_value_t* out)
+{
+    const char* end = object->ptr + object->len - 1; // the closing brace
+    const char* p = object->ptr + 1;
+    const char* name;
+    size_t name_len;
+    int ret;
+
+    if (object->type != AI_JSON_OBJECT)
+        return -ENOENT;
+
+    for (;;) {
+        p = ai_json_skip_ws(p, end);
+        if (p >= end)
+            return -ENOENT;
+        if (*p != '"')
+            return -EINVAL;
+
+        name = p + 1;
+        p = ai_json_skip_string(p, end);
+        if (p == NULL)
+            return -EINVAL;
+        name_len = p - 1 - name;
+
+        p = ai_json_skip_ws(p, end);
+        if (p >= end || *p != ':')
+            return -EINVAL;
+
+        ret = ai_json_parse_value(p + 1, end, out);
+        if (ret < 0)
+            return ret;
+
+        if (name_len == key_len && !memcmp(name, key, key_len))
+            return 0;
+
+        p = ai_json_skip_ws(out->ptr + out->len, end);
+        if (p < end && *p == ',')
+            p++;
+        else if (p < end)
+            return -EINVAL;
+    }
+}
+
+static int ai_json_hex4(const char* p, uint32_t* out)
+{
+    uint32_t v = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        v <<= 4;
+        if (p[i] >= '0' && p[i] <= '9')
+            v |= p[i] - '0';
+        else if (p[i] >= 'a' && p[i] <= 'f')
+            v |= p[i] - 'a' + 10;
+        else if (p[i] >= 'A' && p[i] <= 'F')
+            v |= p[i] - 'A' + 10;
+        else
+            return -EINVAL;
+    }
+
+    *out = v;
+    return 0;
+}
+
+static size_t ai_json_put_utf8(char* out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = 0xc0 | cp >> 6;
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = 0xe0 | cp >> 12;
+        out[1] = 0x80 | (cp >> 6 & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+
+    out[0] = 0xf0 | cp >> 18;
+    out[1] = 0x80 | (cp >> 12 & 0x3f);
+    out[2] = 0x80 | (cp >> 6 & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int ai_json_scan_member(const ai_json_value_t* object, const char* path, ai_json_value_t* out)
+{
+    ai_json_value_t current;
+    const char* dot;
+    int ret;
+
+    if (object == NULL || path == NULL || out == NULL)
+        return -EINVAL;
+
+    current = *object;
+    while (*path) {
+        dot = strchr(path, '.');
+        ret = ai_json_find_member(&current, path, dot ? (size_t)(dot - path) : strlen(path), &current);
+        if (ret < 0)
+            return ret;
+        if (dot == NULL)
+            break;
+        path = dot + 1;
+    }
+
+    *out = current;
+    return 0;
+}
+
+int ai_json_scan(const char* json, size_t len, const char* path, ai_json_value_t* out)
+{
+    ai_json_value_t root;
+    int ret;
+
+    if (json == NULL || out == NULL)
+        return -EINVAL;
+
+    ret = ai_json_parse_value(json, json + len, &root);
+    if (ret < 0)
+        return ret;
+
+    return ai_json_scan_member(&root, path ? path : "", out);
+}
+
+int ai_json_scan_next(const ai_json_value_t* array, const char** cursor, ai_json_value_t* elem)
+{
+    const char* end;
+    const char* p;
+    int ret;
+
+    if (array == NULL || cursor == NULL || elem == NULL || array->type != AI_JSON_ARRAY)
+        return -EINVAL;
+
+    end = array->ptr + array->len - 1; // the closing bracket
+    p = ai_json_skip_ws(*cursor ? *cursor : array->ptr + 1, end);
+    if (*cursor && p < end) {
+        if (*p != ',')
+            return -EINVAL;
+        p++;
+    }
+
+    if (ai_json_skip_ws(p, end) >= end)
+        return 0;
+
+    ret = ai_json_parse_value(p, end, elem);
+    if (ret < 0)
+        return ret;
+
+    *cursor = elem->ptr + elem->len;
+    return 1;
+}
+
+ssize_t ai_json_scan_string(const ai_json_value_t* value, char* out, size_t size)
+{
+    const char* end;
+    const char* p;
+    char utf8[4];
+    uint32_t low;
+    uint32_t cp;
+    size_t n = 0;
+    size_t k;
+
+    if (value == NULL || value->type != AI_JSON_STRING)
+        return -EINVAL;
+
+    end = value->ptr + value->len - 1; // the closing quote
+    for (p = value->ptr + 1; p < end; p++) {
+        k = 1;
+        if (*p != '\\')
+            utf8[0] = *p;
+        else if (++p >= end)
+            return -EINVAL;
+        else {
+            switch (*p) {
+            case 'b':
+                utf8[0] = '\b';
+                break;
+            case 'f':
+                utf8[0] = '\f';
+                break;
+            case 'n':
+                utf8[0] = '\n';
+                break;
+            case 'r':
+                utf8[0] = '\r';
+                break;
+            case 't':
+                utf8[0] = '\t';
+                break;
+            case 'u':
+                if (end - p < 5 || ai_json_hex4(p + 1, &cp) < 0)
+                    return -EINVAL;
+                p += 4;
+
+                /* A high surrogate must be followed by the low half */
+                if (cp >= 0xd800 && cp < 0xdc00) {
+                    if (end - p < 7 || p[1] != '\\' || p[2] != 'u' || ai_json_hex4(p + 3, &low) < 0
+                        || low < 0xdc00 || low >= 0xe000)
+                        return -EINVAL;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    p += 6;
+                }
+                k = ai_json_put_utf8(utf8, cp);
+                break;
+            default:
+                utf8[0] = *p;
+                break;
+            }
+        }
+
+        if (out) {
+            if (n + k >= size)
+                return -ENOSPC;
+            memcpy(out + n, utf8, k);
+        }
+        n += k;
+    }
+
+    if (out == NULL)
+        return n;
+    if (n >= size)
+        return -ENOSPC;
+
+    out[n] = '\0';
+    return n;
+}
+
+int ai_json_scan_int(const ai_json_value_t* value, long* out)
+{
+    const char* p;
+    const char* end;
+    bool negative;
+    long v = 0;
+
+    if (value == NULL || out == NULL || value->type != AI_JSON_NUMBER)
+        return -EINVAL;
+
+    p = value->ptr;
+    end = value->ptr + value->len;
+    negative = *p == '-';
+    if (negative)
+        p++;
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        v = v * 10 + (*p - '0');
+
+    *out = negative ? -v : v;
+    return 0;
+}
+
+int ai_json_scan_bool(const ai_json_value_t* value, bool* out)
+{
+    if (value == NULL || out == NULL)
+        return -EINVAL;
+
+    if (value->type != AI_JSON_TRUE && value->type != AI_JSON_FALSE)
+        return -EINVAL;
+
+    *out = value->type == AI_JSON_TRUE;
+    return 0;
+}
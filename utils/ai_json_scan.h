@@ -0,0 +1,96 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_json_scan.h
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+#ifndef FRAMEWORKS_AI_JSON_SCAN_H_
+#define FRAMEWORKS_AI_JSON_SCAN_H_
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* Read-only JSON scanner for picking a few fields out of a server reply.
+ *
+ * Values are spans into the caller's buffer, nothing is copied and
+ * nothing is allocated. A lookup walks the members in order, skipping
+ * the ones it does not need without descending into them, and stops at
+ * the first match. The input does not have to be NUL terminated. Only
+ * the parts that are walked get validated. */
+
+typedef enum {
+    AI_JSON_NONE,
+    AI_JSON_OBJECT,
+    AI_JSON_ARRAY,
+    AI_JSON_STRING,
+    AI_JSON_NUMBER,
+    AI_JSON_TRUE,
+    AI_JSON_FALSE,
+    AI_JSON_NULL,
+} ai_json_type_t;
+
+typedef struct ai_json_value_s {
+    const char* ptr; // first byte, the opening quote or bracket
+    size_t len; // up to and including the closing quote or bracket
+    ai_json_type_t type;
+} ai_json_value_t;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/* Find a value by a dot separated member path such as "result.text",
+ * an empty path returns the root. Returns 0, -ENOENT when a member is
+ * missing or -EINVAL for malformed input. */
+
+int ai_json_scan(const char* json, size_t len, const char* path, ai_json_value_t* out);
+
+/* Same, starting from an object found earlier */
+
+int ai_json_scan_member(const ai_json_value_t* object, const char* path, ai_json_value_t* out);
+
+/* Iterate an array, *cursor must be NULL on the first call. Returns 1
+ * with the next element in elem, 0 at the end, -EINVAL if malformed. */
+
+int ai_json_scan_next(const ai_json_value_t* array, const char** cursor, ai_json_value_t* elem);
+
+/* Unescape a string value into out as NUL terminated UTF-8. value->len
+ * bytes are always enough. Returns the length or -ENOSPC / -EINVAL.
+ * With out NULL only the length is computed. */
+
+ssize_t ai_json_scan_string(const ai_json_value_t* value, char* out, size_t size);
+
+int ai_json_scan_int(const ai_json_value_t* value, long* out);
+int ai_json_scan_bool(const ai_json_value_t* value, bool* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAMEWORKS_AI_JSON_SCAN_H_
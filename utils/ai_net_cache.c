@@ -0,0 +1,281 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_net_cache.c
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ai_common.h"
+#include "ai_net_cache.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define AI_NET_CACHE_HOSTS 4
+#define AI_NET_HOST_LEN 64
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+typedef struct ai_net_entry_s {
+    char host[AI_NET_HOST_LEN];
+    int port;
+    char addr[AI_NET_ADDR_LEN];
+    time_t addr_expires;
+    void* session; // serialized tls session from lws
+    size_t session_len;
+    time_t session_expires;
+    time_t used;
+} ai_net_entry_t;
+
+typedef struct ai_net_key_s {
+    const char* host;
+    int port;
+} ai_net_key_t;
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static ai_net_entry_t g_net_entries[AI_NET_CACHE_HOSTS];
+static pthread_mutex_t g_net_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static time_t ai_net_cache_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void ai_net_cache_drop_session(ai_net_entry_t* entry)
+{
+    free(entry->session);
+    entry->session = NULL;
+    entry->session_len = 0;
+}
+
+/* Must hold g_net_lock. With create the least recently used slot is
+ * recycled when the host is not cached yet. */
+
+static ai_net_entry_t* ai_net_cache_find(const char* host, int port, bool create)
+{
+    ai_net_entry_t* victim = &g_net_entries[0];
+    ai_net_entry_t* entry;
+    int i;
+
+    for (i = 0; i < AI_NET_CACHE_HOSTS; i++) {
+        entry = &g_net_entries[i];
+        if (entry->port == port && strcmp(entry->host, host) == 0) {
+            entry->used = ai_net_cache_now();
+            return entry;
+        }
+        if (entry->used < victim->used)
+            victim = entry;
+    }
+
+    if (!create || strlen(host) >= AI_NET_HOST_LEN)
+        return NULL;
+
+    ai_net_cache_drop_session(victim);
+    memset(victim, 0, sizeof(ai_net_entry_t));
+    strlcpy(victim->host, host, sizeof(victim->host));
+    victim->port = port;
+    victim->used = ai_net_cache_now();
+
+    return victim;
+}
+
+static int ai_net_cache_resolve(const char* host, char* addr, size_t size)
+{
+    struct addrinfo hints;
+    struct addrinfo* res;
+    const void* sin_addr;
+    int ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    ret = getaddrinfo(host, NULL, &hints, &res);
+    if (ret != 0) {
+        AI_WARN("net_cache resolve %s failed:%d\n", host, ret);
+        return -EHOSTUNREACH;
+    }
+
+    if (res->ai_family == AF_INET6)
+        sin_addr = &((struct sockaddr_in6*)res->ai_addr)->sin6_addr;
+    else
+        sin_addr = &((struct sockaddr_in*)res->ai_addr)->sin_addr;
+
+    ret = inet_ntop(res->ai_family, sin_addr, addr, size) ? 0 : -EINVAL;
+    freeaddrinfo(res);
+
+    return ret;
+}
+
+#ifdef LWS_WITH_TLS_SESSIONS
+static int ai_net_cache_load_cb(struct lws_context* cx, struct lws_tls_session_dump* info)
+{
+    ai_net_key_t* key = info->opaque;
+    ai_net_entry_t* entry;
+    int ret = 1;
+
+    pthread_mutex_lock(&g_net_lock);
+    entry = ai_net_cache_find(key->host, key->port, false);
+    if (entry && entry->session && entry->session_expires > ai_net_cache_now()) {
+        /* lws frees the blob once it has been deserialized */
+        info->blob = malloc(entry->session_len);
+        if (info->blob) {
+            memcpy(info->blob, entry->session, entry->session_len);
+            info->blob_len = entry->session_len;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&g_net_lock);
+
+    return ret;
+}
+
+static int ai_net_cache_save_cb(struct lws_context* cx, struct lws_tls_session_dump* info)
+{
+    ai_net_key_t* key = info->opaque;
+    ai_net_entry_t* entry;
+    void* session;
+
+    session = malloc(info->blob_len);
+    if (session == NULL)
+        return 1;
+    memcpy(session, info->blob, info->blob_len);
+
+    pthread_mutex_lock(&g_net_lock);
+    entry = ai_net_cache_find(key->host, key->port, true);
+    if (entry) {
+        ai_net_cache_drop_session(entry);
+        entry->session = session;
+        entry->session_len = info->blob_len;
+        entry->session_expires = ai_net_cache_now() + AI_NET_SESSION_TTL;
+        session = NULL;
+    }
+    pthread_mutex_unlock(&g_net_lock);
+
+    free(session);
+    return 0;
+}
+#endif
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int ai_net_cache_prepare(struct lws_client_connect_info* ccinfo, char* addr, size_t size)
+{
+    ai_net_entry_t* entry;
+    bool hit = false;
+    int ret;
+
+    if (ccinfo == NULL || ccinfo->host == NULL || addr == NULL || size == 0)
+        return -EINVAL;
+
+    pthread_mutex_lock(&g_net_lock);
+    entry = ai_net_cache_find(ccinfo->host, ccinfo->port, false);
+    if (entry && entry->addr[0] && entry->addr_expires > ai_net_cache_now()) {
+        strlcpy(addr, entry->addr, size);
+        hit = true;
+    }
+    pthread_mutex_unlock(&g_net_lock);
+
+    /* a failed lookup leaves ccinfo->address alone, lws then resolves it
+     * itself and reports the error through the usual callback */
+    if (!hit) {
+        ret = ai_net_cache_resolve(ccinfo->host, addr, size);
+        if (ret < 0)
+            return ret;
+
+        pthread_mutex_lock(&g_net_lock);
+        entry = ai_net_cache_find(ccinfo->host, ccinfo->port, true);
+        if (entry) {
+            strlcpy(entry->addr, addr, sizeof(entry->addr));
+            entry->addr_expires = ai_net_cache_now() + AI_NET_DNS_TTL;
+        }
+        pthread_mutex_unlock(&g_net_lock);
+    }
+
+    ccinfo->address = addr;
+    AI_INFO("net_cache %s -> %s%s\n", ccinfo->host, addr, hit ? " (cached)" : "");
+
+#ifdef LWS_WITH_TLS_SESSIONS
+    if (ccinfo->ssl_connection & LCCSCF_USE_SSL) {
+        ai_net_key_t key = { ccinfo->host, ccinfo->port };
+        struct lws_vhost* vhost = ccinfo->vhost;
+
+        if (vhost == NULL)
+            vhost = lws_get_vhost_by_name(ccinfo->context, "default");
+        if (vhost && lws_tls_session_dump_load(vhost, ccinfo->host, ccinfo->port, ai_net_cache_load_cb, &key) == 0)
+            AI_INFO("net_cache %s resuming tls session\n", ccinfo->host);
+    }
+#endif
+
+    return 0;
+}
+
+void ai_net_cache_connected(struct lws* wsi, const char* host, int port)
+{
+#ifdef LWS_WITH_TLS_SESSIONS
+    ai_net_key_t key = { host, port };
+
+    if (wsi == NULL || host == NULL)
+        return;
+
+    lws_tls_session_dump_save(lws_get_vhost(wsi), host, port, ai_net_cache_save_cb, &key);
+#endif
+}
+
+void ai_net_cache_failed(const char* host, int port)
+{
+    ai_net_entry_t* entry;
+
+    if (host == NULL)
+        return;
+
+    pthread_mutex_lock(&g_net_lock);
+    entry = ai_net_cache_find(host, port, false);
+    if (entry) {
+        entry->addr[0] = '\0';
+        ai_net_cache_drop_session(entry);
+    }
+    pthread_mutex_unlock(&g_net_lock);
+}
@@ -0,0 +1,70 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_net_cache.h
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+#ifndef FRAMEWORKS_AI_NET_CACHE_H_
+#define FRAMEWORKS_AI_NET_CACHE_H_
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stddef.h>
+#include <libwebsockets.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define AI_NET_ADDR_LEN 46 // INET6_ADDRSTRLEN
+#define AI_NET_DNS_TTL 300 // seconds, getaddrinfo does not report the record ttl
+#define AI_NET_SESSION_TTL 3600 // seconds a saved tls session is offered again
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/* Process-wide cache for the fixed endpoints the engines connect to.
+ *
+ * Each engine owns its lws context, so neither the resolver result nor the
+ * tls session of one engine's connection helps the next engine. This keeps
+ * both per host:port behind one lock: prepare fills ccinfo->address with a
+ * cached numeric address (resolving and caching it on a miss) and hands
+ * the last tls session to the context's default vhost; ccinfo->host still
+ * carries the name for SNI and the Host header. addr must stay valid until
+ * lws_client_connect_via_info returns.
+ *
+ * Call connected once the websocket is up to save the session, and failed
+ * on a connection error so the next connect starts from a fresh lookup and
+ * a full handshake. Sessions are only kept when lws is built with
+ * LWS_WITH_TLS_SESSIONS. */
+
+int ai_net_cache_prepare(struct lws_client_connect_info* ccinfo, char* addr, size_t size);
+void ai_net_cache_connected(struct lws* wsi, const char* host, int port);
+void ai_net_cache_failed(const char* host, int port);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAMEWORKS_AI_NET_CACHE_H_
@@ -18,11 +18,67 @@
  *
  ****************************************************************************/
 
+/* memfd_create is a GNU extension in glibc's <sys/mman.h> */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef CONFIG_AI_RING_BUFFER_MIRROR
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "ai_common.h"
 #include "ai_ring_buffer.h"
 
+#ifdef CONFIG_AI_RING_BUFFER_MIRROR
+static char* ai_ring_buffer_map_mirror(size_t buf_size)
+{
+    char* addr;
+    int fd;
+
+    if (buf_size % sysconf(_SC_PAGESIZE) != 0)
+        return NULL;
+
+    fd = memfd_create("ai_ring_buffer", 0);
+    if (fd < 0)
+        return NULL;
+
+    if (ftruncate(fd, buf_size) < 0)
+        goto err;
+
+    /* Reserve twice the size, then map the same pages into both halves */
+    addr = mmap(NULL, buf_size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        goto err;
+
+    if (mmap(addr, buf_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(addr + buf_size, buf_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(addr, buf_size * 2);
+        goto err;
+    }
+
+    close(fd);
+    return addr;
+
+err:
+    close(fd);
+    return NULL;
+}
+#endif
+
+static ai_ring_buffer_size_t ai_ring_buffer_span(ai_ring_buffer_t* buffer, ai_ring_buffer_size_t index)
+{
+    /* A mirrored buffer is contiguous for a whole capacity from any index */
+    if (buffer->flags & AI_RING_BUFFER_MIRRORED)
+        return AI_RING_BUFFER_MASK(buffer) + 1;
+
+    return AI_RING_BUFFER_MASK(buffer) + 1 - index;
+}
+
 void ai_ring_buffer_init(ai_ring_buffer_t* buffer, char* buf, size_t buf_size)
 {
     AI_RING_BUFFER_ASSERT(AI_RING_BUFFER_IS_POWER_OF_TWO(buf_size) == 1);
@@ -30,23 +86,164 @@ void ai_ring_buffer_init(ai_ring_buffer_t* buffer, char* buf, size_t buf_size)
     buffer->buffer_mask = buf_size - 1;
     buffer->tail_index = 0;
     buffer->head_index = 0;
+    buffer->flags = 0;
+    buffer->policy = AI_RING_BUFFER_DROP_OLDEST;
+    buffer->max_size = buf_size;
+    memset(&buffer->stats, 0, sizeof(buffer->stats));
 }
 
-void ai_ring_buffer_queue(ai_ring_buffer_t* buffer, char data)
+void ai_ring_buffer_set_policy(ai_ring_buffer_t* buffer, ai_ring_buffer_policy_t policy, size_t max_size)
+{
+    buffer->policy = policy;
+    if (max_size > AI_RING_BUFFER_MASK(buffer) + 1)
+        buffer->max_size = max_size;
+    else
+        buffer->max_size = AI_RING_BUFFER_MASK(buffer) + 1;
+}
+
+int ai_ring_buffer_alloc(ai_ring_buffer_t* buffer, size_t buf_size, int flags)
+{
+    char* buf;
+
+    if (!AI_RING_BUFFER_IS_POWER_OF_TWO(buf_size))
+        return -EINVAL;
+
+#ifdef CONFIG_AI_RING_BUFFER_MIRROR
+    if (flags & AI_RING_BUFFER_MIRRORED) {
+        buf = ai_ring_buffer_map_mirror(buf_size);
+        if (buf != NULL) {
+            ai_ring_buffer_init(buffer, buf, buf_size);
+            buffer->flags = AI_RING_BUFFER_MIRRORED | AI_RING_BUFFER_OWNED;
+            return 0;
+        }
+        AI_WARN("ring buffer mirror failed, fall back to plain layout");
+    }
+#else
+    (void)flags;
+#endif
+
+    buf = (char*)malloc(buf_size);
+    if (buf == NULL)
+        return -ENOMEM;
+
+    ai_ring_buffer_init(buffer, buf, buf_size);
+    buffer->flags = AI_RING_BUFFER_OWNED;
+    return 0;
+}
+
+void ai_ring_buffer_free(ai_ring_buffer_t* buffer)
 {
-    if (ai_ring_buffer_is_full(buffer))
-        buffer->tail_index = ((buffer->tail_index + 1) & AI_RING_BUFFER_MASK(buffer));
+    if (buffer->buffer == NULL || !(buffer->flags & AI_RING_BUFFER_OWNED))
+        return;
+
+#ifdef CONFIG_AI_RING_BUFFER_MIRROR
+    if (buffer->flags & AI_RING_BUFFER_MIRRORED)
+        munmap(buffer->buffer, (AI_RING_BUFFER_MASK(buffer) + 1) * 2);
+    else
+#endif
+        free(buffer->buffer);
 
-    /* Place data in buffer */
-    buffer->buffer[buffer->head_index] = data;
-    buffer->head_index = ((buffer->head_index + 1) & AI_RING_BUFFER_MASK(buffer));
+    buffer->buffer = NULL;
+    buffer->flags = 0;
 }
 
-void ai_ring_buffer_queue_arr(ai_ring_buffer_t* buffer, const char* data, ai_ring_buffer_size_t size)
+static int ai_ring_buffer_grow(ai_ring_buffer_t* buffer, ai_ring_buffer_size_t need)
 {
-    ai_ring_buffer_size_t i;
-    for (i = 0; i < size; i++)
-        ai_ring_buffer_queue(buffer, data[i]);
+    ai_ring_buffer_t grown;
+    size_t size = AI_RING_BUFFER_MASK(buffer) + 1;
+    ai_ring_buffer_size_t cnt;
+    int ret;
+
+    if (!(buffer->flags & AI_RING_BUFFER_OWNED))
+        return -EPERM;
+
+    while (size - 1 < need && size < buffer->max_size)
+        size <<= 1;
+    if (size > buffer->max_size || size == AI_RING_BUFFER_MASK(buffer) + 1)
+        return -ENOSPC;
+
+    ret = ai_ring_buffer_alloc(&grown, size, buffer->flags & AI_RING_BUFFER_MIRRORED);
+    if (ret < 0)
+        return ret;
+
+    cnt = ai_ring_buffer_peek_arr(buffer, grown.buffer, ai_ring_buffer_num_items(buffer));
+    grown.head_index = cnt;
+    grown.policy = buffer->policy;
+    grown.max_size = buffer->max_size;
+    grown.stats = buffer->stats;
+
+    ai_ring_buffer_free(buffer);
+    *buffer = grown;
+
+    AI_INFO("ring buffer grown to %zu", size);
+    return 0;
+}
+
+void ai_ring_buffer_queue(ai_ring_buffer_t* buffer, char data)
+{
+    ai_ring_buffer_queue_arr(buffer, &data, 1);
+}
+
+int ai_ring_buffer_queue_arr(ai_ring_buffer_t* buffer, const char* data, ai_ring_buffer_size_t size)
+{
+    ai_ring_buffer_size_t capacity;
+    ai_ring_buffer_size_t room;
+    ai_ring_buffer_size_t first;
+    ai_ring_buffer_size_t cnt;
+
+    room = ai_ring_buffer_num_free(buffer);
+    if (size > room) {
+        buffer->stats.overflow_events++;
+
+        switch (buffer->policy) {
+        case AI_RING_BUFFER_REJECT:
+            buffer->stats.bytes_dropped += size;
+            return -EAGAIN;
+
+        case AI_RING_BUFFER_DROP_NEWEST:
+            buffer->stats.bytes_dropped += size - room;
+            size = room;
+            break;
+
+        case AI_RING_BUFFER_GROW:
+            if (ai_ring_buffer_grow(buffer, ai_ring_buffer_num_items(buffer) + size) == 0
+                && size <= ai_ring_buffer_num_free(buffer))
+                break;
+
+            /* Fall through - at the cap keep the newest data */
+        case AI_RING_BUFFER_DROP_OLDEST:
+        default:
+            /* Only the newest capacity bytes can survive, skip the rest up front */
+            capacity = AI_RING_BUFFER_MASK(buffer);
+            if (size > capacity) {
+                buffer->stats.bytes_dropped += size - capacity;
+                data += size - capacity;
+                size = capacity;
+            }
+
+            /* Overwrite the oldest data to make room */
+            room = ai_ring_buffer_num_free(buffer);
+            if (size > room) {
+                buffer->stats.bytes_dropped += size - room;
+                buffer->tail_index = ((buffer->tail_index + size - room) & AI_RING_BUFFER_MASK(buffer));
+            }
+            break;
+        }
+    }
+
+    first = ai_ring_buffer_span(buffer, buffer->head_index);
+    if (first > size)
+        first = size;
+
+    memcpy(buffer->buffer + buffer->head_index, data, first);
+    memcpy(buffer->buffer, data + first, size - first);
+    buffer->head_index = ((buffer->head_index + size) & AI_RING_BUFFER_MASK(buffer));
+
+    cnt = ai_ring_buffer_num_items(buffer);
+    if (cnt > buffer->stats.high_watermark)
+        buffer->stats.high_watermark = cnt;
+
+    return size;
 }
 
 uint8_t ai_ring_buffer_dequeue(ai_ring_buffer_t* buffer, char* data)
@@ -62,33 +259,89 @@ uint8_t ai_ring_buffer_dequeue(ai_ring_buffer_t* buffer, char* data)
 
 ai_ring_buffer_size_t ai_ring_buffer_clear_arr(ai_ring_buffer_t* buffer, ai_ring_buffer_size_t len)
 {
-    if (ai_ring_buffer_is_empty(buffer))
-        return 0;
+    ai_ring_buffer_size_t cnt = ai_ring_buffer_num_items(buffer);
 
-    char* data_ptr = &buffer->drop_char;
-    ai_ring_buffer_size_t cnt = 0;
-    while ((cnt < len) && ai_ring_buffer_dequeue(buffer, data_ptr)) {
-        cnt++;
-    }
+    if (cnt > len)
+        cnt = len;
+
+    buffer->tail_index = ((buffer->tail_index + cnt) & AI_RING_BUFFER_MASK(buffer));
+
+    return cnt;
+}
+
+ai_ring_buffer_size_t ai_ring_buffer_peek_arr(ai_ring_buffer_t* buffer, char* data, ai_ring_buffer_size_t len)
+{
+    ai_ring_buffer_size_t cnt = ai_ring_buffer_num_items(buffer);
+    ai_ring_buffer_size_t first;
+
+    if (cnt > len)
+        cnt = len;
+
+    /* At most two copies: up to the wrap point, then from the start */
+    first = ai_ring_buffer_span(buffer, buffer->tail_index);
+    if (first > cnt)
+        first = cnt;
+
+    memcpy(data, buffer->buffer + buffer->tail_index, first);
+    memcpy(data + first, buffer->buffer, cnt - first);
 
     return cnt;
 }
 
 ai_ring_buffer_size_t ai_ring_buffer_dequeue_arr(ai_ring_buffer_t* buffer, char* data, ai_ring_buffer_size_t len)
 {
-    if (ai_ring_buffer_is_empty(buffer))
-        return 0;
+    ai_ring_buffer_size_t cnt = ai_ring_buffer_peek_arr(buffer, data, len);
 
-    char* data_ptr = data;
-    ai_ring_buffer_size_t cnt = 0;
-    while ((cnt < len) && ai_ring_buffer_dequeue(buffer, data_ptr)) {
-        cnt++;
-        data_ptr++;
-    }
+    buffer->tail_index = ((buffer->tail_index + cnt) & AI_RING_BUFFER_MASK(buffer));
+
+    return cnt;
+}
+
+ai_ring_buffer_size_t ai_ring_buffer_reserve(ai_ring_buffer_t* buffer, ai_ring_buffer_size_t len, char** data)
+{
+    ai_ring_buffer_size_t room = AI_RING_BUFFER_MASK(buffer) - ai_ring_buffer_num_items(buffer);
+    ai_ring_buffer_size_t first = ai_ring_buffer_span(buffer, buffer->head_index);
+
+    /* Only hand out the free space before the wrap point */
+    if (room > first)
+        room = first;
+    if (room > len)
+        room = len;
+
+    *data = buffer->buffer + buffer->head_index;
+
+    return room;
+}
+
+void ai_ring_buffer_commit(ai_ring_buffer_t* buffer, ai_ring_buffer_size_t len)
+{
+    AI_RING_BUFFER_ASSERT(len <= AI_RING_BUFFER_MASK(buffer) - ai_ring_buffer_num_items(buffer));
+
+    buffer->head_index = ((buffer->head_index + len) & AI_RING_BUFFER_MASK(buffer));
+
+    len = ai_ring_buffer_num_items(buffer);
+    if (len > buffer->stats.high_watermark)
+        buffer->stats.high_watermark = len;
+}
+
+ai_ring_buffer_size_t ai_ring_buffer_peek_contiguous(ai_ring_buffer_t* buffer, char** data)
+{
+    ai_ring_buffer_size_t cnt = ai_ring_buffer_num_items(buffer);
+    ai_ring_buffer_size_t first = ai_ring_buffer_span(buffer, buffer->tail_index);
+
+    if (cnt > first)
+        cnt = first;
+
+    *data = buffer->buffer + buffer->tail_index;
 
     return cnt;
 }
 
+ai_ring_buffer_size_t ai_ring_buffer_consume(ai_ring_buffer_t* buffer, ai_ring_buffer_size_t len)
+{
+    return ai_ring_buffer_clear_arr(buffer, len);
+}
+
 uint8_t ai_ring_buffer_peek(ai_ring_buffer_t* buffer, char* data, ai_ring_buffer_size_t index)
 {
     if (index >= ai_ring_buffer_num_items(buffer))
@@ -114,4 +367,9 @@ uint8_t ai_ring_buffer_is_full(ai_ring_buffer_t* buffer)
 ai_ring_buffer_size_t ai_ring_buffer_num_items(ai_ring_buffer_t* buffer)
 {
     return ((buffer->head_index - buffer->tail_index) & AI_RING_BUFFER_MASK(buffer));
+}
+
+ai_ring_buffer_size_t ai_ring_buffer_num_free(ai_ring_buffer_t* buffer)
+{
+    return AI_RING_BUFFER_MASK(buffer) - ai_ring_buffer_num_items(buffer);
 }
\ No newline at end of file
@@ -37,6 +37,26 @@ typedef size_t ai_ring_buffer_size_t;
 
 #define AI_RING_BUFFER_MASK(rb) (rb->buffer_mask)
 
+/* ai_ring_buffer_alloc flags */
+
+#define AI_RING_BUFFER_MIRRORED 0x01 // map the pages twice, needs CONFIG_AI_RING_BUFFER_MIRROR
+#define AI_RING_BUFFER_OWNED 0x02 // memory comes from ai_ring_buffer_alloc
+
+/* What ai_ring_buffer_queue_arr does when the data doesn't fit */
+
+typedef enum {
+    AI_RING_BUFFER_DROP_OLDEST, // overwrite the oldest data (default)
+    AI_RING_BUFFER_DROP_NEWEST, // keep what fits, drop the rest of the new data
+    AI_RING_BUFFER_REJECT, // queue nothing and return -EAGAIN
+    AI_RING_BUFFER_GROW, // reallocate up to max_size, then drop oldest
+} ai_ring_buffer_policy_t;
+
+typedef struct ai_ring_buffer_stats_s {
+    size_t bytes_dropped; // bytes overwritten or not accepted
+    size_t overflow_events; // queue calls that did not fit
+    size_t high_watermark; // most bytes ever queued
+} ai_ring_buffer_stats_t;
+
 typedef struct ai_ring_buffer_s ai_ring_buffer_t;
 
 struct ai_ring_buffer_s {
@@ -44,19 +64,47 @@ struct ai_ring_buffer_s {
     ai_ring_buffer_size_t buffer_mask;
     ai_ring_buffer_size_t tail_index;
     ai_ring_buffer_size_t head_index;
-    char drop_char;
+    uint8_t flags;
+    ai_ring_buffer_policy_t policy;
+    size_t max_size;
+    ai_ring_buffer_stats_t stats;
 };
 
 void ai_ring_buffer_init(ai_ring_buffer_t* buffer, char* buf, size_t buf_size);
+
+/* Allocate the backing store. With AI_RING_BUFFER_MIRRORED the buffer is
+ * mapped twice back to back when the platform allows it, so every read or
+ * write of up to capacity bytes is contiguous; otherwise it silently falls
+ * back to the plain layout. */
+
+int ai_ring_buffer_alloc(ai_ring_buffer_t* buffer, size_t buf_size, int flags);
+void ai_ring_buffer_free(ai_ring_buffer_t* buffer);
+
+/* AI_RING_BUFFER_GROW needs a buffer from ai_ring_buffer_alloc and moves
+ * the data, so it can't be used while reserve/peek_contiguous spans are
+ * outstanding. max_size caps the growth and is ignored by other policies. */
+
+void ai_ring_buffer_set_policy(ai_ring_buffer_t* buffer, ai_ring_buffer_policy_t policy, size_t max_size);
 void ai_ring_buffer_queue(ai_ring_buffer_t* buffer, char data);
-void ai_ring_buffer_queue_arr(ai_ring_buffer_t* buffer, const char* data, ai_ring_buffer_size_t size);
+int ai_ring_buffer_queue_arr(ai_ring_buffer_t* buffer, const char* data, ai_ring_buffer_size_t size);
 uint8_t ai_ring_buffer_dequeue(ai_ring_buffer_t* buffer, char* data);
 ai_ring_buffer_size_t ai_ring_buffer_clear_arr(ai_ring_buffer_t* buffer, ai_ring_buffer_size_t len);
 ai_ring_buffer_size_t ai_ring_buffer_dequeue_arr(ai_ring_buffer_t* buffer, char* data, ai_ring_buffer_size_t len);
+ai_ring_buffer_size_t ai_ring_buffer_peek_arr(ai_ring_buffer_t* buffer, char* data, ai_ring_buffer_size_t len);
+
+/* Zero-copy access: reserve/commit for producers, peek_contiguous/consume
+ * for consumers. Both only expose the span up to the wrap point (the whole
+ * content for a mirrored buffer), so callers loop until they get 0 back. */
+
+ai_ring_buffer_size_t ai_ring_buffer_reserve(ai_ring_buffer_t* buffer, ai_ring_buffer_size_t len, char** data);
+void ai_ring_buffer_commit(ai_ring_buffer_t* buffer, ai_ring_buffer_size_t len);
+ai_ring_buffer_size_t ai_ring_buffer_peek_contiguous(ai_ring_buffer_t* buffer, char** data);
+ai_ring_buffer_size_t ai_ring_buffer_consume(ai_ring_buffer_t* buffer, ai_ring_buffer_size_t len);
 uint8_t ai_ring_buffer_peek(ai_ring_buffer_t* buffer, char* data, ai_ring_buffer_size_t index);
 uint8_t ai_ring_buffer_is_empty(ai_ring_buffer_t* buffer);
 uint8_t ai_ring_buffer_is_full(ai_ring_buffer_t* buffer);
 ai_ring_buffer_size_t ai_ring_buffer_num_items(ai_ring_buffer_t* buffer);
+ai_ring_buffer_size_t ai_ring_buffer_num_free(ai_ring_buffer_t* buffer);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,184 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_spsc_ring.c
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+
+#include "ai_spsc_ring.h"
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int ai_spsc_ring_init(ai_spsc_ring_t* ring, char* buf, size_t buf_size)
+{
+    if (ring == NULL || buf == NULL || buf_size == 0
+        || (buf_size & (buf_size - 1)) != 0)
+        return -EINVAL;
+
+    ring->buffer = buf;
+    ring->size = buf_size;
+    ring->mask = buf_size - 1;
+    atomic_init(&ring->head, 0);
+    ring->head_pending = 0;
+    ring->tail_cache = 0;
+    atomic_init(&ring->tail, 0);
+    ring->head_cache = 0;
+
+    return 0;
+}
+
+size_t ai_spsc_ring_writable(ai_spsc_ring_t* ring)
+{
+    size_t room = ring->size - (ring->head_pending - ring->tail_cache);
+
+    /* Only touch the consumer's cache line when the snapshot runs out */
+    if (room == 0) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        room = ring->size - (ring->head_pending - ring->tail_cache);
+    }
+
+    return room;
+}
+
+size_t ai_spsc_ring_reserve(ai_spsc_ring_t* ring, size_t len, char** data)
+{
+    size_t offset = ring->head_pending & ring->mask;
+    size_t room = ai_spsc_ring_writable(ring);
+
+    if (room < len) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        room = ring->size - (ring->head_pending - ring->tail_cache);
+    }
+
+    if (room > ring->size - offset)
+        room = ring->size - offset;
+    if (room > len)
+        room = len;
+
+    *data = ring->buffer + offset;
+
+    return room;
+}
+
+void ai_spsc_ring_commit(ai_spsc_ring_t* ring, size_t len)
+{
+    ring->head_pending += len;
+}
+
+size_t ai_spsc_ring_stage(ai_spsc_ring_t* ring, const char* data, size_t len)
+{
+    size_t offset = ring->head_pending & ring->mask;
+    size_t room = ai_spsc_ring_writable(ring);
+    size_t first;
+
+    if (room < len) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        room = ring->size - (ring->head_pending - ring->tail_cache);
+    }
+
+    if (len > room)
+        len = room;
+
+    first = ring->size - offset;
+    if (first > len)
+        first = len;
+
+    memcpy(ring->buffer + offset, data, first);
+    memcpy(ring->buffer, data + first, len - first);
+    ring->head_pending += len;
+
+    return len;
+}
+
+void ai_spsc_ring_publish(ai_spsc_ring_t* ring)
+{
+    atomic_store_explicit(&ring->head, ring->head_pending, memory_order_release);
+}
+
+size_t ai_spsc_ring_write(ai_spsc_ring_t* ring, const char* data, size_t len)
+{
+    len = ai_spsc_ring_stage(ring, data, len);
+    if (len > 0)
+        ai_spsc_ring_publish(ring);
+
+    return len;
+}
+
+size_t ai_spsc_ring_readable(ai_spsc_ring_t* ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (ring->head_cache == tail)
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    return ring->head_cache - tail;
+}
+
+size_t ai_spsc_ring_peek_contiguous(ai_spsc_ring_t* ring, char** data)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t offset = tail & ring->mask;
+    size_t cnt = ai_spsc_ring_readable(ring);
+
+    if (cnt > ring->size - offset)
+        cnt = ring->size - offset;
+
+    *data = ring->buffer + offset;
+
+    return cnt;
+}
+
+void ai_spsc_ring_consume(ai_spsc_ring_t* ring, size_t len)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+}
+
+size_t ai_spsc_ring_read(ai_spsc_ring_t* ring, char* data, size_t len)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t offset = tail & ring->mask;
+    size_t cnt = ai_spsc_ring_readable(ring);
+    size_t first;
+
+    if (cnt < len) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        cnt = ring->head_cache - tail;
+    }
+
+    if (cnt > len)
+        cnt = len;
+
+    first = ring->size - offset;
+    if (first > cnt)
+        first = cnt;
+
+    memcpy(data, ring->buffer + offset, first);
+    memcpy(data + first, ring->buffer, cnt - first);
+    atomic_store_explicit(&ring->tail, tail + cnt, memory_order_release);
+
+    return cnt;
+}
@@ -0,0 +1,99 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_spsc_ring.h
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+#ifndef FRAMEWORKS_AI_SPSC_RING_H_
+#define FRAMEWORKS_AI_SPSC_RING_H_
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#ifndef AI_SPSC_RING_CACHE_LINE
+#define AI_SPSC_RING_CACHE_LINE 64
+#endif
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* Single-producer/single-consumer byte ring.
+ *
+ * One thread may call the producer functions (reserve, commit, stage,
+ * publish, write, writable) while another thread calls the consumer
+ * functions (peek_contiguous, consume, read, readable). Indices run
+ * freely and are masked on access, so the whole buffer is usable.
+ *
+ * Producer writes are staged privately and become visible to the consumer
+ * on publish, so a burst of small writes costs a single release store. */
+
+typedef struct ai_spsc_ring_s {
+    /* Read-only after init */
+    char* buffer;
+    size_t size;
+    size_t mask;
+
+    /* Producer side */
+    atomic_size_t head __attribute__((aligned(AI_SPSC_RING_CACHE_LINE)));
+    size_t head_pending;
+    size_t tail_cache;
+
+    /* Consumer side */
+    atomic_size_t tail __attribute__((aligned(AI_SPSC_RING_CACHE_LINE)));
+    size_t head_cache;
+} ai_spsc_ring_t;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int ai_spsc_ring_init(ai_spsc_ring_t* ring, char* buf, size_t buf_size);
+
+/* Producer */
+
+size_t ai_spsc_ring_writable(ai_spsc_ring_t* ring);
+size_t ai_spsc_ring_reserve(ai_spsc_ring_t* ring, size_t len, char** data);
+void ai_spsc_ring_commit(ai_spsc_ring_t* ring, size_t len);
+size_t ai_spsc_ring_stage(ai_spsc_ring_t* ring, const char* data, size_t len);
+void ai_spsc_ring_publish(ai_spsc_ring_t* ring);
+size_t ai_spsc_ring_write(ai_spsc_ring_t* ring, const char* data, size_t len);
+
+/* Consumer */
+
+size_t ai_spsc_ring_readable(ai_spsc_ring_t* ring);
+size_t ai_spsc_ring_peek_contiguous(ai_spsc_ring_t* ring, char** data);
+void ai_spsc_ring_consume(ai_spsc_ring_t* ring, size_t len);
+size_t ai_spsc_ring_read(ai_spsc_ring_t* ring, char* data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAMEWORKS_AI_SPSC_RING_H_
@@ -0,0 +1,166 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_vad.c
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+
+#include "ai_vad.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define AI_VAD_FRAME_MS 10
+#define AI_VAD_ONSET_FRAMES 3
+#define AI_VAD_MIN_ENERGY 10000 // mean square, about -50dBFS
+#define AI_VAD_SPEECH_RATIO 8 // voiced speech, about 9dB over the floor
+#define AI_VAD_UNVOICED_RATIO 3 // fricatives, about 5dB over the floor
+#define AI_VAD_UNVOICED_ZCR 4 // at least one crossing per 4 samples
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* The floor drops quickly on quieter frames. It closes 1/16 of the gap on
+ * louder non-speech frames and grows at most about 7dB a second during
+ * speech, so a long utterance can't drag it up to speech level while a
+ * louder background still wins after a few seconds. */
+
+static void ai_vad_track_noise(ai_vad_t* vad, uint64_t energy, bool speech)
+{
+    if (vad->noise == 0)
+        vad->noise = energy ? energy : 1;
+    else if (energy < vad->noise)
+        vad->noise -= (vad->noise - energy) / 4;
+    else if (speech)
+        vad->noise += vad->noise / 64 + 1;
+    else
+        vad->noise += (energy - vad->noise) / 16;
+
+    if (vad->noise == 0)
+        vad->noise = 1;
+}
+
+static bool ai_vad_classify(ai_vad_t* vad, uint64_t energy, int crossings)
+{
+    if (energy < AI_VAD_MIN_ENERGY)
+        return false;
+
+    if (energy > vad->noise * AI_VAD_SPEECH_RATIO)
+        return true;
+
+    return energy > vad->noise * AI_VAD_UNVOICED_RATIO
+        && crossings * AI_VAD_UNVOICED_ZCR >= vad->frame_samples;
+}
+
+static void ai_vad_frame(ai_vad_t* vad)
+{
+    uint64_t energy = vad->energy / vad->samples;
+    bool speech = ai_vad_classify(vad, energy, vad->crossings);
+
+    ai_vad_track_noise(vad, energy, speech);
+    vad->energy = 0;
+    vad->crossings = 0;
+    vad->samples = 0;
+
+    if (!vad->speech) {
+        vad->onset = speech ? vad->onset + 1 : 0;
+        if (vad->onset >= AI_VAD_ONSET_FRAMES) {
+            vad->speech = true;
+            vad->silence = 0;
+        }
+        return;
+    }
+
+    vad->silence = speech ? 0 : vad->silence + 1;
+    if (vad->silence >= vad->hangover_frames) {
+        vad->speech = false;
+        vad->onset = 0;
+        vad->ended = true;
+    }
+}
+
+static void ai_vad_sample(ai_vad_t* vad, int16_t sample)
+{
+    vad->energy += (int32_t)sample * sample;
+    if ((sample < 0) != (vad->last < 0))
+        vad->crossings++;
+    vad->last = sample;
+
+    if (++vad->samples == vad->frame_samples)
+        ai_vad_frame(vad);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int ai_vad_init(ai_vad_t* vad, int sample_rate, int channels, int hangover_ms)
+{
+    if (vad == NULL || sample_rate < 1000 || channels <= 0 || hangover_ms <= 0)
+        return -EINVAL;
+
+    memset(vad, 0, sizeof(ai_vad_t));
+    vad->frame_bytes = channels * sizeof(int16_t);
+    vad->frame_samples = sample_rate / 1000 * AI_VAD_FRAME_MS;
+    vad->hangover_frames = (hangover_ms + AI_VAD_FRAME_MS - 1) / AI_VAD_FRAME_MS;
+
+    return 0;
+}
+
+void ai_vad_reset(ai_vad_t* vad)
+{
+    int frame_bytes = vad->frame_bytes;
+    int frame_samples = vad->frame_samples;
+    int hangover_frames = vad->hangover_frames;
+
+    memset(vad, 0, sizeof(ai_vad_t));
+    vad->frame_bytes = frame_bytes;
+    vad->frame_samples = frame_samples;
+    vad->hangover_frames = hangover_frames;
+}
+
+ai_vad_state_t ai_vad_process(ai_vad_t* vad, const char* data, size_t len)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t i;
+
+    /* only the first channel is analysed, the rest is skipped */
+    for (i = 0; i < len; i++) {
+        if (vad->pos == 0)
+            vad->low = bytes[i];
+        else if (vad->pos == 1)
+            ai_vad_sample(vad, (int16_t)(vad->low | bytes[i] << 8));
+
+        if (++vad->pos == vad->frame_bytes)
+            vad->pos = 0;
+    }
+
+    if (vad->ended) {
+        vad->ended = false;
+        return AI_VAD_END;
+    }
+
+    return vad->speech ? AI_VAD_SPEECH : AI_VAD_SILENCE;
+}
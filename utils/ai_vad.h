@@ -0,0 +1,84 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_vad.h
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+
+#ifndef FRAMEWORKS_AI_VAD_H_
+#define FRAMEWORKS_AI_VAD_H_
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* Voice activity detector for s16le pcm.
+ *
+ * Audio is cut into 10ms frames of the first channel. A frame is speech
+ * when its energy stands well above a running noise floor, or somewhat
+ * above it with the zero-crossing rate of an unvoiced consonant. An
+ * utterance starts after 30ms of speech and ends once hangover_ms of
+ * silence follow it; that end is reported once, then the detector waits
+ * for the next utterance. Input may be split anywhere, even mid sample. */
+
+typedef enum {
+    AI_VAD_SILENCE,
+    AI_VAD_SPEECH,
+    AI_VAD_END, // trailing silence reached the hangover
+} ai_vad_state_t;
+
+typedef struct ai_vad_s {
+    int frame_bytes; // bytes per interleaved sample frame
+    int frame_samples; // samples per 10ms analysis frame
+    int hangover_frames;
+    int pos; // byte position inside the current sample frame
+    uint8_t low; // first byte of a split sample
+    uint64_t noise; // running noise floor, mean square per sample
+    uint64_t energy;
+    int crossings;
+    int samples;
+    int16_t last;
+    int onset; // consecutive speech frames before an utterance starts
+    int silence; // consecutive silent frames inside an utterance
+    bool speech; // inside an utterance
+    bool ended; // end reached, not yet reported
+} ai_vad_t;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int ai_vad_init(ai_vad_t* vad, int sample_rate, int channels, int hangover_ms);
+void ai_vad_reset(ai_vad_t* vad);
+ai_vad_state_t ai_vad_process(ai_vad_t* vad, const char* data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAMEWORKS_AI_VAD_H_
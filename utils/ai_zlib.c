@@ -0,0 +1,163 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_zlib.c
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ai_common.h"
+#include "ai_zlib.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define AI_ZLIB_GZIP 16 // added to windowBits for a gzip wrapper
+#define AI_ZLIB_INFLATE_BITS 15 // the peer may use any window
+#define AI_ZLIB_DEFLATE_BITS 10 // 1K window, about 12K of deflate state
+#define AI_ZLIB_DEFLATE_MEMLEVEL 4
+#define AI_ZLIB_LEVEL 6
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static int ai_zlib_inflate_prepare(ai_zlib_t* zlib)
+{
+    if (zlib->inflate_ready)
+        return inflateReset(&zlib->inflate) == Z_OK ? 0 : -EINVAL;
+
+    memset(&zlib->inflate, 0, sizeof(zlib->inflate));
+    if (inflateInit2(&zlib->inflate, AI_ZLIB_INFLATE_BITS + AI_ZLIB_GZIP) != Z_OK)
+        return -ENOMEM;
+
+    zlib->inflate_ready = true;
+    return 0;
+}
+
+static int ai_zlib_deflate_prepare(ai_zlib_t* zlib)
+{
+    if (zlib->deflate_ready)
+        return deflateReset(&zlib->deflate) == Z_OK ? 0 : -EINVAL;
+
+    memset(&zlib->deflate, 0, sizeof(zlib->deflate));
+    if (deflateInit2(&zlib->deflate, AI_ZLIB_LEVEL, Z_DEFLATED,
+            AI_ZLIB_DEFLATE_BITS + AI_ZLIB_GZIP, AI_ZLIB_DEFLATE_MEMLEVEL,
+            Z_DEFAULT_STRATEGY)
+        != Z_OK)
+        return -ENOMEM;
+
+    zlib->deflate_ready = true;
+    return 0;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+void ai_zlib_init(ai_zlib_t* zlib)
+{
+    memset(zlib, 0, sizeof(ai_zlib_t));
+}
+
+void ai_zlib_release(ai_zlib_t* zlib)
+{
+    if (zlib->inflate_ready)
+        inflateEnd(&zlib->inflate);
+
+    if (zlib->deflate_ready)
+        deflateEnd(&zlib->deflate);
+
+    zlib->inflate_ready = false;
+    zlib->deflate_ready = false;
+}
+
+size_t ai_zlib_gunzip_size(const void* in, size_t in_len)
+{
+    const uint8_t* isize = (const uint8_t*)in + in_len - 4;
+
+    /* 10 byte header, at least an empty block and the 8 byte trailer */
+    if (in == NULL || in_len < 18)
+        return 0;
+
+    return (size_t)isize[0] | (size_t)isize[1] << 8
+        | (size_t)isize[2] << 16 | (size_t)isize[3] << 24;
+}
+
+ssize_t ai_zlib_gunzip(ai_zlib_t* zlib, const void* in, size_t in_len, void* out, size_t out_size)
+{
+    int ret;
+
+    if (zlib == NULL || in == NULL || out == NULL)
+        return -EINVAL;
+
+    ret = ai_zlib_inflate_prepare(zlib);
+    if (ret < 0)
+        return ret;
+
+    zlib->inflate.next_in = (Bytef*)in;
+    zlib->inflate.avail_in = in_len;
+    zlib->inflate.next_out = out;
+    zlib->inflate.avail_out = out_size;
+
+    ret = inflate(&zlib->inflate, Z_FINISH);
+    if (ret == Z_STREAM_END)
+        return out_size - zlib->inflate.avail_out;
+
+    if (ret == Z_BUF_ERROR && zlib->inflate.avail_out == 0)
+        return -ENOSPC;
+
+    AI_WARN("gunzip failed:%d %s", ret, zlib->inflate.msg ? zlib->inflate.msg : "");
+    return -EINVAL;
+}
+
+ssize_t ai_zlib_gzip(ai_zlib_t* zlib, const void* in, size_t in_len, void* out, size_t out_size)
+{
+    int ret;
+
+    if (zlib == NULL || in == NULL || out == NULL)
+        return -EINVAL;
+
+    ret = ai_zlib_deflate_prepare(zlib);
+    if (ret < 0)
+        return ret;
+
+    zlib->deflate.next_in = (Bytef*)in;
+    zlib->deflate.avail_in = in_len;
+    zlib->deflate.next_out = out;
+    zlib->deflate.avail_out = out_size;
+
+    ret = deflate(&zlib->deflate, Z_FINISH);
+    if (ret == Z_STREAM_END)
+        return out_size - zlib->deflate.avail_out;
+
+    return ret == Z_OK || ret == Z_BUF_ERROR ? -ENOSPC : -EINVAL;
+}
+
+size_t ai_zlib_gzip_bound(ai_zlib_t* zlib, size_t in_len)
+{
+    if (ai_zlib_deflate_prepare(zlib) < 0)
+        return 0;
+
+    return deflateBound(&zlib->deflate, in_len);
+}
@@ -0,0 +1,80 @@
+/****************************************************************************
+ * frameworks/ai/utils/ai_zlib.h
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.  The
+ * ASF licenses this file to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *
+ ****************************************************************************/
+#ifndef FRAMEWORKS_AI_ZLIB_H_
+#define FRAMEWORKS_AI_ZLIB_H_
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* gzip codec for self-contained protocol messages.
+ *
+ * Each call handles one complete gzip member. The z_streams are set up on
+ * first use and only reset between messages, so the window and state
+ * buffers are allocated once per codec instead of once per message. The
+ * deflate side uses a small window, request payloads are short JSON.
+ * A codec belongs to one thread. */
+
+typedef struct ai_zlib_s {
+    z_stream inflate;
+    z_stream deflate;
+    bool inflate_ready;
+    bool deflate_ready;
+} ai_zlib_t;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+void ai_zlib_init(ai_zlib_t* zlib);
+void ai_zlib_release(ai_zlib_t* zlib);
+
+/* Uncompressed size recorded in the gzip trailer, 0 if in is too short */
+
+size_t ai_zlib_gunzip_size(const void* in, size_t in_len);
+
+/* Both return the number of bytes written to out, -ENOSPC when out is
+ * too small and -EINVAL for malformed input. */
+
+ssize_t ai_zlib_gunzip(ai_zlib_t* zlib, const void* in, size_t in_len, void* out, size_t out_size);
+ssize_t ai_zlib_gzip(ai_zlib_t* zlib, const void* in, size_t in_len, void* out, size_t out_size);
+
+/* Worst case output of ai_zlib_gzip for in_len bytes */
+
+size_t ai_zlib_gzip_bound(ai_zlib_t* zlib, size_t in_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAMEWORKS_AI_ZLIB_H_